@@ -86,49 +86,48 @@ class CloudRenderEngine(bpy.types.RenderEngine):
 
 	def RenderScene(self, tile, index, total):
 		result = tile[4];
-		cl = np.zeros((tile[2]*tile[3],4)); #light sources
-		cs = cl.copy(); #environment
 
 		sc = int(ceil(self.samples_ext/self.samples_int)); #external sample count
 
 		dd = 0; #total accumulated sample count
+		da = tile[2]*tile[3]; #pixels still sampled (adaptive sampling)
 		for i in range(0,sc):
 			if self.test_break():
 				raise BreakException("Render aborted by user.");
 
-			self.update_stats("Path tracing tile ("+str(index)+"/"+str(total)+")",str(dd)+"/"+str(self.samples_ext)+" samples");
+			if da == 0:
+				break;
+
+			self.update_stats("Path tracing tile ("+str(index)+"/"+str(total)+")",str(dd)+"/"+str(self.samples_ext)+" samples, "+str(da)+" active pixels");
 			d1 = min(self.samples_ext-i*self.samples_int,self.samples_int);
 
+			#samples are accumulated by the engine, results are the averages over all passes of this tile
 			libdroplet.Render(tile[0],tile[1],tile[2],tile[3],d1);
 			while True:
 				qr = libdroplet.QueryResult(0);
 				if qr is not None:
 					break;
 
-			dd += d1;
-			cl += qr;
-			cs += libdroplet.QueryResult(1);
-			fd = 1.0/float(dd);
+			dd, da = libdroplet.QuerySamples();
+			cl = np.array(qr); #light sources
+			cs = np.array(libdroplet.QueryResult(1)); #environment
 
 			rpass = result.layers[self.layer].passes.find_by_type("COMBINED",result.views[0].name);
 			if rpass is not None:
-				rpass.rect = (cl+cs)*np.array([fd,fd,fd,0.5*fd]);
+				rpass.rect = (cl+cs)*np.array([1.0,1.0,1.0,0.5]);
 			rpass = result.layers[self.layer].passes.find_by_type("TRANSMISSION_DIRECT",result.views[0].name);
 			if rpass is not None:
-				rpass.rect = np.delete(cl,3,1)*fd;
+				rpass.rect = np.delete(cl,3,1);
 			rpass = result.layers[self.layer].passes.find_by_type("TRANSMISSION_INDIRECT",result.views[0].name);
 			if rpass is not None:
-				rpass.rect = np.delete(cs,3,1)*fd;
+				rpass.rect = np.delete(cs,3,1);
 
 			self.update_result(result);
 			self.update_progress(1.0-(total-index)/(total)+i/(sc*total));
 
 	def RenderShadow(self, tile, index, total):
 		result = tile[4];
-		cl = np.zeros((tile[2]*tile[3],4)); #light sources
-		cs = cl.copy(); #environment
 
-		dd = 0;
 		for i in range(0,1):
 			if self.test_break():
 				raise BreakException("Render aborted by user.");
@@ -142,13 +141,11 @@ class CloudRenderEngine(bpy.types.RenderEngine):
 				if qr is not None:
 					break;
 
-			dd += d1;
-			cl += qr;
-			fd = 1.0/float(dd);
+			cl = np.array(qr); #light sources
 
 			rpass = result.layers[self.layer].passes.find_by_type("SHADOW",result.views[0].name);
 			if rpass is not None:
-				rpass.rect = np.delete(cl,3,1)*fd;
+				rpass.rect = np.delete(cl,3,1);
 
 			self.update_result(result);
 			#self.update_progress(1.0-(total-index)/(total)+i/(sc*total));
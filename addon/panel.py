@@ -53,19 +53,35 @@ class ClRenderPanel(bpy.types.Panel):
 
 class ClSamplingProperties(bpy.types.PropertyGroup):
 	samples = IntProperty(name="Render",default=1000,min=1,description="Number of samples to be taken for each pixel.");
+	sampler = EnumProperty(name="Sampler",default="R",items=(
+		("R","Random","Independent random numbers for every decision."),
+		("S","Sobol","Owen-scrambled Sobol sequence for the first free-flight distances and the phase and light directions of the first few scattering orders. Converges faster, especially on the single-scattered sunlight.")));
+	threshold = FloatProperty(name="Noise threshold",default=0.0,min=0.0,max=1.0,precision=4,description="Adaptive sampling: stop sampling the pixels whose estimated relative error falls below this threshold, and give their samples to the noisier pixels. Zero disables adaptive sampling.");
 	scatterevs = IntProperty(name="Scattering",default=500,min=0,max=1000,description="Maximum volume scattering events. Recursivity is employed to compute the subsequent inscattering contributions. For large numbers stack size should be adequate to prevent overflows.");
+	cachedepth = IntProperty(name="Cache depth",default=0,min=0,max=1000,description="Radiance cache: scattering events traced before the path is terminated with the in-scattered radiance cached at the leaf corners. The cache is filled by a pre-pass before rendering. Smaller depths are faster but blur the multiple scattering. Zero disables the cache.");
+	cachesamples = IntProperty(name="Cache samples",default=4096,min=32,max=65536,description="Radiance cache: maximum paths traced for each cache point. The points stop sampling once their estimated relative error falls below 2%. Dense media need more samples; a warning is printed if many points don't converge, in which case the terminated paths are biased.");
+	rrdepth = IntProperty(name="Roulette depth",default=0,min=0,max=1000,description="Scattering events after which the paths are terminated randomly in proportion to their throughput (Russian roulette). Unbiased, but mostly effective with noticeable absorption. Zero disables the roulette.");
+	splits = IntProperty(name="Splitting",default=1,min=1,max=64,description="Light samples and continuation paths traced from the first scattering event of each camera ray. Amortizes the primary traversal over several paths.");
 	msigmas = FloatProperty(name="Sigma.S",default=80.0,min=0.001,description="Macroscopic scattering cross section for maximum density.");
 	msigmaa = FloatProperty(name="Sigma.A",default=0.001,min=0.001,description="Macroscopic absorption cross section for maximum density.");
 	phasef = EnumProperty(name="Phase function",default="M",items=(
 		("H","Henyey-Greenstein","Henyey-Greenstein phase function. A fast approximation with plausible results."),
 		("M","Mie","Precomputed RGB Mie phase function for typical cloud droplets. Being the most accurate this is also the most inefficient due to partly unvectorized table lookups. Note that spectral rendering is required to correctly sample for different wavelengths, although in case of Mie the dispersion is small enough to be approximated without separating the RGB channels.")));
 	phasea = FloatProperty(name="Anisotropy",default=0.75,description="Anisotropy parameter 'g' for the Henyey-Greenstein phase function.");
+	integrator = EnumProperty(name="Integrator",default="R",items=(
+		("R","Recursive","Recurse at every scattering event. Paths of the same packet are traced together, so a single long path keeps the whole packet busy."),
+		("W","Wavefront","Queue the paths and process them in stages, regrouping the active paths into full packets after each stage. Faster on scenes with many scattering events. Surface occlusion is not supported."),
+		("O","Octaves","Approximate the multiple scattering with octaves of single scattering of decreasing extinction, contribution and anisotropy. Costs one light and one sky ray per pixel sample regardless of the scattering events. Fast previews for lighting, but not physically accurate.")));
+	octaves = IntProperty(name="Octaves",default=4,min=1,max=16,description="Number of single scattering octaves, each with half the extinction, contribution and anisotropy of the previous one.");
+	suncache = BoolProperty(name="Sun cache",default=False,description="Bake the transmittance toward the suns into a grid before rendering, and look it up instead of tracing a light ray at every scattering event. Much faster per sample but approximate: the grid is finite and the sun disk is reduced to its central direction. Surface occlusion is not supported.");
 
 	def draw(self, context, layout):
 		s = layout.split();
 		c = s.column();
 		c.row().label("Samples:");
 		c.row().prop(self,"samples");
+		c.row().prop(self,"sampler");
+		c.row().prop(self,"threshold");
 		#seed, default 1000
 		c.row().label("Light transport:");
 		c.row().prop(self,"msigmas");
@@ -74,6 +90,15 @@ class ClSamplingProperties(bpy.types.PropertyGroup):
 		c = s.column();
 		c.row().label("Path tracing:");
 		c.row().prop(self,"scatterevs");
+		c.row().prop(self,"cachedepth");
+		if self.cachedepth > 0:
+			c.row().prop(self,"cachesamples");
+		c.row().prop(self,"rrdepth");
+		c.row().prop(self,"splits");
+		c.row().prop(self,"integrator");
+		if self.integrator == "O":
+			c.row().prop(self,"octaves");
+		c.row().prop(self,"suncache");
 
 		c.row().label("Phase function:");
 		c.row().prop(self,"phasef");
@@ -133,6 +158,9 @@ class ClPerformanceProperties(bpy.types.PropertyGroup):
 	cachelayer = IntProperty(name="Layer",default=10,min=0,max=19,description="Objects in this scene layer are read from the cache, or written to it if the cache doesn't exist. Remove the object from this layer to reconstruct the cache, or manually delete the cache files.");
 	cachedir = StringProperty(name="Path",subtype="DIR_PATH",default="/tmp/",description="Location for the VDB cache.");
 	samples = IntProperty(name="Int.Samples",default=100,min=1,description="Maximum number of samples taken internally by the render engine before returning to update the render result. Higher number of internal samples results in slightly faster render times, but also increases the interval between visual updates.");
+	traversal = EnumProperty(name="Traversal",default="O",items=(
+		("O","Octree","Traverse the octree top-down for every ray, restarting the secondary rays from the scattering leaf."),
+		("H","HDDA","Step through a shallow VDB-like grid of the octree leaves with a hierarchical DDA. Faster on deep octrees, at the cost of a grid built before rendering. Applies to the secondary and light rays; falls back to the octree if the leaves are not at a single depth.")));
 
 	def draw(self, context, layout):
 		s = layout.split();
@@ -142,6 +170,8 @@ class ClPerformanceProperties(bpy.types.PropertyGroup):
 		c.row().prop(self,"tiley");
 		c.row().label("Internal sampling:");
 		c.row().prop(self,"samples");
+		c.row().label("Ray traversal:");
+		c.row().prop(self,"traversal");
 
 		c = s.column();
 		c.row().label("Caching:");#,icon="FILE");
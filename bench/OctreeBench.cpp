@@ -0,0 +1,166 @@
+#include "main.h"
+#include "scene.h"
+#include "KernelOctree.h"
+
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+
+//Octree traversal benchmark: the single-ray step traverser against the packet traverser and the HDDA through the
+//VDB-like grid. The octree is a spherical shell of leaves, and the rays start from small clusters on the shell, similar
+//to the light and secondary rays of the neighbouring pixels.
+//Built with -DBUILD_BENCHMARKS=1. usage: octree-bench [depth] [packets] [spread]
+
+#define SHELL_RADIUS 0.6f
+#define SHELL_WIDTH 0.1f
+#define CHECKSUM_TOLERANCE 1e-5 //relative
+
+static void BuildShell(tbb::concurrent_vector<OctreeStructure> *pob, uint n, uint l, uint depth, uint *pleafc){
+	dfloat4 ce = (*pob)[n].ce;
+	float r = sqrtf(ce.x*ce.x+ce.y*ce.y+ce.z*ce.z);
+	if(fabsf(r-SHELL_RADIUS) > SHELL_WIDTH+ce.w*sqrtf(3.0f))
+		return;
+	if(l == depth){
+		(*pob)[n].volx[VOLUME_BUFFER_FOG] = (*pleafc)++;
+		return;
+	}
+	for(uint i = 0; i < 8; ++i){
+		uint c = pob->size();
+		pob->grow_by(1);
+		(*pob)[n].chn[i] = c;
+		float e = 0.5f*ce.w;
+		(*pob)[c].ce = dfloat4(ce.x+(i&1?e:-e),ce.y+(i&2?e:-e),ce.z+(i&4?e:-e),e);
+		BuildShell(pob,c,l+1,depth,pleafc);
+	}
+}
+
+enum RAYS{
+	RAYS_LIGHT, //common direction
+	RAYS_FORWARD, //forward scattered, within a cone around the packet direction
+	RAYS_ISOTROPIC, //isotropically scattered
+	RAYS_COUNT
+};
+
+struct Packet{
+	sfloat4 ro;
+	sfloat4 rd;
+};
+
+static dfloat3 RandomDirection(std::mt19937 &rng){
+	std::uniform_real_distribution<float> u(0.0f,1.0f);
+	float z = 1.0f-2.0f*u(rng);
+	float r = sqrtf(std::max(1.0f-z*z,0.0f));
+	float p = 2.0f*3.14159265f*u(rng);
+	return dfloat3(r*cosf(p),r*sinf(p),z);
+}
+
+static void GeneratePackets(RAYS type, uint count, float spread, std::vector<Packet> *pps){
+	std::mt19937 rng(1+type);
+	std::uniform_real_distribution<float> u(-1.0f,1.0f);
+	dfloat3 ld = RandomDirection(rng);
+	for(uint i = 0; i < count; ++i){
+		dfloat3 c = RandomDirection(rng);
+		dfloat3 pd = RandomDirection(rng);
+		dfloatN RO[3], RD[3];
+		for(uint j = 0; j < BLCLOUD_VSIZE; ++j){
+			RO[0].v[j] = SHELL_RADIUS*c.x+spread*u(rng);
+			RO[1].v[j] = SHELL_RADIUS*c.y+spread*u(rng);
+			RO[2].v[j] = SHELL_RADIUS*c.z+spread*u(rng);
+			dfloat3 d;
+			if(type == RAYS_LIGHT)
+				d = ld;
+			else if(type == RAYS_FORWARD){
+				d = dfloat3(pd.x+0.3f*u(rng),pd.y+0.3f*u(rng),pd.z+0.3f*u(rng));
+				float s = 1.0f/sqrtf(d.x*d.x+d.y*d.y+d.z*d.z);
+				d = dfloat3(s*d.x,s*d.y,s*d.z);
+			}else d = RandomDirection(rng);
+			RD[0].v[j] = d.x;
+			RD[1].v[j] = d.y;
+			RD[2].v[j] = d.z;
+		}
+		Packet p;
+		for(uint j = 0; j < 3; ++j){
+			p.ro.v[j] = sfloat1::load(&RO[j]);
+			p.rd.v[j] = sfloat1::load(&RD[j]);
+		}
+		p.ro.v[3] = sfloat1::one();
+		p.rd.v[3] = sfloat1::zero();
+		pps->push_back(p);
+	}
+}
+
+//Traverse all the packets to the end. Returns the time in seconds, and the number of leaves and a checksum of them.
+//The checksum is weighted by the leaf lengths in front of the origin, since the traversers may disagree on the
+//near-zero-length leaves (the ray grazing an edge or a corner).
+static double Traverse(KernelOctree::BaseOctreeTraverser *ptrv, const std::vector<Packet> &ps, const OctreeNode *pob, uint64_t *pleafc, double *psum){
+	*pleafc = 0;
+	*psum = 0.0;
+	auto t0 = std::chrono::high_resolution_clock::now();
+	for(uint i = 0; i < ps.size(); ++i){
+		ptrv->Initialize(ps[i].ro,ps[i].rd,sint1::trueI(),pob);
+		for(uint k = 0;; ++k){
+			duintN nodes;
+			sfloat1 tr0, tr1;
+			dintN mask = ptrv->GetLeaf(k,&nodes,tr0,tr1);
+			dfloatN TR0, TR1;
+			sfloat1::store(&TR0,tr0);
+			sfloat1::store(&TR1,tr1);
+			uint c = 0;
+			for(uint j = 0; j < BLCLOUD_VSIZE; ++j)
+				if(mask.v[j] != 0){
+					++c;
+					float t = TR1.v[j]-std::max(TR0.v[j],0.0f);
+					if(t > 0.0f){
+						*psum += (double)t*(nodes.v[j]+1)*(j+1);
+						++*pleafc;
+					}
+				}
+			if(c == 0)
+				break;
+		}
+	}
+	auto t1 = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration<double>(t1-t0).count();
+}
+
+int main(int argc, char **argv){
+	uint depth = argc > 1?atoi(argv[1]):7;
+	uint packets = argc > 2?atoi(argv[2]):20000;
+	float spread = argc > 3?atof(argv[3]):0.02f;
+	const uint reps = 5;
+
+	Scene scene;
+	scene.ob.grow_by(1);
+	scene.ob[0].ce = dfloat4(0.0f,0.0f,0.0f,1.0f);
+	uint leafc = 0;
+	BuildShell(&scene.ob,0,0,depth,&leafc);
+	scene.FreezeOctree();
+	printf("Octree: depth %u, %u nodes, %u leaves. %u packets of %u rays, origin spread %f.\n",depth,scene.nodec,scene.leafc,packets,BLCLOUD_VSIZE,spread);
+
+	KernelOctree::OctreeHDDAGrid grid;
+	grid.Initialize(scene.pnodes,scene.nodec);
+
+	static const char *pnames[] = {"light","forward","isotropic"};
+	for(uint i = 0; i < RAYS_COUNT; ++i){
+		std::vector<Packet> ps;
+		GeneratePackets((RAYS)i,packets,spread,&ps);
+
+		KernelOctree::OctreeStepTraverser steptrv;
+		KernelOctree::OctreePacketTraverser packettrv;
+		KernelOctree::OctreeHDDATraverser hddatrv(&grid);
+		double ts = 1e10, tp = 1e10, th = 1e10;
+		uint64_t sc, pc, hc;
+		double ss, psum, hsum;
+		for(uint r = 0; r < reps; ++r){
+			ts = std::min(ts,Traverse(&steptrv,ps,scene.pnodes,&sc,&ss));
+			tp = std::min(tp,Traverse(&packettrv,ps,scene.pnodes,&pc,&psum));
+			th = std::min(th,Traverse(&hddatrv,ps,scene.pnodes,&hc,&hsum));
+		}
+		double rays = (double)packets*BLCLOUD_VSIZE;
+		printf("%-10s step %7.2f Mrays/s, packet %7.2f Mrays/s (%.2fx)%s, hdda %7.2f Mrays/s (%.2fx)%s, %.1f leaves/ray\n",pnames[i],
+			rays/ts*1e-6,rays/tp*1e-6,ts/tp,fabs(ss-psum) > CHECKSUM_TOLERANCE*ss?" MISMATCH":"",rays/th*1e-6,ts/th,fabs(ss-hsum) > CHECKSUM_TOLERANCE*ss?" MISMATCH":"",(double)sc/rays);
+	}
+
+	return 0;
+}
@@ -3,6 +3,9 @@
 #include "kernel.h"
 #include "KernelOctree.h"
 
+#include <cfloat>
+#include <cmath>
+
 namespace KernelOctree{
 
 //http://citeseerx.ist.psu.edu/viewdoc/summary?doi=10.1.1.29.987
@@ -75,8 +78,8 @@ static uint OctreeNextNode(const dfloat3 &tm, const duint3 &xyz){
 	//should be okay with coherent rays
 }*/
 
-static void OctreeInitialize(const float4 &ro, const float4 &rd, const tbb::concurrent_vector<OctreeStructure> *pob, dfloat3 &t0s, dfloat3 &t1s, uint &a){
-	float4 ce = float4::load(&(*pob)[0].ce);
+static void OctreeInitialize(const float4 &ro, const float4 &rd, const OctreeNode *pob, dfloat3 &t0s, dfloat3 &t1s, uint &a){
+	float4 ce = float4::load(&pob[0].ce);
 	float4 ro1 = ro-ce+ce.splat<3>();
 	float4 rd1 = rd;
 	float4 scaabbmin = float4::zero();
@@ -87,17 +90,17 @@ static void OctreeInitialize(const float4 &ro, const float4 &rd, const tbb::conc
 
 	a = 0;
 	if(rds.x < 0.0f){
-		ros.x = 2.0f*(*pob)[0].ce.w-ros.x;
+		ros.x = 2.0f*pob[0].ce.w-ros.x;
 		rds.x = -rds.x;
 		a |= 4;
 	}
 	if(rds.y < 0.0f){
-		ros.y = 2.0f*(*pob)[0].ce.w-ros.y;
+		ros.y = 2.0f*pob[0].ce.w-ros.y;
 		rds.y = -rds.y;
 		a |= 2;
 	}
 	if(rds.z < 0.0f){
-		ros.z = 2.0f*(*pob)[0].ce.w-ros.z;
+		ros.z = 2.0f*pob[0].ce.w-ros.z;
 		rds.z = -rds.z;
 		a |= 1;
 	}
@@ -117,6 +120,33 @@ BaseOctreeTraverser::~BaseOctreeTraverser(){
 	//
 }
 
+void BaseOctreeTraverser::Initialize(const sfloat4 &ro, const sfloat4 &rd, const sint1 &gm, const OctreeNode *_pob, const dintN &nodes, const uint *pparent){
+	Initialize(ro,rd,gm,_pob);
+}
+
+OctreeLeafArena::OctreeLeafArena() : size(0), x0(0), y0(0), tilex(0), tiley(0){
+	//
+}
+
+OctreeLeafArena::~OctreeLeafArena(){
+	//
+}
+
+//Discard the lists if the tile changes.
+void OctreeLeafArena::Reset(uint _x0, uint _y0, uint _tilex, uint _tiley){
+	if(_x0 == x0 && _y0 == y0 && _tilex == tilex && _tiley == tiley)
+		return;
+	x0 = _x0;
+	y0 = _y0;
+	tilex = _tilex;
+	tiley = _tiley;
+	pks.clear();
+	pks.resize(((tilex+BLCLOUD_VX-1)/BLCLOUD_VX)*((tiley+BLCLOUD_VY-1)/BLCLOUD_VY));
+	for(uint i = 0; i < pks.size(); ++i)
+		pks[i].mask = 0;
+	size = 0;
+}
+
 OctreeFullTraverser::OctreeFullTraverser(){
 	//
 }
@@ -125,10 +155,12 @@ OctreeFullTraverser::~OctreeFullTraverser(){
 	//
 }
 
-void OctreeFullTraverser::Initialize(const sfloat4 &ro, const sfloat4 &rd, const sint1 &gm, const tbb::concurrent_vector<OctreeStructure> *_pob){
+void OctreeFullTraverser::Initialize(const sfloat4 &ro, const sfloat4 &rd, const sint1 &gm, const OctreeNode *_pob){
 	pob = _pob;
 	for(uint i = 0, a; i < BLCLOUD_VSIZE; ++i){
 		ls[i].clear();
+		pls[i] = ls[i].data();
+		lc[i] = 0;
 		if(((int*)&gm.v)[i] == 0)
 			continue;
 
@@ -136,6 +168,44 @@ void OctreeFullTraverser::Initialize(const sfloat4 &ro, const sfloat4 &rd, const
 		OctreeInitialize(ro.get(i),rd.get(i),pob,t0s,t1s,a);
 		if(std::max(std::max(t0s.x,t0s.y),t0s.z) < std::min(std::min(t1s.x,t1s.y),t1s.z))
 			OctreeProcessSubtree(t0s,t1s,a,0,0,&ls[i]);
+		pls[i] = ls[i].data();
+		lc[i] = ls[i].size();
+	}
+}
+
+//Initialize with the stored lists of packet p. On the first pass the lists are traversed and stored to the arena.
+void OctreeFullTraverser::Initialize(const sfloat4 &ro, const sfloat4 &rd, const sint1 &gm, const OctreeNode *_pob, OctreeLeafArena *parena, uint p){
+	OctreeLeafArena::Packet &pk = parena->pks[p];
+	int mask = 0;
+	for(uint i = 0; i < BLCLOUD_VSIZE; ++i)
+		if(((int*)&gm.v)[i] != 0)
+			mask |= 1<<i;
+	if((pk.mask & mask) != mask){
+		Initialize(ro,rd,gm,_pob);
+		size_t n = 0;
+		for(uint i = 0; i < BLCLOUD_VSIZE; ++i)
+			n += ls[i].size();
+		parena->size -= pk.ls.size();
+		if(parena->size.fetch_add(n)+n > LEAF_ARENA_MAX_SIZE/sizeof(Node)){
+			parena->size -= n;
+			pk.ls.clear();
+			pk.ls.shrink_to_fit();
+			pk.mask = 0;
+			return;
+		}
+		pk.ls.clear();
+		pk.ls.reserve(n);
+		for(uint i = 0; i < BLCLOUD_VSIZE; ++i){
+			pk.offs[i] = pk.ls.size();
+			pk.ls.insert(pk.ls.end(),ls[i].begin(),ls[i].end());
+		}
+		pk.offs[BLCLOUD_VSIZE] = pk.ls.size();
+		pk.mask = mask;
+	}
+	pob = _pob;
+	for(uint i = 0; i < BLCLOUD_VSIZE; ++i){
+		pls[i] = pk.ls.data()+pk.offs[i];
+		lc[i] = mask & (1<<i)?pk.offs[i+1]-pk.offs[i]:0;
 	}
 }
 
@@ -145,7 +215,7 @@ void OctreeFullTraverser::OctreeProcessSubtree(const dfloat3 &t0, const dfloat3
 	if(t1.x < 0.0f || t1.y < 0.0f || t1.z < 0.0f || (n == 0 && l > 0))
 		return;
 
-	if((*pob)[n].volx[VOLUME_BUFFER_SDF] != ~0u || (*pob)[n].volx[VOLUME_BUFFER_FOG] != ~0u){
+	if(pob[n].leaf != ~0u){
 		float tr0 = std::max(std::max(t0.x,t0.y),t0.z);
 		float tr1 = std::min(std::min(t1.x,t1.y),t1.z);
 		pls->push_back(Node(n,tr0,tr1));
@@ -164,35 +234,35 @@ void OctreeFullTraverser::OctreeProcessSubtree(const dfloat3 &t0, const dfloat3
 		static const uint nla[] = {0,4,2,6,1,5,3,7};
 		switch(tn){
 		case 0:
-			OctreeProcessSubtree(t0,tm,a,(*pob)[n].chn[nla[a]],l+1,pls);
+			OctreeProcessSubtree(t0,tm,a,pob[n].Child(nla[a]),l+1,pls);
 			tn = OctreeNextNode(tm,duint3(4,2,1));
 			break;
 		case 1:
-			OctreeProcessSubtree(dfloat3(t0.x,t0.y,tm.z),dfloat3(tm.x,tm.y,t1.z),a,(*pob)[n].chn[nla[1^a]],l+1,pls);
+			OctreeProcessSubtree(dfloat3(t0.x,t0.y,tm.z),dfloat3(tm.x,tm.y,t1.z),a,pob[n].Child(nla[1^a]),l+1,pls);
 			tn = OctreeNextNode(dfloat3(tm.x,tm.y,t1.z),duint3(5,3,8));
 			break;
 		case 2:
-			OctreeProcessSubtree(dfloat3(t0.x,tm.y,t0.z),dfloat3(tm.x,t1.y,tm.z),a,(*pob)[n].chn[nla[2^a]],l+1,pls);
+			OctreeProcessSubtree(dfloat3(t0.x,tm.y,t0.z),dfloat3(tm.x,t1.y,tm.z),a,pob[n].Child(nla[2^a]),l+1,pls);
 			tn = OctreeNextNode(dfloat3(tm.x,t1.y,tm.z),duint3(6,8,3));
 			break;
 		case 3:
-			OctreeProcessSubtree(dfloat3(t0.x,tm.y,tm.z),dfloat3(tm.x,t1.y,t1.z),a,(*pob)[n].chn[nla[3^a]],l+1,pls);
+			OctreeProcessSubtree(dfloat3(t0.x,tm.y,tm.z),dfloat3(tm.x,t1.y,t1.z),a,pob[n].Child(nla[3^a]),l+1,pls);
 			tn = OctreeNextNode(dfloat3(tm.x,t1.y,t1.z),duint3(7,8,8));
 			break;
 		case 4:
-			OctreeProcessSubtree(dfloat3(tm.x,t0.y,t0.z),dfloat3(t1.x,tm.y,tm.z),a,(*pob)[n].chn[nla[4^a]],l+1,pls);
+			OctreeProcessSubtree(dfloat3(tm.x,t0.y,t0.z),dfloat3(t1.x,tm.y,tm.z),a,pob[n].Child(nla[4^a]),l+1,pls);
 			tn = OctreeNextNode(dfloat3(t1.x,tm.y,tm.z),duint3(8,6,5));
 			break;
 		case 5:
-			OctreeProcessSubtree(dfloat3(tm.x,t0.y,tm.z),dfloat3(t1.x,tm.y,t1.z),a,(*pob)[n].chn[nla[5^a]],l+1,pls);
+			OctreeProcessSubtree(dfloat3(tm.x,t0.y,tm.z),dfloat3(t1.x,tm.y,t1.z),a,pob[n].Child(nla[5^a]),l+1,pls);
 			tn = OctreeNextNode(dfloat3(t1.x,tm.y,t1.z),duint3(8,7,8));
 			break;
 		case 6:
-			OctreeProcessSubtree(dfloat3(tm.x,tm.y,t0.z),dfloat3(t1.x,t1.y,tm.z),a,(*pob)[n].chn[nla[6^a]],l+1,pls);
+			OctreeProcessSubtree(dfloat3(tm.x,tm.y,t0.z),dfloat3(t1.x,t1.y,tm.z),a,pob[n].Child(nla[6^a]),l+1,pls);
 			tn = OctreeNextNode(dfloat3(t1.x,t1.y,tm.z),duint3(8,8,7));
 			break;
 		case 7:
-			OctreeProcessSubtree(dfloat3(tm.x,tm.y,tm.z),dfloat3(t1.x,t1.y,t1.z),a,(*pob)[n].chn[nla[7^a]],l+1,pls);
+			OctreeProcessSubtree(dfloat3(tm.x,tm.y,tm.z),dfloat3(t1.x,t1.y,t1.z),a,pob[n].Child(nla[7^a]),l+1,pls);
 			tn = 8;
 			break;
 		}
@@ -200,16 +270,21 @@ void OctreeFullTraverser::OctreeProcessSubtree(const dfloat3 &t0, const dfloat3
 }
 
 dintN OctreeFullTraverser::GetLeaf(uint i, duintN *pnodes, sfloat1 &tr0, sfloat1 &tr1){
+	return GetLeaf(duintN(i),pnodes,tr0,tr1);
+}
+
+dintN OctreeFullTraverser::GetLeaf(const duintN &li, duintN *pnodes, sfloat1 &tr0, sfloat1 &tr1){
 	dintN mask;
 	dfloatN TR0, TR1;
 	for(uint j = 0; j < BLCLOUD_VSIZE; ++j){
-		if(i >= ls[j].size()){
+		uint i = li.v[j];
+		if(i >= lc[j]){
 			mask.v[j] = 0;
 			continue;
 		}
-		pnodes->v[j] = std::get<0>(ls[j][i]);
-		TR0.v[j] = std::get<1>(ls[j][i]);
-		TR1.v[j] = std::get<2>(ls[j][i]);
+		pnodes->v[j] = std::get<0>(pls[j][i]);
+		TR0.v[j] = std::get<1>(pls[j][i]);
+		TR1.v[j] = std::get<2>(pls[j][i]);
 		mask.v[j] = -1;
 	}
 	tr0 = sfloat1::load(&TR0);
@@ -227,7 +302,7 @@ OctreeStepTraverser::~OctreeStepTraverser(){
 	//
 }
 
-void OctreeStepTraverser::Initialize(const sfloat4 &ro, const sfloat4 &rd, const sint1 &gm, const tbb::concurrent_vector<OctreeStructure> *_pob){
+void OctreeStepTraverser::Initialize(const sfloat4 &ro, const sfloat4 &rd, const sint1 &gm, const OctreeNode *_pob){
 	pob = _pob;
 	for(uint i = 0; i < BLCLOUD_VSIZE; ++i){
 		mask.v[i] = 0;
@@ -238,12 +313,62 @@ void OctreeStepTraverser::Initialize(const sfloat4 &ro, const sfloat4 &rd, const
 		if(std::max(std::max(stack[i].t0[0].x,stack[i].t0[0].y),stack[i].t0[0].z) < std::min(std::min(stack[i].t1[0].x,stack[i].t1[0].y),stack[i].t1[0].z)){
 			mask.v[i] = -1;
 			stack[i].l = 0;
+			stack[i].b = 0;
 			stack[i].n[0] = 0;
 			stack[i].p[0] = false;
 		}
 	}
 }
 
+//Ray interval of the node n, interpolated from the root interval (level 0 of the stack) in the mirrored space.
+static void OctreeNodeInterval(const OctreeNode *pob, uint n, uint a, const dfloat3 &rt0, const dfloat3 &rt1, dfloat3 &t0, dfloat3 &t1){
+	const dfloat4 &rce = pob[0].ce;
+	const dfloat4 &ce = pob[n].ce;
+	float s = 0.5f/rce.w;
+	//low corner of the node relative to the root, in units of the root size
+	float fx = (ce.x-ce.w-rce.x+rce.w)*s, fy = (ce.y-ce.w-rce.y+rce.w)*s, fz = (ce.z-ce.w-rce.z+rce.w)*s;
+	float fw = 2.0f*ce.w*s;
+	if(a & 4)
+		fx = 1.0f-fx-fw;
+	if(a & 2)
+		fy = 1.0f-fy-fw;
+	if(a & 1)
+		fz = 1.0f-fz-fw;
+	t0 = dfloat3(rt0.x+(rt1.x-rt0.x)*fx,rt0.y+(rt1.y-rt0.y)*fy,rt0.z+(rt1.z-rt0.z)*fz);
+	t1 = dfloat3(rt0.x+(rt1.x-rt0.x)*(fx+fw),rt0.y+(rt1.y-rt0.y)*(fy+fw),rt0.z+(rt1.z-rt0.z)*(fz+fw));
+}
+
+//Restart the traversal from the nodes (0 if unknown) of the previous rays, usually the leaves where they scattered.
+//Each lane starts from the deepest ancestor of its node containing the origin ro, instead of descending from the
+//root. The levels above it are restored one at a time through the parent links as the ray leaves them, so the short
+//secondary walks often never climb back to the root.
+void OctreeStepTraverser::Initialize(const sfloat4 &ro, const sfloat4 &rd, const sint1 &gm, const OctreeNode *_pob, const dintN &nodes, const uint *_pparent){
+	Initialize(ro,rd,gm,_pob);
+	pparent = _pparent;
+	int re = std::ilogb(pob[0].ce.w); //node depth from the extent exponent
+	for(uint i = 0; i < BLCLOUD_VSIZE; ++i){
+		if(mask.v[i] == 0 || nodes.v[i] == 0)
+			continue;
+		float4 p = ro.get(i);
+		dfloat3 pc = dfloat3(p);
+		uint n = nodes.v[i];
+		for(; n != 0; n = pparent[n]){
+			const dfloat4 &ce = pob[n].ce;
+			if(fabsf(pc.x-ce.x) <= ce.w && fabsf(pc.y-ce.y) <= ce.w && fabsf(pc.z-ce.z) <= ce.w)
+				break;
+		}
+		uint l = re-std::ilogb(pob[n].ce.w);
+		if(n == 0 || l >= sizeof(stack[i].n)/sizeof(stack[i].n[0]))
+			continue;
+		Stack &s = stack[i];
+		OctreeNodeInterval(pob,n,s.a,s.t0[0],s.t1[0],s.t0[l],s.t1[l]);
+		s.l = l;
+		s.b = l;
+		s.n[l] = n;
+		s.p[l] = false;
+	}
+}
+
 dintN OctreeStepTraverser::GetLeaf(uint i, duintN *pnodes, sfloat1 &tr0, sfloat1 &tr1){
 	//Only sequential traversal is supported. Index is ignored here,
 	dfloatN TR0, TR1;
@@ -251,7 +376,10 @@ dintN OctreeStepTraverser::GetLeaf(uint i, duintN *pnodes, sfloat1 &tr0, sfloat1
 		if(mask.v[j] == 0)
 			continue;
 		Node node;
-		if(!OctreeProcessSubtree(stack[j].t0,stack[j].t1,stack[j].tm,stack[j].tn,stack[j].n,stack[j].p,stack[j].l,stack[j].a,&node)){
+		Stack &s = stack[j];
+		bool r;
+		while(!(r = OctreeProcessSubtree(s.t0,s.t1,s.tm,s.tn,s.n,s.p,s.l,s.a,s.b,&node)) && OctreeRestoreParent(s));
+		if(!r){
 			mask.v[j] = 0;
 			continue;
 		}
@@ -265,8 +393,34 @@ dintN OctreeStepTraverser::GetLeaf(uint i, duintN *pnodes, sfloat1 &tr0, sfloat1
 	return mask;
 }
 
-//Use a stack-saving iterative algorithm when only partial traversal is required
-bool OctreeStepTraverser::OctreeProcessSubtree(dfloat3 *pt0, dfloat3 *pt1, dfloat3 *ptm, uint *ptn, uint *pn, bool *pp, uint &l, uint a, Node *pnode){
+//Restore the level above the restart node of a lane (s.b), as if the traversal had descended from there, once the
+//walk has left the node. Returns false if the root was already reached.
+bool OctreeStepTraverser::OctreeRestoreParent(Stack &s){
+	if(s.b == 0)
+		return false;
+	static const uint nla[] = {0,4,2,6,1,5,3,7};
+	static const duint3 nq[] = {duint3(4,2,1),duint3(5,3,8),duint3(6,8,3),duint3(7,8,8),duint3(8,6,5),duint3(8,7,8),duint3(8,8,7),duint3(8,8,8)};
+	uint c = s.n[s.b];
+	uint n = pparent[c];
+	uint k = 0;
+	for(; pob[n].Child(k) != c; ++k);
+	uint l = --s.b;
+	if(n != 0) //the root interval is kept at level 0
+		OctreeNodeInterval(pob,n,s.a,s.t0[0],s.t1[0],s.t0[l],s.t1[l]);
+	s.tm[l] = dfloat3(
+		0.5f*(s.t0[l].x+s.t1[l].x),
+		0.5f*(s.t0[l].y+s.t1[l].y),
+		0.5f*(s.t0[l].z+s.t1[l].z));
+	s.tn[l] = OctreeNextNode(s.t1[l+1],nq[nla[k]^s.a]); //next after the child being left
+	s.n[l] = n;
+	s.p[l] = true;
+	s.l = l;
+	return true;
+}
+
+//Use a stack-saving iterative algorithm when only partial traversal is required. The walk ends when the level b is
+//left, the levels above it are restored by the caller.
+bool OctreeStepTraverser::OctreeProcessSubtree(dfloat3 *pt0, dfloat3 *pt1, dfloat3 *ptm, uint *ptn, uint *pn, bool *pp, uint &l, uint a, uint b, Node *pnode){
 	for(;;){
 		if(pp[l]){
 			static const uint nla[] = {0,4,2,6,1,5,3,7};
@@ -275,13 +429,13 @@ bool OctreeStepTraverser::OctreeProcessSubtree(dfloat3 *pt0, dfloat3 *pt1, dfloa
 	pt0[l+1] = t0n;\
 	pt1[l+1] = t1n;\
 	ptn[l] = OctreeNextNode(pt1[l+1],q);\
-	pn[l+1] = (*pob)[pn[l]].chn[nla[x^a]];\
+	pn[l+1] = pob[pn[l]].Child(nla[x^a]);\
 	pp[++l] = false;
 			case 0:
 				pt0[l+1] = pt0[l];
 				pt1[l+1] = ptm[l];
 				ptn[l] = OctreeNextNode(ptm[l],duint3(4,2,1));
-				pn[l+1] = (*pob)[pn[l]].chn[nla[a]];
+				pn[l+1] = pob[pn[l]].Child(nla[a]);
 				pp[++l] = false;
 				break;
 			case 1:
@@ -312,28 +466,31 @@ bool OctreeStepTraverser::OctreeProcessSubtree(dfloat3 *pt0, dfloat3 *pt1, dfloa
 				pt0[l+1] = dfloat3(ptm[l].x,ptm[l].y,ptm[l].z);
 				pt1[l+1] = dfloat3(pt1[l].x,pt1[l].y,pt1[l].z);
 				ptn[l] = 8;
-				pn[l+1] = (*pob)[pn[l]].chn[nla[7^a]];
+				pn[l+1] = pob[pn[l]].Child(nla[7^a]);
 				pp[++l] = false;
 				break;
 			default:
-				if(l == 0)
+				if(l == b)
 					return false;
 				--l;
 				break;
 			}
 		}else{
 			if(pt1[l].x < 0.0f || pt1[l].y < 0.0f || pt1[l].z < 0.0f || (pn[l] == 0 && l > 0)){
-				if(l == 0)
+				if(l == b)
 					return false;
 				--l;
 				continue;
 			}
 
-			if((*pob)[pn[l]].volx[VOLUME_BUFFER_SDF] != ~0u || (*pob)[pn[l]].volx[VOLUME_BUFFER_FOG] != ~0u){
+			if(pob[pn[l]].leaf != ~0u){
 				float tr0 = std::max(std::max(pt0[l].x,pt0[l].y),pt0[l].z);
 				float tr1 = std::min(std::min(pt1[l].x,pt1[l].y),pt1[l].z);
 				*pnode = Node(pn[l],tr0,tr1);
-				--l;
+				if(l == b){
+					pp[l] = true; //the restart node itself is a leaf, done on the next call
+					ptn[l] = 8;
+				}else --l;
 				return true; //continue;
 			}
 
@@ -348,4 +505,399 @@ bool OctreeStepTraverser::OctreeProcessSubtree(dfloat3 *pt0, dfloat3 *pt1, dfloa
 	}
 }
 
+OctreePacketTraverser::OctreePacketTraverser(){
+	//
+}
+
+OctreePacketTraverser::~OctreePacketTraverser(){
+	//
+}
+
+void OctreePacketTraverser::Initialize(const sfloat4 &ro, const sfloat4 &rd, const sint1 &gm, const OctreeNode *_pob){
+	OctreeStepTraverser::Initialize(ro,rd,gm,_pob); //single-ray roots of all the lanes
+	uint c[8] = {0};
+	for(uint i = 0; i < BLCLOUD_VSIZE; ++i){
+		tr[i] = -FLT_MAX;
+		if(mask.v[i] != 0)
+			c[stack[i].a]++;
+	}
+	a = std::max_element(c,c+8)-c;
+	pmask = 0;
+	l = -1;
+	sc = 0;
+	if(c[a] < std::max(BLCLOUD_VSIZE/2u,2u) || pob[0].leaf != ~0u)
+		return;
+
+	dfloatN T0[3], T1[3];
+	for(uint i = 0; i < BLCLOUD_VSIZE; ++i){
+		if(mask.v[i] == 0 || stack[i].a != a){
+			for(uint j = 0; j < 3; ++j)
+				T0[j].v[i] = T1[j].v[i] = 0.0f;
+			continue;
+		}
+		pmask |= 1<<i;
+		qh[i] = 0;
+		qc[i] = 0;
+		T0[0].v[i] = stack[i].t0[0].x;
+		T0[1].v[i] = stack[i].t0[0].y;
+		T0[2].v[i] = stack[i].t0[0].z;
+		T1[0].v[i] = stack[i].t1[0].x;
+		T1[1].v[i] = stack[i].t1[0].y;
+		T1[2].v[i] = stack[i].t1[0].z;
+	}
+	pm = sint1::mask(pmask);
+	for(uint j = 0; j < 3; ++j){
+		t0[0][j] = sfloat1::load(&T0[j]);
+		t1[0][j] = sfloat1::load(&T1[j]);
+		tm[0][j] = 0.5f*(t0[0][j]+t1[0][j]);
+	}
+	lm[0] = sfloat1::And(pm,sfloat1::GreaterOrEqual(sfloat1::min(sfloat1::min(t1[0][0],t1[0][1]),t1[0][2]),sfloat1::zero()));
+	n[0] = 0;
+	tn[0] = 0;
+	l = 0;
+	lc = 0;
+}
+
+//Advance the shared traversal to the next leaf intersected by any of the packet lanes (pm).
+bool OctreePacketTraverser::PacketStep(uint *pnode, sfloat1 &m, sfloat1 &tr0, sfloat1 &tr1){
+	static const uint nla[] = {0,4,2,6,1,5,3,7};
+	while(l >= 0){
+		if(tn[l] == 8){
+			--l;
+			continue;
+		}
+		uint k = tn[l]++;
+		uint c = pob[n[l]].Child(nla[k^a]);
+		if(c == 0)
+			continue;
+
+		sfloat1 c0[3], c1[3];
+		for(uint j = 0; j < 3; ++j){
+			bool b = k&(4>>j); //x: 4, y: 2, z: 1
+			c0[j] = b?tm[l][j]:t0[l][j];
+			c1[j] = b?t1[l][j]:tm[l][j];
+		}
+		tr0 = sfloat1::max(sfloat1::max(c0[0],c0[1]),c0[2]);
+		tr1 = sfloat1::min(sfloat1::min(c1[0],c1[1]),c1[2]);
+		m = sfloat1::And(sfloat1::And(lm[l],pm),sfloat1::And(sfloat1::Less(tr0,tr1),sfloat1::GreaterOrEqual(tr1,sfloat1::zero())));
+		if(m.AllFalse())
+			continue;
+
+		if(pob[c].leaf != ~0u){
+			*pnode = c;
+			return true;
+		}
+
+		++l;
+		for(uint j = 0; j < 3; ++j){
+			t0[l][j] = c0[j];
+			t1[l][j] = c1[j];
+			tm[l][j] = 0.5f*(c0[j]+c1[j]);
+		}
+		lm[l] = m;
+		n[l] = c;
+		tn[l] = 0;
+	}
+	return false;
+}
+
+dintN OctreePacketTraverser::GetLeaf(uint i, duintN *pnodes, sfloat1 &tr0, sfloat1 &tr1){
+	//Only sequential traversal is supported. Index is ignored here.
+	if(pmask == 0 && sc == 0)
+		return OctreeStepTraverser::GetLeaf(i,pnodes,tr0,tr1); //nothing returned by the packet, no leaves to skip
+	for(;;){
+		//continue the shared traversal until every packet lane has a leaf
+		int wm = pmask;
+		for(int m = pmask; m != 0; m &= m-1)
+			if(qc[__builtin_ctz(m)] > 0)
+				wm &= ~(1<<__builtin_ctz(m));
+		if(wm == 0)
+			break;
+		uint node;
+		sfloat1 m, t0m, t1m;
+		if(!PacketStep(&node,m,t0m,t1m))
+			break;
+		int mm = m.MoveMask();
+		lc += __builtin_popcount(mm);
+		if(++sc >= PACKET_MIN_STEPS && lc < PACKET_MIN_LANES*sc){
+			//Incoherent lanes, the shared traversal would visit most of the leaves for a single lane only
+			pmask = 0;
+			break;
+		}
+		dfloatN TR0, TR1;
+		sfloat1::store(&TR0,t0m);
+		sfloat1::store(&TR1,t1m);
+		for(; mm != 0; mm &= mm-1){
+			uint j = __builtin_ctz(mm);
+			if(qc[j] == PACKET_QUEUE_SIZE){
+				//Too far ahead of the others. The queued leaves are dropped, and the single-ray traversal
+				//continues from the last leaf returned.
+				pmask &= ~(1<<j);
+				pm = sint1::mask(pmask);
+				continue;
+			}
+			q[j][(qh[j]+qc[j])%PACKET_QUEUE_SIZE] = Node(node,TR0.v[j],TR1.v[j]);
+			qc[j]++;
+		}
+	}
+
+	dfloatN TR0, TR1;
+	for(uint j = 0; j < BLCLOUD_VSIZE; ++j){
+		if(mask.v[j] == 0)
+			continue;
+		Node node;
+		if(pmask & (1<<j)){
+			if(qc[j] == 0){
+				pmask &= ~(1<<j);
+				mask.v[j] = 0;
+				continue;
+			}
+			node = q[j][qh[j]];
+			qh[j] = (qh[j]+1)%PACKET_QUEUE_SIZE;
+			qc[j]--;
+		}else{
+			Stack &s = stack[j];
+			do{
+				bool r;
+				while(!(r = OctreeProcessSubtree(s.t0,s.t1,s.tm,s.tn,s.n,s.p,s.l,s.a,s.b,&node)) && OctreeRestoreParent(s));
+				if(!r){
+					mask.v[j] = 0;
+					break;
+				}
+			}while(std::get<2>(node) <= tr[j]); //skip the leaves already returned by the packet
+			if(mask.v[j] == 0)
+				continue;
+		}
+		tr[j] = std::get<2>(node);
+		pnodes->v[j] = std::get<0>(node);
+		TR0.v[j] = std::get<1>(node);
+		TR1.v[j] = std::get<2>(node);
+	}
+	tr0 = sfloat1::load(&TR0);
+	tr1 = sfloat1::load(&TR1);
+
+	return mask;
+}
+
+OctreeHDDAGrid::OctreeHDDAGrid(){
+	//
+}
+
+OctreeHDDAGrid::~OctreeHDDAGrid(){
+	//
+}
+
+bool OctreeHDDAGrid::Initialize(const OctreeNode *pob, uint nodec){
+	ce = pob[0].ce;
+	std::vector<std::pair<uint64_t, uint>> ls; //leaves keyed by their path from the root
+	std::vector<uint> ln; //leaf nodes
+	int re = std::ilogb(ce.w), ld = -1;
+	for(uint i = 0; i < nodec; ++i){
+		const OctreeNode &n = pob[i];
+		if(n.leaf == ~0u)
+			continue;
+		int l = re-std::ilogb(n.ce.w);
+		if(ld == -1)
+			ld = l;
+		else if(l != ld)
+			return false;
+		ln.push_back(i);
+	}
+	if(ld == -1)
+		ld = 0; //no leaves, a single empty root cell
+
+	lv[2].log2dim = std::min(ld,HDDA_LOWER_LOG2DIM);
+	lv[1].log2dim = std::min(ld-(int)lv[2].log2dim,HDDA_UPPER_LOG2DIM);
+	lv[0].log2dim = ld-lv[2].log2dim-lv[1].log2dim;
+	lv[2].log2size = 0;
+	lv[1].log2size = lv[2].log2dim;
+	lv[0].log2size = lv[1].log2size+lv[1].log2dim;
+	scale = (float)(1<<ld)/(2.0f*ce.w);
+
+	for(uint i : ln){
+		const dfloat4 &c = pob[i].ce;
+		uint64_t x = (uint64_t)((c.x-ce.x+ce.w)*scale), y = (uint64_t)((c.y-ce.y+ce.w)*scale), z = (uint64_t)((c.z-ce.z+ce.w)*scale);
+		uint64_t k = 0;
+		for(uint j = 0; j < HDDA_LEVELS; ++j){
+			uint64_t m = (1<<lv[j].log2dim)-1;
+			k = (((((k<<lv[j].log2dim)|(x>>lv[j].log2size&m))<<lv[j].log2dim)|(y>>lv[j].log2size&m))<<lv[j].log2dim)|(z>>lv[j].log2size&m);
+		}
+		ls.push_back(std::make_pair(k,i));
+	}
+	std::sort(ls.begin(),ls.end());
+
+	//The children are created in the order of their keys, so the children of each node are contiguous. Each leaf
+	//adds the nodes below the first level where its path departs from the previous one.
+	uint sh[HDDA_LEVELS]; //key bits below the child index of each level
+	for(uint j = HDDA_LEVELS, b = 0; j-- > 0; b += 3*lv[j].log2dim){
+		sh[j] = b;
+		lv[j].words = std::max((1u<<3*lv[j].log2dim)/64u,1u);
+		lv[j].mask.clear();
+		lv[j].chn.clear();
+	}
+	lv[0].mask.resize(lv[0].words,0);
+	for(uint i = 0; i < ls.size(); ++i){
+		uint64_t k = ls[i].first;
+		uint j = 0;
+		if(i > 0)
+			for(; j < HDDA_LEVELS && ls[i-1].first>>sh[j] == k>>sh[j]; ++j);
+		for(; j < HDDA_LEVELS; ++j){
+			uint b = (uint)(k>>sh[j])&((1u<<3*lv[j].log2dim)-1);
+			uint n = lv[j].mask.size()/lv[j].words-1; //the last node of the level
+			lv[j].mask[n*lv[j].words+b/64] |= 1ull<<(b%64);
+			if(j < HDDA_LEVELS-1){
+				lv[j].chn.push_back(lv[j+1].mask.size()/lv[j+1].words);
+				lv[j+1].mask.resize(lv[j+1].mask.size()+lv[j+1].words,0);
+			}else lv[j].chn.push_back(ls[i].second);
+		}
+	}
+	for(uint j = 0; j < HDDA_LEVELS; ++j){
+		lv[j].offs.resize(lv[j].mask.size());
+		for(uint i = 0, c = 0; i < lv[j].mask.size(); c += __builtin_popcountll(lv[j].mask[i++]))
+			lv[j].offs[i] = c;
+	}
+
+	return true;
+}
+
+//Child (x,y,z) of the node n at the level l, if present.
+inline bool OctreeHDDAGrid::Child(uint l, uint n, int x, int y, int z, uint *pc) const{
+	const Level &v = lv[l];
+	uint b = (((x<<v.log2dim)|y)<<v.log2dim)|z;
+	uint w = n*v.words+b/64;
+	uint64_t m = v.mask[w], s = 1ull<<(b%64);
+	if(!(m & s))
+		return false;
+	*pc = v.chn[v.offs[w]+__builtin_popcountll(m&(s-1))];
+	return true;
+}
+
+OctreeHDDATraverser::OctreeHDDATraverser(const OctreeHDDAGrid *_pgrid) : pgrid(_pgrid){
+	//
+}
+
+OctreeHDDATraverser::~OctreeHDDATraverser(){
+	//
+}
+
+void OctreeHDDATraverser::Initialize(const sfloat4 &ro, const sfloat4 &rd, const sint1 &gm, const OctreeNode *_pob){
+	pob = _pob;
+	const OctreeHDDAGrid::Level *plv = pgrid->lv;
+	float r = (float)(1<<(plv[0].log2size+plv[0].log2dim)); //root size, in leaves
+	for(uint i = 0; i < BLCLOUD_VSIZE; ++i){
+		mask.v[i] = 0;
+		if(((int*)&gm.v)[i] == 0)
+			continue;
+
+		Lane &s = lanes[i];
+		dfloat3 p = dfloat3(ro.get(i)), d = dfloat3(rd.get(i));
+		const dfloat4 &ce = pgrid->ce;
+		s.o = dfloat3((p.x-ce.x+ce.w)*pgrid->scale,(p.y-ce.y+ce.w)*pgrid->scale,(p.z-ce.z+ce.w)*pgrid->scale);
+		s.d = dfloat3(d.x*pgrid->scale,d.y*pgrid->scale,d.z*pgrid->scale);
+		float o[3] = {s.o.x,s.o.y,s.o.z}, dd[3] = {s.d.x,s.d.y,s.d.z}, id[3];
+		float t0 = 0.0f, t1 = FLT_MAX;
+		for(uint j = 0; j < 3; ++j){
+			s.st[j] = dd[j] < 0.0f?-1:1;
+			id[j] = dd[j] != 0.0f?1.0f/dd[j]:FLT_MAX; //never the nearest boundary
+			float ta = -o[j]*id[j], tb = (r-o[j])*id[j];
+			t0 = std::max(t0,std::min(ta,tb));
+			t1 = std::min(t1,std::max(ta,tb));
+		}
+		if(t0 >= t1)
+			continue;
+		mask.v[i] = -1;
+		for(uint k = 0; k < HDDA_LEVELS; ++k){
+			float cs = (float)(1<<plv[k].log2size);
+			for(uint j = 0; j < 3; ++j)
+				s.td[k][j] = cs*fabsf(id[j]);
+		}
+		//root cell of the entry point
+		for(uint j = 0; j < 3; ++j){
+			float cs = (float)(1<<plv[0].log2size);
+			s.c[0][j] = std::min(std::max((int)floorf((o[j]+dd[j]*t0)/cs),0),(1<<plv[0].log2dim)-1);
+			s.tm[0][j] = ((float)(s.c[0][j]+(s.st[j] > 0))*cs-o[j])*id[j];
+		}
+		s.t[0] = t0;
+		s.n[0] = 0;
+		s.l = 0;
+	}
+}
+
+dintN OctreeHDDATraverser::GetLeaf(uint i, duintN *pnodes, sfloat1 &tr0, sfloat1 &tr1){
+	//Only sequential traversal is supported. Index is ignored here.
+	dfloatN TR0, TR1;
+	for(uint j = 0; j < BLCLOUD_VSIZE; ++j){
+		if(mask.v[j] == 0)
+			continue;
+		Node node;
+		if(!HDDAStep(lanes[j],&node)){
+			mask.v[j] = 0;
+			continue;
+		}
+		pnodes->v[j] = std::get<0>(node);
+		TR0.v[j] = std::get<1>(node);
+		TR1.v[j] = std::get<2>(node);
+	}
+	tr0 = sfloat1::load(&TR0);
+	tr1 = sfloat1::load(&TR1);
+
+	return mask;
+}
+
+//Step to the next cell along the ray at the level l.
+static inline void HDDAAdvance(float *pt, float (*ptm)[3], float (*ptd)[3], int (*pc)[3], const int *pst, uint l){
+	uint a = ptm[l][0] < ptm[l][1]?(ptm[l][0] < ptm[l][2]?0:2):(ptm[l][1] < ptm[l][2]?1:2);
+	pt[l] = ptm[l][a];
+	ptm[l][a] += ptd[l][a];
+	pc[l][a] += pst[a];
+}
+
+bool OctreeHDDATraverser::HDDAStep(Lane &s, Node *pnode){
+	const OctreeHDDAGrid::Level *plv = pgrid->lv;
+	for(;;){
+		uint l = s.l;
+		int m = (1<<plv[l].log2dim)-1;
+		int x = s.c[l][0], y = s.c[l][1], z = s.c[l][2];
+		if(l > 0){
+			x -= s.c[l-1][0]<<plv[l].log2dim;
+			y -= s.c[l-1][1]<<plv[l].log2dim;
+			z -= s.c[l-1][2]<<plv[l].log2dim;
+		}
+		if((x|y|z) & ~m){
+			//left the node
+			if(l == 0)
+				return false;
+			s.l = --l;
+			HDDAAdvance(s.t,s.tm,s.td,s.c,s.st,l);
+			continue;
+		}
+		uint c;
+		if(!pgrid->Child(l,s.n[l],x,y,z,&c)){
+			HDDAAdvance(s.t,s.tm,s.td,s.c,s.st,l);
+			continue;
+		}
+		float t0 = s.t[l];
+		if(l == HDDA_LEVELS-1){
+			float t1 = std::min(std::min(s.tm[l][0],s.tm[l][1]),s.tm[l][2]);
+			HDDAAdvance(s.t,s.tm,s.td,s.c,s.st,l);
+			if(t1 <= t0)
+				continue; //grazing an edge or a corner
+			*pnode = Node(c,t0,t1);
+			return true;
+		}
+		//descend into the child, starting from the cell of the entry point
+		uint k = l+1;
+		float cs = (float)(1<<plv[k].log2size);
+		float o[3] = {s.o.x,s.o.y,s.o.z}, d[3] = {s.d.x,s.d.y,s.d.z};
+		for(uint j = 0; j < 3; ++j){
+			int c0 = s.c[l][j]<<plv[k].log2dim;
+			s.c[k][j] = std::min(std::max((int)floorf((o[j]+d[j]*t0)/cs),c0),c0+(1<<plv[k].log2dim)-1);
+			s.tm[k][j] = d[j] != 0.0f?((float)(s.c[k][j]+(s.st[j] > 0))*cs-o[j])/d[j]:FLT_MAX;
+		}
+		s.t[k] = t0;
+		s.n[k] = c;
+		s.l = k;
+	}
+}
+
 }
@@ -7,21 +7,47 @@ class BaseOctreeTraverser{
 public:
 	BaseOctreeTraverser();
 	~BaseOctreeTraverser();
-	virtual void Initialize(const sfloat4 &, const sfloat4 &, const sint1 &, const tbb::concurrent_vector<OctreeStructure> *) = 0;
+	virtual void Initialize(const sfloat4 &, const sfloat4 &, const sint1 &, const OctreeNode *) = 0;
+	virtual void Initialize(const sfloat4 &, const sfloat4 &, const sint1 &, const OctreeNode *, const dintN &, const uint *); //restart from the previous leaves, if supported
 	virtual dintN GetLeaf(uint, duintN *, sfloat1 &, sfloat1 &) = 0;
-protected:
 	typedef std::tuple<uint, float, float> Node;
-	const tbb::concurrent_vector<OctreeStructure> *pob;
+protected:
+	const OctreeNode *pob;
+};
+
+#define LEAF_ARENA_MAX_SIZE (256u<<20) //bytes, the packets above the limit are traversed on every pass
+
+//Primary leaf lists of the packets in a tile. The primary rays are identical on every pass, so the lists are
+//traversed once and kept until the tile changes.
+class OctreeLeafArena{
+public:
+	OctreeLeafArena();
+	~OctreeLeafArena();
+	void Reset(uint, uint, uint, uint);
+private:
+	friend class OctreeFullTraverser;
+	struct Packet{
+		std::vector<BaseOctreeTraverser::Node> ls; //lists of the lanes back to back
+		uint offs[BLCLOUD_VSIZE+1];
+		int mask; //lanes stored
+	};
+	std::vector<Packet> pks;
+	std::atomic<size_t> size; //stored nodes
+	uint x0, y0, tilex, tiley;
 };
 
 class OctreeFullTraverser : public BaseOctreeTraverser{
 public:
 	OctreeFullTraverser();
 	~OctreeFullTraverser();
-	void Initialize(const sfloat4 &, const sfloat4 &, const sint1 &, const tbb::concurrent_vector<OctreeStructure> *);
+	void Initialize(const sfloat4 &, const sfloat4 &, const sint1 &, const OctreeNode *);
+	void Initialize(const sfloat4 &, const sfloat4 &, const sint1 &, const OctreeNode *, OctreeLeafArena *, uint);
 	dintN GetLeaf(uint, duintN *, sfloat1 &, sfloat1 &);
+	dintN GetLeaf(const duintN &, duintN *, sfloat1 &, sfloat1 &); //leaf index per lane
 private:
 	std::vector<Node> ls[BLCLOUD_VSIZE];
+	const Node *pls[BLCLOUD_VSIZE]; //lists being traversed, either ls or the arena
+	uint lc[BLCLOUD_VSIZE];
 	void OctreeProcessSubtree(const dfloat3 &, const dfloat3 &, uint, uint, uint, std::vector<Node> *);
 };
 
@@ -29,19 +55,109 @@ class OctreeStepTraverser : public BaseOctreeTraverser{
 public:
 	OctreeStepTraverser();
 	~OctreeStepTraverser();
-	void Initialize(const sfloat4 &, const sfloat4 &, const sint1 &, const tbb::concurrent_vector<OctreeStructure> *);
+	void Initialize(const sfloat4 &, const sfloat4 &, const sint1 &, const OctreeNode *);
+	void Initialize(const sfloat4 &, const sfloat4 &, const sint1 &, const OctreeNode *, const dintN &, const uint *);
 	dintN GetLeaf(uint, duintN *, sfloat1 &, sfloat1 &);
-private:
+protected:
 #define MAX_DEPTH 16
 	typedef struct{
 		dfloat3 t0[MAX_DEPTH], t1[MAX_DEPTH], tm[MAX_DEPTH];
 		uint n[MAX_DEPTH], tn[MAX_DEPTH], a, l;
+		uint b; //level of the restart node, the levels above are restored once the walk leaves it
 		bool p[MAX_DEPTH]; //stack pointer
 	} Stack;
 #undef MAX_DEPTH
 	Stack stack[BLCLOUD_VSIZE];
 	dintN mask;
-	bool OctreeProcessSubtree(dfloat3 *, dfloat3 *, dfloat3 *, uint *, uint *, bool *, uint &, uint, Node *);
+	const uint *pparent; //parent of each node, for the restarts
+	bool OctreeProcessSubtree(dfloat3 *, dfloat3 *, dfloat3 *, uint *, uint *, bool *, uint &, uint, uint, Node *);
+	bool OctreeRestoreParent(Stack &);
+};
+
+#define PACKET_QUEUE_SIZE 16 //leaves buffered per lane before it leaves the packet
+#define PACKET_MIN_STEPS 8 //shared leaves visited before the coherence is checked
+#define PACKET_MIN_LANES 2 //min average number of lanes per shared leaf to keep the packet
+
+//Packet traversal of the secondary and light rays. The lanes in the dominant direction octant (if at least half of
+//them) share a single stack, visiting the children in the mirrored index order, which is front-to-back for all of
+//them. The leaves are buffered per lane until requested. The lanes in the other octants, and those running too far
+//ahead of the packet (queue full), fall back to the single-ray traversal. So does the whole packet if the lanes turn
+//out to share too few leaves.
+class OctreePacketTraverser : public OctreeStepTraverser{
+public:
+	OctreePacketTraverser();
+	~OctreePacketTraverser();
+	void Initialize(const sfloat4 &, const sfloat4 &, const sint1 &, const OctreeNode *);
+	dintN GetLeaf(uint, duintN *, sfloat1 &, sfloat1 &);
+private:
+#define MAX_DEPTH 16
+	sfloat1 t0[MAX_DEPTH][3], t1[MAX_DEPTH][3], tm[MAX_DEPTH][3];
+	sfloat1 lm[MAX_DEPTH]; //lanes intersecting the node
+	uint n[MAX_DEPTH], tn[MAX_DEPTH];
+#undef MAX_DEPTH
+	int l; //shared stack pointer, -1 when done
+	uint a; //shared octant
+	int pmask; //lanes in the packet
+	sfloat1 pm;
+	Node q[BLCLOUD_VSIZE][PACKET_QUEUE_SIZE];
+	uint qh[BLCLOUD_VSIZE], qc[BLCLOUD_VSIZE];
+	uint sc, lc; //shared leaves visited, and the sum of their lanes
+	float tr[BLCLOUD_VSIZE]; //exit distance of the last leaf returned
+	bool PacketStep(uint *, sfloat1 &, sfloat1 &, sfloat1 &);
+};
+
+#define HDDA_LEVELS 3
+#define HDDA_UPPER_LOG2DIM 5 //children per axis of the upper internal nodes, as in the 5-4-3 VDB trees
+#define HDDA_LOWER_LOG2DIM 4 //-- lower internal nodes, whose children are the octree leaves (the bricks)
+
+//Shallow VDB-like hierarchy over the octree leaves: the root, and the upper and lower internal nodes of 32^3 and
+//16^3 children. The root takes the octree levels above them, and in the shallow octrees the internal nodes take fewer.
+//Only the child masks and the present children are stored, indexed through the running popcount of the mask words.
+//Requires the leaves to be at a single depth.
+class OctreeHDDAGrid{
+public:
+	OctreeHDDAGrid();
+	~OctreeHDDAGrid();
+	bool Initialize(const OctreeNode *, uint);
+private:
+	friend class OctreeHDDATraverser;
+	struct Level{
+		std::vector<uint64_t> mask; //child masks of the nodes back to back
+		std::vector<uint> offs; //index of the first child of each mask word
+		std::vector<uint> chn; //nodes of the next level, or the octree leaves
+		uint log2dim; //children per axis
+		uint log2size; //child size, in leaves
+		uint words; //mask words per node
+	} lv[HDDA_LEVELS];
+	dfloat4 ce; //root node
+	float scale; //leaves per world unit
+	bool Child(uint, uint, int, int, int, uint *) const;
+};
+
+//Hierarchical DDA through the OctreeHDDAGrid: a 3D-DDA steps through the children of the current node at each level,
+//skipping the empty ones whole and descending into the present ones. The walk starts at the root, which is only
+//three levels above the leaves, so there's no restart from the previous leaves.
+class OctreeHDDATraverser : public BaseOctreeTraverser{
+public:
+	OctreeHDDATraverser(const OctreeHDDAGrid *);
+	~OctreeHDDATraverser();
+	void Initialize(const sfloat4 &, const sfloat4 &, const sint1 &, const OctreeNode *);
+	dintN GetLeaf(uint, duintN *, sfloat1 &, sfloat1 &);
+private:
+	typedef struct{
+		float t[HDDA_LEVELS]; //entry distance of the current cell
+		float tm[HDDA_LEVELS][3]; //distance to the next cell boundary
+		float td[HDDA_LEVELS][3]; //distance between the cell boundaries
+		int c[HDDA_LEVELS][3]; //current cell, in the cell units of the level
+		uint n[HDDA_LEVELS]; //current node
+		int st[3]; //step direction
+		dfloat3 o, d; //ray, in leaf units
+		uint l;
+	} Lane;
+	Lane lanes[BLCLOUD_VSIZE];
+	dintN mask;
+	const OctreeHDDAGrid *pgrid;
+	bool HDDAStep(Lane &, Node *);
 };
 
 }
@@ -1,9 +1,6 @@
 #include "main.h"
 #include "KernelSampler.h"
 
-#define USE_SSE2
-#include "sse_mathfun.h"
-
 //precomputed Mie phase (RGB channels) for cloud droplets, 1024*3 entries
 static const dfloat3 miepdf[] = {
 	{0.0903518f,0.0916993f,0.0930511f},{0.0590581f,0.0682281f,0.0681127f},{0.0594793f,0.0577884f,0.0635298f},{0.0778413f,0.0710927f,0.0662018f},
@@ -197,58 +194,70 @@ sfloat4 HGPhase::Sample(const sfloat4 &iv, const sfloat1 &u1, const sfloat1 &u2)
 	sfloat4 b1, b2;
 	SamplingBasis(iv,&b1,&b2);
 	sfloat1 sph, cph;
-	sincos_ps(ph.v,&sph.v,&cph.v);
+	sfloat1::sincos(ph,&sph,&cph);
 	return b1*st*cph+b2*st*sph+iv*ct;
 }
 
 HGPhase HGPhase::ghg(0.75f);
 
 MiePhase::MiePhase(){
-	//
+	//Resample the phase to a table indexed without acos(). The coordinate x in [0,2] is sqrt(1-|ct|) for ct >= 0
+	//and 2-sqrt(1-|ct|) for ct < 0, which is close to linear in theta at both the forward and backward peaks.
+	for(uint i = 0; i <= MIE_EVALUATE_SIZE; ++i){
+		float x = 2.0f*(float)i/(float)MIE_EVALUATE_SIZE;
+		float u = x <= 1.0f?x:2.0f-x;
+		float ct = x <= 1.0f?1.0f-u*u:u*u-1.0f;
+		float b = (float)miedl*acosf(-ct)/SM_PI;
+		float c = std::max(std::min(floorf(b),(float)(miedl-2)),0.0f);
+		float t = b-c;
+		for(uint j = 0; j < 3; ++j)
+			ptable[j][i] = miepdf[(uint)c+0][j]+t*(miepdf[(uint)c+1][j]-miepdf[(uint)c+0][j]);
+	}
+
+	//Invert the cdf (sampled uniformly in theta) for the constant time sampling
+	for(uint i = 0, k = 0; i <= MIE_SAMPLE_SIZE; ++i){
+		float u = (float)i/(float)MIE_SAMPLE_SIZE;
+		for(; k < miedl-2 && miecdf[k+1].x < u; ++k);
+		float d = miecdf[k+1].x-miecdf[k].x;
+		float t = d > 0.0f?std::max(std::min((u-miecdf[k].x)/d,1.0f),0.0f):0.0f;
+		float a = ((float)k+t)/(float)(miedl-1);
+		ctable[i] = -cosf(SM_PI*a);
+	}
 }
 
 MiePhase::~MiePhase(){
 	//
 }
 
-sfloat1 MiePhase::Evaluate(const sfloat1 &ct) const{
+//Table index and the interpolation factor for cosine ct
+sfloat1 MiePhase::TableCoordinate(const sfloat1 &ct, sint1 *pi) const{
 	sfloat1 ct1 = sfloat1::saturate2(ct); //hack rare abs(ct) > 1 cases
-	sfloat1 a = sfloat1::acos(-ct1)/SM_PI;
-	sfloat1 b = sfloat1((float)miedl*a);
-	sfloat1 c = sfloat1::floor(b);
-	c = sfloat1::min(c,(float)(miedl-2));
-	c = sfloat1::max(c,0.0f);
-	sfloat1 t = b-c; //frac(b)
-	dfloatN X = dfloatN(c);
-	dfloatN MA, MB;
-	for(uint i = 0; i < BLCLOUD_VSIZE; ++i){
-		MA.v[i] = miepdf[(uint)X.v[i]+0].x;
-		MB.v[i] = miepdf[(uint)X.v[i]+1].x;
-	}
-	sfloat1 ma = sfloat1::load(&MA);
-	sfloat1 mb = sfloat1::load(&MB);
+	sfloat1 u = sfloat1::sqrt(sfloat1::max(1.0f-sfloat1::abs(ct1),sfloat1::zero()));
+	sfloat1 x = sfloat1::select(2.0f-u,u,sfloat1::GreaterOrEqual(ct1,sfloat1::zero()));
+	sfloat1 b = x*(0.5f*(float)MIE_EVALUATE_SIZE);
+	sfloat1 c = sfloat1::min(sfloat1::floor(b),(float)(MIE_EVALUATE_SIZE-1));
+	*pi = sint1::convert(c);
+	return b-c;
+}
+
+sfloat1 MiePhase::Evaluate(const sfloat1 &ct) const{
+	sint1 i;
+	sfloat1 t = TableCoordinate(ct,&i);
+	sfloat1 m = sint1::trueI();
+	sfloat1 ma = sfloat1::gather(ptable[0],i,m);
+	sfloat1 mb = sfloat1::gather(ptable[0],i+sint1(1),m);
 	return sfloat1::lerp(ma,mb,t);
 }
 
 sfloat4 MiePhase::EvaluateRGB(const sfloat1 &ct) const{
-	sfloat1 ct1 = sfloat1::saturate2(ct);
-	sfloat1 a = sfloat1::acos(-ct1)/SM_PI;
-	sfloat1 b = sfloat1((float)miedl*a);
-	sfloat1 c = sfloat1::floor(b);
-	c = sfloat1::min(c,(float)(miedl-2));
-	c = sfloat1::max(c,0.0f);
-	sfloat1 t = b-c; //frac(b)
-	dfloatN X = dfloatN(c);
+	sint1 i;
+	sfloat1 t = TableCoordinate(ct,&i);
+	sfloat1 m = sint1::trueI();
 	sfloat4 ph;
-	for(uint i = 0; i < 3; ++i){
-		dfloatN MA, MB;
-		for(uint j = 0; j < BLCLOUD_VSIZE; ++j){
-			MA.v[j] = miepdf[(uint)X.v[j]+0][i];
-			MB.v[j] = miepdf[(uint)X.v[j]+1][i];
-		}
-		sfloat1 ma = sfloat1::load(&MA);
-		sfloat1 mb = sfloat1::load(&MB);
-		ph.v[i] = sfloat1::lerp(ma,mb,t);
+	for(uint j = 0; j < 3; ++j){
+		sfloat1 ma = sfloat1::gather(ptable[j],i,m);
+		sfloat1 mb = sfloat1::gather(ptable[j],i+sint1(1),m);
+		ph.v[j] = sfloat1::lerp(ma,mb,t);
 	}
 	ph.v[3] = sfloat1::one();
 
@@ -256,36 +265,79 @@ sfloat4 MiePhase::EvaluateRGB(const sfloat1 &ct) const{
 }
 
 sfloat4 MiePhase::Sample(const sfloat4 &iv, const sfloat1 &u1, const sfloat1 &u2) const{
-	sfloat1 th = sfloat1::zero();
-	sfloat1 ub = sfloat1((float)miedl*u1);
-	for(uint i = 0; i < miedl-1; ++i){
-		sfloat1 cdf0 = sfloat1(miecdf[i+0].x);
-		sfloat1 cdf1 = sfloat1(miecdf[i+1].x);
-		sfloat1 b = sfloat1::max(ub,(float)i);
-		sfloat1 c = sfloat1::min(sfloat1::floor(b),(float)(miedl-1));
-		sfloat1 t = b-c;
-		sfloat1 cdf = sfloat1::lerp(cdf0,cdf1,t);
-		sfloat1 m = sfloat1::Less(cdf,u1);
-		sfloat1 s = sfloat1((float)i/(float)miedl)+t/(float)miedl;
-		th = sfloat1::Or(sfloat1::And(m,s),sfloat1::AndNot(m,th));
-		if(m.AllFalse())
-			break;
-	}
-	th *= SM_PI;
+	sfloat1 b = u1*(float)MIE_SAMPLE_SIZE;
+	sfloat1 c = sfloat1::max(sfloat1::min(sfloat1::floor(b),(float)(MIE_SAMPLE_SIZE-1)),sfloat1::zero());
+	sfloat1 t = b-c;
+	sint1 i = sint1::convert(c);
+	sfloat1 m = sint1::trueI();
+	sfloat1 ct = sfloat1::lerp(sfloat1::gather(ctable,i,m),sfloat1::gather(ctable,i+sint1(1),m),t);
 	sfloat1 ph = 2.0f*SM_PI*u2;
 
 	sfloat4 b1, b2;
 	SamplingBasis(iv,&b1,&b2);
-	sfloat1 ct = -cos_ps(th.v);
 	sfloat1 st = sfloat1::sqrt(sfloat1::max(1.0f-ct*ct,sfloat1::zero()));
 	sfloat1 sph, cph;
-	sincos_ps(ph.v,&sph.v,&cph.v);
+	sfloat1::sincos(ph,&sph,&cph);
 
 	return b1*st*cph+b2*st*sph+iv*ct;
 }
 
 MiePhase MiePhase::gmie;
 
+//Vose's alias method for n weights. Returns the sum of the weights.
+static double BuildAlias(const double *pw, uint n, float *pprob, float *palias){
+	double sum = 0.0;
+	for(uint i = 0; i < n; ++i)
+		sum += pw[i];
+
+	std::vector<double> q(n);
+	std::vector<uint> sl, ll; //small and large
+	for(uint i = 0; i < n; ++i){
+		q[i] = sum > 0.0?pw[i]*(double)n/sum:1.0;
+		if(q[i] < 1.0)
+			sl.push_back(i);
+		else ll.push_back(i);
+	}
+	while(!sl.empty() && !ll.empty()){
+		uint i = sl.back(), j = ll.back();
+		sl.pop_back();
+		pprob[i] = (float)q[i];
+		palias[i] = (float)j;
+		q[j] -= 1.0-q[i];
+		if(q[j] < 1.0){
+			ll.pop_back();
+			sl.push_back(j);
+		}
+	}
+	//leftovers (numerical error) are always accepted
+	for(uint i : sl){
+		pprob[i] = 1.0f;
+		palias[i] = (float)i;
+	}
+	for(uint i : ll){
+		pprob[i] = 1.0f;
+		palias[i] = (float)i;
+	}
+
+	return sum;
+}
+
+//Sample the alias table of n entries at offset o. Returns the selected entry pc, and u remapped within the entry.
+static inline sfloat1 SampleAlias(const float *pprob, const float *palias, uint n, const sint1 &o, const sfloat1 &u, sfloat1 *pc){
+	sfloat1 b = u*(float)n;
+	sfloat1 c = sfloat1::max(sfloat1::min(sfloat1::floor(b),(float)(n-1)),sfloat1::zero());
+	sfloat1 t = sfloat1::min(b-c,0.99999994f);
+	sint1 i = o+sint1::convert(c);
+
+	sfloat1 m = sint1::trueI();
+	sfloat1 p = sfloat1::gather(pprob,i,m);
+	sfloat1 a = sfloat1::gather(palias,i,m);
+	sfloat1 ma = sfloat1::Less(t,p);
+
+	*pc = sfloat1::select(a,c,ma);
+	return sfloat1::select((t-p)/sfloat1::max(1.0f-p,1e-7f),t/sfloat1::max(p,1e-7f),ma);
+}
+
 BaseLight::BaseLight(){
 	lights.push_back(this);
 }
@@ -294,6 +346,67 @@ BaseLight::~BaseLight(){
 	//
 }
 
+//Build the selection table once all the lights have been created.
+void BaseLight::InitializeSelection(){
+	uint n = lights.size();
+	std::vector<double> lw(n);
+	for(uint i = 0; i < n; ++i){
+		dfloat4 e = dfloat4(lights[i]->Irradiance());
+		lw[i] = std::max(0.2126*e.x+0.7152*e.y+0.0722*e.z,0.0);
+	}
+	lprob.resize(n);
+	lalias.resize(n);
+	lpmf.resize(n);
+	double sum = BuildAlias(lw.data(),n,lprob.data(),lalias.data());
+	for(uint i = 0; i < n; ++i)
+		lpmf[i] = sum > 0.0?(float)(lw[i]/sum):1.0f/(float)n;
+}
+
+sfloat4 BaseLight::EvaluateAll(const sfloat4 &rd){
+	sfloat4 lc = sfloat4::zero();
+	for(uint i = 0; i < lights.size(); ++i)
+		lc += lights[i]->Evaluate(rd);
+	return lc;
+}
+
+//Pdf of SampleAll()
+sfloat1 BaseLight::PdfAll(const sfloat4 &iv){
+	sfloat1 p = sfloat1::zero();
+	for(uint i = 0; i < lights.size(); ++i)
+		p += lpmf[i]*lights[i]->Pdf(iv);
+	return p;
+}
+
+sfloat4 BaseLight::SampleAll(const sfloat4 &iv, const sfloat1 &u1, const sfloat1 &u2){
+	if(lights.size() == 1)
+		return lights[0]->Sample(iv,u1,u2);
+	if(lights.empty())
+		return iv; //zero pdf
+
+	//u1 is reused for the light after the selection
+	sfloat1 l;
+	sfloat1 u = SampleAlias(lprob.data(),lalias.data(),lights.size(),sint1(0),u1,&l);
+
+	sfloat4 lrd = iv;
+	for(uint i = 0; i < lights.size(); ++i){
+		sfloat1 m = sfloat1::Equal(l,sfloat1((float)i));
+		if(m.AllFalse())
+			continue;
+		sfloat4 s = lights[i]->Sample(iv,u,u2);
+		for(uint j = 0; j < 3; ++j)
+			lrd.v[j] = sfloat1::select(lrd.v[j],s.v[j],m);
+	}
+
+	return lrd;
+}
+
+float4 BaseLight::IrradianceAll(){
+	float4 e = float4::zero();
+	for(uint i = 0; i < lights.size(); ++i)
+		e += lights[i]->Irradiance();
+	return e;
+}
+
 void BaseLight::DeleteAll(){
 	for(uint i = 0; i < lights.size(); ++i)
 		delete lights[i];
@@ -301,6 +414,9 @@ void BaseLight::DeleteAll(){
 }
 
 std::vector<BaseLight *> BaseLight::lights;
+std::vector<float> BaseLight::lprob;
+std::vector<float> BaseLight::lalias;
+std::vector<float> BaseLight::lpmf;
 
 SunLight::SunLight(const dfloat3 *pd, const dfloat3 *pc, float _angle) : direction(*pd), color(*pc), angle(_angle){
 	cosAngle = cosf(_angle);
@@ -326,7 +442,7 @@ sfloat4 SunLight::Evaluate(const sfloat4 &rd) const{
 sfloat1 SunLight::Pdf(const sfloat4 &iv) const{
 	sfloat1 ctm = cosAngle;
 	sfloat1 lt = sfloat1::Greater(sfloat4::dot3(iv,sfloat4(float4::load(&direction))),ctm);
-	return sfloat1::And(lt,sfloat1(1.0f/(2.0f*SM_PI*(1.0f-ctm*ctm))));
+	return sfloat1::And(lt,sfloat1(1.0f/(2.0f*SM_PI*(1.0f-cosAngle)))); //uniform over the cone, as in Sample()
 }
 
 sfloat4 SunLight::Sample(const sfloat4 &iv, const sfloat1 &u1, const sfloat1 &u2) const{
@@ -339,11 +455,15 @@ sfloat4 SunLight::Sample(const sfloat4 &iv, const sfloat1 &u1, const sfloat1 &u2
 	sfloat4 lrd = sfloat4(float4::load(&direction));
 	SamplingBasis(lrd,&b1,&b2);
 	sfloat1 sph, cph;
-	sincos_ps(ph.v,&sph.v,&cph.v);
+	sfloat1::sincos(ph,&sph,&cph);
 
 	return b1*st*cph+b2*st*sph+lrd*ct;
 }
 
+float4 SunLight::Irradiance() const{
+	return float4::load(&color)*(2.0f*SM_PI*(1.0f-cosAngle));
+}
+
 BaseEnv::BaseEnv(){
 	//
 }
@@ -364,6 +484,14 @@ sfloat4 NullEnv::Evaluate(const sfloat4 &rd) const{
 	return sfloat4(0.0f);
 }
 
+sfloat1 NullEnv::Pdf(const sfloat4 &rd) const{
+	return sfloat1::zero();
+}
+
+sfloat4 NullEnv::Sample(const sfloat1 &u1, const sfloat1 &u2) const{
+	return sfloat4(0.0f,0.0f,1.0f,0.0f);
+}
+
 NullEnv NullEnv::nenv;
 
 MapEnv::MapEnv(){
@@ -378,9 +506,45 @@ dfloat4 * MapEnv::Initialize(uint w, uint h){
 	ptex = new dfloat4[w*h];
 	this->w = w;
 	this->h = h;
+	pmprob = pmalias = 0;
+	pcprob = pcalias = 0;
+	ppdf = 0;
 	return ptex;
 }
 
+//Build the sampling distribution once the texels have been loaded.
+bool MapEnv::InitializeSampling(){
+	if(!(pmprob = new(std::nothrow) float[h]) || !(pmalias = new(std::nothrow) float[h]) ||
+		!(pcprob = new(std::nothrow) float[w*h]) || !(pcalias = new(std::nothrow) float[w*h]) || !(ppdf = new(std::nothrow) float[w*h]))
+		return false;
+
+	//texel luminance after the same linearization as in the kernel
+	std::vector<double> lum(w*h);
+	for(uint i = 0; i < w*h; ++i)
+		lum[i] = 0.2126*pow(std::max(ptex[i].x,0.0f),2.2)+0.7152*pow(std::max(ptex[i].y,0.0f),2.2)+0.0722*pow(std::max(ptex[i].z,0.0f),2.2);
+
+	//cell (i,j) is bilinearly interpolated from the texels (i,j)..(i+1,j+1)
+	std::vector<double> cw(w*h), rw(h);
+	for(uint i = 0; i < h; ++i){
+		uint i1 = std::min(i+1,h-1);
+		double st = sin(M_PI*((double)i+0.5)/(double)h);
+		for(uint j = 0; j < w; ++j){
+			uint j1 = std::min(j+1,w-1);
+			cw[w*i+j] = 0.25*st*(lum[w*i+j]+lum[w*i1+j]+lum[w*i+j1]+lum[w*i1+j1]);
+		}
+		rw[i] = BuildAlias(&cw[w*i],w,pcprob+w*i,pcalias+w*i);
+	}
+	double sum = BuildAlias(rw.data(),h,pmprob,pmalias);
+
+	for(uint i = 0; i < h; ++i)
+		for(uint j = 0; j < w; ++j)
+			ppdf[w*i+j] = sum > 0.0?
+				(float)(cw[w*i+j]*(double)(w*h)/sum):
+				1.0f; //uniform in texture space (and so is the alias table)
+
+	return true;
+}
+
 sfloat4 MapEnv::Evaluate(const sfloat4 &rd) const{
 	sfloat1 tha = sfloat1::acos(-rd.v[2])/SM_PI;
 	sfloat1 thb = sfloat1((float)h*sfloat1::saturate(tha));
@@ -418,8 +582,43 @@ sfloat4 MapEnv::Evaluate(const sfloat4 &rd) const{
 	return ce;
 }
 
+sfloat1 MapEnv::Pdf(const sfloat4 &rd) const{
+	sfloat1 tha = sfloat1::acos(-rd.v[2])/SM_PI;
+	sfloat1 thc = sfloat1::max(sfloat1::min(sfloat1::floor((float)h*sfloat1::saturate(tha)),(float)(h-1)),0.0f);
+	sfloat1 pha = 0.5+sfloat1::atan2(rd.v[1],-rd.v[0])/sfloat1(2.0f*SM_PI);
+	sfloat1 phc = sfloat1::max(sfloat1::min(sfloat1::floor((float)w*sfloat1::saturate(pha)),(float)(w-1)),0.0f);
+
+	sfloat1 p = sfloat1::gather(ppdf,sint1((int)w)*sint1::convert(thc)+sint1::convert(phc),sint1::trueI());
+	sfloat1 st = sfloat1::sqrt(sfloat1::max(1.0f-rd.v[2]*rd.v[2],sfloat1::zero()));
+	return p/sfloat1::max(2.0f*SM_PI*SM_PI*st,1e-7f); //texture space to solid angle: dw = 2pi^2*sin(theta)*du*dv
+}
+
+sfloat4 MapEnv::Sample(const sfloat1 &u1, const sfloat1 &u2) const{
+	sfloat1 i, j;
+	sfloat1 ua = SampleAlias(pmprob,pmalias,h,sint1(0),u1,&i);
+	sfloat1 ub = SampleAlias(pcprob,pcalias,w,sint1((int)w)*sint1::convert(i),u2,&j);
+
+	sfloat1 th = SM_PI*(i+ua)/(float)h;
+	sfloat1 ph = 2.0f*SM_PI*((j+ub)/(float)w-0.5f);
+	sfloat1 sth, cth, sph, cph;
+	sfloat1::sincos(th,&sth,&cth);
+	sfloat1::sincos(ph,&sph,&cph);
+
+	sfloat4 rd;
+	rd.v[0] = -sth*cph;
+	rd.v[1] = sth*sph;
+	rd.v[2] = -cth;
+	rd.v[3] = sfloat1::zero();
+	return rd;
+}
+
 void MapEnv::Destroy(){
 	delete []ptex;
+	delete []pmprob;
+	delete []pmalias;
+	delete []pcprob;
+	delete []pcalias;
+	delete []ppdf;
 }
 
 MapEnv MapEnv::genv;
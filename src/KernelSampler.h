@@ -24,6 +24,9 @@ public:
 	static HGPhase ghg;
 };
 
+#define MIE_EVALUATE_SIZE 4096 //phase table entries
+#define MIE_SAMPLE_SIZE 4096 //inverse cdf entries
+
 class MiePhase : public PhaseFunction{
 public:
 	MiePhase();
@@ -32,6 +35,10 @@ public:
 	sfloat4 EvaluateRGB(const sfloat1 &) const;
 	sfloat4 Sample(const sfloat4 &, const sfloat1 &, const sfloat1 &) const;
 	static MiePhase gmie;
+private:
+	sfloat1 TableCoordinate(const sfloat1 &, sint1 *) const;
+	float ptable[3][MIE_EVALUATE_SIZE+1]; //RGB phase, parametrized by the cosine (see TableCoordinate())
+	float ctable[MIE_SAMPLE_SIZE+1]; //inverse cdf, cos(theta) for uniform u
 };
 
 class BaseLight{
@@ -41,8 +48,16 @@ public:
 	virtual sfloat4 Evaluate(const sfloat4 &) const = 0; //evaluate radiance for some direction
 	virtual sfloat1 Pdf(const sfloat4 &) const = 0;
 	virtual sfloat4 Sample(const sfloat4 &, const sfloat1 &, const sfloat1 &) const = 0;
+	virtual float4 Irradiance() const = 0; //rgb irradiance on a surface facing the light
+	//All the lights as a single mixture: one light per sample, selected in proportion to the irradiance
+	static void InitializeSelection();
+	static sfloat4 EvaluateAll(const sfloat4 &);
+	static sfloat1 PdfAll(const sfloat4 &);
+	static sfloat4 SampleAll(const sfloat4 &, const sfloat1 &, const sfloat1 &);
+	static float4 IrradianceAll();
 	static void DeleteAll();
 	static std::vector<BaseLight *> lights;
+	static std::vector<float> lprob, lalias, lpmf; //selection alias table and probabilities
 };
 
 class SunLight : public BaseLight{
@@ -52,6 +67,7 @@ public:
 	sfloat4 Evaluate(const sfloat4 &) const;
 	sfloat1 Pdf(const sfloat4 &) const;
 	sfloat4 Sample(const sfloat4 &, const sfloat1 &, const sfloat1 &) const;
+	float4 Irradiance() const;
 	dfloat3 direction;
 	dfloat3 color; //color*intensity
 	float angle; //cross-section angle
@@ -63,6 +79,8 @@ public:
 	BaseEnv();
 	~BaseEnv();
 	virtual sfloat4 Evaluate(const sfloat4 &) const = 0;
+	virtual sfloat1 Pdf(const sfloat4 &) const = 0; //solid angle pdf of Sample()
+	virtual sfloat4 Sample(const sfloat1 &, const sfloat1 &) const = 0;
 };
 
 class NullEnv : public BaseEnv{
@@ -70,6 +88,8 @@ public:
 	NullEnv();
 	~NullEnv();
 	virtual sfloat4 Evaluate(const sfloat4 &) const;
+	virtual sfloat1 Pdf(const sfloat4 &) const;
+	virtual sfloat4 Sample(const sfloat1 &, const sfloat1 &) const;
 	static NullEnv nenv;
 };
 
@@ -78,7 +98,10 @@ public:
 	MapEnv();
 	~MapEnv();
 	dfloat4 * Initialize(uint, uint);
+	bool InitializeSampling();
 	sfloat4 Evaluate(const sfloat4 &) const;
+	sfloat1 Pdf(const sfloat4 &) const;
+	sfloat4 Sample(const sfloat1 &, const sfloat1 &) const;
 	void Destroy();
 /*private:
 	float P(int, int, float) const;
@@ -92,6 +115,11 @@ public:
 private:
 	dfloat4 *ptex;
 	uint w, h;
+	//Luminance distribution over the texels (lat-long cells, weighted by sin(theta)). The rows are sampled with the
+	//marginal alias table and the columns with the conditional table of the row; pdf is the density in texture space.
+	float *pmprob, *pmalias; //h
+	float *pcprob, *pcalias; //w*h
+	float *ppdf; //w*h
 public:
 	static MapEnv genv;
 };
@@ -3,6 +3,21 @@
 #ifdef USE_EMBREE
 #include <embree2/rtcore.h>
 #include <embree2/rtcore_ray.h>
+
+//ray packet matching the kernel width
+#if BLCLOUD_VSIZE == 16
+#define RTCRayN RTCRay16
+#define rtcIntersectN rtcIntersect16
+#define RTC_INTERSECTN RTC_INTERSECT16
+#elif BLCLOUD_VSIZE == 8
+#define RTCRayN RTCRay8
+#define rtcIntersectN rtcIntersect8
+#define RTC_INTERSECTN RTC_INTERSECT8
+#else
+#define RTCRayN RTCRay4
+#define rtcIntersectN rtcIntersect4
+#define RTC_INTERSECTN RTC_INTERSECT4
+#endif
 #endif
 
 #include "scene.h"
@@ -21,7 +36,7 @@ void SceneOcclusion::Initialize(){
 	DebugPrintf("> Preparing occlusion geometry...\n");
 
 	pdev = rtcNewDevice(0);
-	pscene = rtcDeviceNewScene(pdev,RTC_SCENE_STATIC|RTC_SCENE_INCOHERENT|RTC_SCENE_HIGH_QUALITY,RTC_INTERSECT4);
+	pscene = rtcDeviceNewScene(pdev,RTC_SCENE_STATIC|RTC_SCENE_INCOHERENT|RTC_SCENE_HIGH_QUALITY,RTC_INTERSECTN);
 
 	for(uint i = 0; i < SceneData::Surface::objs.size(); ++i){
 		if(!SceneData::Surface::objs[i]->flags & SCENEOBJ_HOLDOUT)
@@ -58,7 +73,7 @@ sint1 SceneOcclusion::Intersect(const sfloat4 &ro, const sfloat4 &rd, const sflo
 	//TODO: check if number of occluders > 0 to skip the initialization when not needed
 	//RTCRayNt<BLCLOUD_VSIZE> ray;
 #ifdef USE_EMBREE
-	RTCRay4 ray;
+	RTCRayN ray;
 	for(uint i = 0; i < BLCLOUD_VSIZE; ++i){
 		dfloat4 RO = dfloat4(ro.get(i));
 		ray.orgx[i] = RO.x;
@@ -77,7 +92,7 @@ sint1 SceneOcclusion::Intersect(const sfloat4 &ro, const sfloat4 &rd, const sflo
 		ray.primID[i] = RTC_INVALID_GEOMETRY_ID;
 	}
 
-	rtcIntersect4(&gm.v,pscene,ray);
+	rtcIntersectN(&gm.v,pscene,ray);
 
 	dintN mask;
 	for(uint i = 0; i < BLCLOUD_VSIZE; ++i){
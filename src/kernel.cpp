@@ -9,78 +9,151 @@
 #include "ArHosekSkyModel.h"
 #endif
 
-#include <random>
 #include <cfloat>
 //#include <fenv.h>
 
 #include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+
+//Counter-based rng: every number is a hash of the stream key and a counter. The streams are keyed by pixel
+//(and by path in the wavefront integrator), so no shared state or locking is needed and a tile renders the same
+//every time. State: v[0] = key, v[1] = counter.
+//https://nullprogram.com/blog/2018/07/31/ (lowbias32)
+inline sint1 RNG_Hash(const sint1 &z){
+	sint1 x = sint1::Xor(z,z.ShiftRight<16>());
+	x = x*sint1(0x7feb352du);
+	x = sint1::Xor(x,x.ShiftRight<15>());
+	x = x*sint1(0x846ca68bu);
+	return sint1::Xor(x,x.ShiftRight<16>());
+}
 
-#define USE_SSE2
-#include "sse_mathfun.h"
-
-//https://developer.nvidia.com/gpugems/GPUGems3/gpugems3_ch37.html
-//vectorized version
-inline __m128i RNG_TausStep(__m128i z, __m128i s1, __m128i s2, __m128i s3, __m128i m){
-	__m128i a, b;
-	a = _mm_sll_epi32(z,s1);
-	a = _mm_xor_si128(a,z);
-	a = _mm_srl_epi32(a,s2);
-	b = _mm_and_si128(z,m);
-	b = _mm_sll_epi32(b,s3);
-	b = _mm_xor_si128(b,a);
-	return b;
-}
-
-inline __m128i RNG_LCGStep(__m128i z, __m128i a, __m128i c){
-	__m128i t1 = _mm_mul_epu32(a,z);
-	__m128i t2 = _mm_mul_epu32(_mm_srli_si128(a,4),_mm_srli_si128(z,4));
-	__m128i az = _mm_unpacklo_epi32(_mm_shuffle_epi32(t1,_MM_SHUFFLE(0,0,2,0)),_mm_shuffle_epi32(t2,_MM_SHUFFLE(0,0,2,0)));
-	__m128i rr = _mm_add_epi32(az,c);
-	return rr;
-}
-
-//_mm_ctf_epu32 from the web somewhere
-inline __m128 _mm_ctf_epu32(const __m128i v){
-	const __m128 two16 = _mm_set1_ps(0x10000);
+//unsigned int -> float conversion
+inline sfloat1 RNG_ConvertU32(const sint1 &v){
+	const sfloat1 two16 = sfloat1((float)0x10000);
 	//Avoid double rounding by doing two exact conversions
 	//of high and low 16-bit segments
-	const __m128i hi = _mm_srli_epi32(v,16);
-	const __m128i lo = _mm_srli_epi32(_mm_slli_epi32(v,16),16);
-	const __m128 fhi = _mm_mul_ps(_mm_cvtepi32_ps(hi),two16);
-	const __m128 flo = _mm_cvtepi32_ps(lo);
+	const sint1 hi = v.ShiftRight<16>();
+	const sint1 lo = v.ShiftLeft<16>().ShiftRight<16>();
+	const sfloat1 fhi = sfloat1(VL_PS(cvtepi32)(hi.v))*two16;
+	const sfloat1 flo = VL_PS(cvtepi32)(lo.v);
 	//do single rounding according to current rounding mode
-	return _mm_add_ps(fhi,flo);
-}
-
-inline __m128 RNG_Sample(sint4 *prs){
-	__m128i x;
-	x = _mm_xor_si128(prs->v[0].v,prs->v[1].v);
-	x = _mm_xor_si128(x,prs->v[2].v);
-	x = _mm_xor_si128(x,prs->v[3].v);
-	//__m128 q = _mm_castsi128_ps(x);
-	__m128 q = _mm_ctf_epu32(x);
-	__m128 f = _mm_set_ps1(2.3283064365387e-10f);
-	__m128 r = _mm_mul_ps(f,q);
-	prs->v[0].v = RNG_TausStep(prs->v[0].v,_mm_set1_epi32(13),_mm_set1_epi32(19),_mm_set1_epi32(12),_mm_set1_epi32(4294967294u));
-	prs->v[1].v = RNG_TausStep(prs->v[1].v,_mm_set1_epi32(2),_mm_set1_epi32(25),_mm_set1_epi32(4),_mm_set1_epi32(4294967288u));
-	prs->v[2].v = RNG_TausStep(prs->v[2].v,_mm_set1_epi32(3),_mm_set1_epi32(11),_mm_set1_epi32(17),_mm_set1_epi32(4294967280u));
-	prs->v[3].v = RNG_LCGStep(prs->v[3].v,_mm_set1_epi32(1664525u),_mm_set1_epi32(1013904223u));
-	return r;
+	return fhi+flo;
 }
 
-inline void RNG_Init(sint4 *prs){
-	//use mersenne twister to initialize the vectorized rng
-	static std::mt19937 mt(1000);
-	static std::uniform_int_distribution<int> rr(256,std::numeric_limits<int>::max());
-	static tbb::spin_mutex sm;
-	for(uint i = 0; i < 4; ++i){
-		uint rs[BLCLOUD_VSIZE];
-		sm.lock();
-		for(uint j = 0; j < BLCLOUD_VSIZE; ++j)
-			rs[j] = rr(mt);
-		sm.unlock();
-		prs->v[i].v = _mm_set_epi32(rs[0],rs[1],rs[2],rs[3]);
+inline sint1 RNG_Next(sint4 *prs){
+	sint1 x = RNG_Hash(sint1::Xor(prs->v[0],RNG_Hash(prs->v[1])));
+	prs->v[1] = prs->v[1]+sint1(1);
+	return x;
+}
+
+inline sfloat1 RNG_Sample(sint4 *prs){
+	return RNG_ConvertU32(RNG_Next(prs))*2.3283064365387e-10f;
+}
+
+inline void RNG_Init(sint4 *prs, const sint1 &key){
+	prs->v[0] = RNG_Hash(key);
+	prs->v[1] = sint1(0);
+	prs->v[2] = sint1(0);
+	prs->v[3] = sint1(0);
+}
+
+//Samplers for the dimensions that benefit the most from stratification: the first free-flight distance of each
+//ray, and the phase, light and environment directions at each scattering event. Each scattering order (event) owns
+//two 4D sets of dimensions; the rest of the decisions (subsequent woodcock steps, higher orders) use RNG_Sample().
+//The sampler state is kept along with the rng: v[2] = sample index of the pixel, v[3] = pixel seed.
+enum SAMPLER_DIM{
+	SAMPLER_DIM_FREEFLIGHT, //first collision distance along the ray leaving the event
+	SAMPLER_DIM_LIGHTFLIGHT, //-- along the light and environment rays
+	SAMPLER_DIM_ENV, //environment direction (2D)
+	SAMPLER_DIM_PHASE = 4, //phase direction (2D)
+	SAMPLER_DIM_LIGHT = 6, //light direction (2D)
+	SAMPLER_DIM_COUNT = 8
+};
+
+#define SAMPLER_MAX_EVENTS 4 //scattering orders with stratified dimensions
+
+class BaseSampler{
+public:
+	BaseSampler(){}
+	virtual ~BaseSampler(){}
+	virtual sfloat1 Sample(sint4 *, const sint1 &, SAMPLER_DIM) const = 0;
+};
+
+class RandomSampler : public BaseSampler{
+public:
+	sfloat1 Sample(sint4 *prs, const sint1 &e, SAMPLER_DIM d) const{
+		return RNG_Sample(prs);
+	}
+	static RandomSampler grandom;
+};
+
+//Owen-scrambled Sobol, padded with independently scrambled and shuffled 4D sets
+//http://www.jcgt.org/published/0009/04/01/
+class SobolSampler : public BaseSampler{
+public:
+	sfloat1 Sample(sint4 *prs, const sint1 &e, SAMPLER_DIM d) const{
+		sfloat1 u = RNG_Sample(prs); //always drawn to keep the rng sequence independent of the dimensions
+		sint1 set = e+e+sint1(d>>2);
+		sint1 seed = RNG_Hash(sint1::Xor(prs->v[3],RNG_Hash(set)));
+		sint1 x = Sobol(NestedUniformScramble(prs->v[2],seed),d&3);
+		x = NestedUniformScramble(x,RNG_Hash(seed+sint1(d&3)));
+		sfloat1 q = RNG_ConvertU32(x)*2.3283064365387e-10f;
+		return sfloat1::select(u,q,sint1::Less(e,sint1(SAMPLER_MAX_EVENTS)));
+	}
+	static SobolSampler gsobol;
+private:
+	static inline sint1 ReverseBits(sint1 x){
+		x = sint1::Or(sint1::And(x.ShiftRight<1>(),sint1(0x55555555)),sint1::And(x,sint1(0x55555555)).ShiftLeft<1>());
+		x = sint1::Or(sint1::And(x.ShiftRight<2>(),sint1(0x33333333)),sint1::And(x,sint1(0x33333333)).ShiftLeft<2>());
+		x = sint1::Or(sint1::And(x.ShiftRight<4>(),sint1(0x0f0f0f0f)),sint1::And(x,sint1(0x0f0f0f0f)).ShiftLeft<4>());
+		x = sint1::Or(sint1::And(x.ShiftRight<8>(),sint1(0x00ff00ff)),sint1::And(x,sint1(0x00ff00ff)).ShiftLeft<8>());
+		return sint1::Or(x.ShiftRight<16>(),x.ShiftLeft<16>());
 	}
+	static inline sint1 NestedUniformScramble(const sint1 &x, const sint1 &seed){
+		//Laine-Karras permutation of the reversed bits
+		sint1 y = ReverseBits(x)+seed;
+		y = sint1::Xor(y,y*sint1(0x6c50b47c));
+		y = sint1::Xor(y,y*sint1(0xb82f1e52));
+		y = sint1::Xor(y,y*sint1(0xc7afe638));
+		y = sint1::Xor(y,y*sint1(0x8d22f6e6));
+		return ReverseBits(y);
+	}
+	static inline sint1 Sobol(sint1 index, uint d){
+		sint1 x = sint1(0);
+		for(uint i = 0; i < 32 && !sfloat1(sint1::Equal(index,sint1(0))).AllTrue(); ++i){
+			x = sint1::Xor(x,sint1::And(-sint1::And(index,sint1(1)),sint1(directions[d][i])));
+			index = index.ShiftRight<1>();
+		}
+		return x;
+	}
+	static const uint directions[4][32];
+};
+
+const uint SobolSampler::directions[4][32] = {
+	{0x80000000,0x40000000,0x20000000,0x10000000,0x08000000,0x04000000,0x02000000,0x01000000,
+	0x00800000,0x00400000,0x00200000,0x00100000,0x00080000,0x00040000,0x00020000,0x00010000,
+	0x00008000,0x00004000,0x00002000,0x00001000,0x00000800,0x00000400,0x00000200,0x00000100,
+	0x00000080,0x00000040,0x00000020,0x00000010,0x00000008,0x00000004,0x00000002,0x00000001},
+	{0x80000000,0xc0000000,0xa0000000,0xf0000000,0x88000000,0xcc000000,0xaa000000,0xff000000,
+	0x80800000,0xc0c00000,0xa0a00000,0xf0f00000,0x88880000,0xcccc0000,0xaaaa0000,0xffff0000,
+	0x80008000,0xc000c000,0xa000a000,0xf000f000,0x88008800,0xcc00cc00,0xaa00aa00,0xff00ff00,
+	0x80808080,0xc0c0c0c0,0xa0a0a0a0,0xf0f0f0f0,0x88888888,0xcccccccc,0xaaaaaaaa,0xffffffff},
+	{0x80000000,0xc0000000,0x60000000,0x90000000,0xe8000000,0x5c000000,0x8e000000,0xc5000000,
+	0x68800000,0x9cc00000,0xee600000,0x55900000,0x80680000,0xc09c0000,0x60ee0000,0x90550000,
+	0xe8808000,0x5cc0c000,0x8e606000,0xc5909000,0x6868e800,0x9c9c5c00,0xeeee8e00,0x5555c500,
+	0x8000e880,0xc0005cc0,0x60008e60,0x9000c590,0xe8006868,0x5c009c9c,0x8e00eeee,0xc5005555},
+	{0x80000000,0xc0000000,0x20000000,0x50000000,0xf8000000,0x74000000,0xa2000000,0x93000000,
+	0xd8800000,0x25400000,0x59e00000,0xe6d00000,0x78080000,0xb40c0000,0x82020000,0xc3050000,
+	0x208f8000,0x51474000,0xfbea2000,0x75d93000,0xa0858800,0x914e5400,0xdbe79e00,0x25db6d00,
+	0x58800080,0xe54000c0,0x79e00020,0xb6d00050,0x800800f8,0xc00c0074,0x200200a2,0x50050093}
+};
+
+RandomSampler RandomSampler::grandom;
+SobolSampler SobolSampler::gsobol;
+
+//per-pixel seed for the sampler scrambling (px: tile pixel index)
+inline sint1 SamplerSeed(const sint1 &px, uint x0, uint y0, uint w){
+	return RNG_Hash(sint1::Xor(RNG_Hash(px),sint1(y0*w+x0)));
 }
 
 //multiply four vectors simultaneously
@@ -93,45 +166,955 @@ inline sfloat4 mul(const sfloat4 &v, const matrix44 &m){
 	return r;
 }
 
-inline float SampleVoxelSpace(const float4 &p, float *pvol, const float4 &ce, uint lvoxc){
-	float4 nv = float4((float)lvoxc);
-	float4 ni = -0.5f*(ce-ce.splat<3>()-p)*(nv-float4::one())/ce.splat<3>();
-	float4 nf = float4::max(float4::floor(ni),float4::zero()); //max() shouldn't be necessary?
-	float4 nc = float4::min(float4::ceil(ni),nv-float4::one());
-	float4 nl = ni-nf;
+//Trilinear brick lookup for all lanes at once. The corner indices are computed once and shared by the N
+//volume buffers, which are then fetched with gathers. Lanes where m[k] == 0 are not fetched and return zero.
+template<uint N>
+inline void SampleVoxelSpace(const sfloat4 &p, const sfloat4 &ce, const float *const *ppvol, const sint1 *poffs, const sfloat1 *pm, uint lvoxc, sfloat1 *pr){
+	sfloat1 nv = sfloat1((float)(lvoxc-1));
+	sfloat1 ns = 0.5f*nv/ce.v[3];
+
+	sfloat1 nf[3], nc[3], nl[3];
+	for(uint k = 0; k < 3; ++k){
+		sfloat1 ni = (p.v[k]-ce.v[k]+ce.v[3])*ns;
+		nf[k] = sfloat1::max(sfloat1::floor(ni),sfloat1::zero());
+		nc[k] = sfloat1::min(sfloat1::ceil(ni),nv);
+		nl[k] = ni-nf[k];
+		//Safe-guard to clamp indices. There's a rare case where indices go out bounds.
+		nf[k] = sfloat1::min(nf[k],nv);
+		nc[k] = sfloat1::max(nc[k],sfloat1::zero());
+	}
+
+	sfloat1 n1 = sfloat1((float)lvoxc);
+	sfloat1 n2 = sfloat1((float)(lvoxc*lvoxc));
+	sfloat1 xs[2] = {nf[0],nc[0]};
+	sfloat1 ys[2] = {nf[1]*n1,nc[1]*n1};
+	sfloat1 zs[2] = {nf[2]*n2,nc[2]*n2};
+	sint1 ci[8]; //corner i = (x,y,z) bits
+	for(uint i = 0; i < 8; ++i)
+		ci[i] = sint1::convert(zs[i>>2]+ys[(i>>1)&1]+xs[i&1]);
+
+	for(uint k = 0; k < N; ++k){
+		sfloat1 c[8];
+		for(uint i = 0; i < 8; ++i)
+			c[i] = sfloat1::gather(ppvol[k],ci[i]+poffs[k],pm[k]);
+		sfloat1 u[4];
+		for(uint i = 0; i < 4; ++i)
+			u[i] = sfloat1::lerp(c[2*i+0],c[2*i+1],nl[0]); //([x,y0,z0],[x,y1,z0],[x,y0,z1],[x,y1,z1])
+		sfloat1 v0 = sfloat1::lerp(u[0],u[1],nl[1]);
+		sfloat1 v1 = sfloat1::lerp(u[2],u[3],nl[1]);
+		pr[k] = sfloat1::And(pm[k],sfloat1::lerp(v0,v1,nl[2]));
+	}
+}
+
+//Leaf data of the lanes qm for the volume lookups: center and extent, majorant (1 for the sdf leaves and the
+//inactive lanes), majorant outside the surface (the fog maximum, 0 if no fog), sole fog mask, fog mask and brick
+//offsets, and majorant grid offset. The sdf leaves whose minimum distance is positive lie entirely outside the
+//surface, and are handled as fog leaves, so that they are crossed at the majorant of the fog alone.
+static void LoadLeaves(const duintN &nodes, const sfloat1 &qm, RenderKernel *pkernel, sfloat4 *pce, sfloat1 *psmax, sfloat1 *psfog, sint1 *pvm, sint1 *pfm, sint1 *pvx, sint1 *pgx){
+	dfloatN smax1, sfog1;
+	dintN QM = dintN(qm);
+	dintN VM, FM, VX[VOLUME_BUFFER_COUNT], GX;
+	*pce = sfloat4::zero();
+	for(uint j = 0; j < BLCLOUD_VSIZE; ++j){
+		if(QM.v[j] != 0){
+			const OctreeNode &node = pkernel->pscene->pnodes[nodes.v[j]];
+			const OctreeLeaf &leaf = pkernel->pscene->pleafdata[node.leaf];
+			pce->set(j,float4::load(&node.ce));
+			sfog1.v[j] = leaf.volx[VOLUME_BUFFER_FOG] != ~0u?leaf.qval[VOLUME_BUFFER_FOG]:0.0f;
+			if(leaf.volx[VOLUME_BUFFER_SDF] != ~0u && leaf.qval[VOLUME_BUFFER_SDF] <= 0.0f){
+				smax1.v[j] = 1.0f;
+				VM.v[j] = 0;
+			}else{
+				smax1.v[j] = sfog1.v[j];
+				VM.v[j] = -1;
+			}
+			FM.v[j] = leaf.volx[VOLUME_BUFFER_FOG] != ~0u?-1:0;
+			for(uint k = 0; k < VOLUME_BUFFER_COUNT; ++k)
+				VX[k].v[j] = pkernel->pscene->lvoxc3*leaf.volx[k];
+			GX.v[j] = SCENE_QGRID3*node.leaf;
+		}else{
+			smax1.v[j] = 1.0f; //keeps p/smax negative, so that rm is not changed for the inactive lanes
+			sfog1.v[j] = 0.0f;
+			VM.v[j] = 0;
+			FM.v[j] = 0;
+			for(uint k = 0; k < VOLUME_BUFFER_COUNT; ++k)
+				VX[k].v[j] = 0;
+			GX.v[j] = 0;
+		}
+	}
+	*psmax = sfloat1::load(&smax1);
+	*psfog = sfloat1::load(&sfog1);
+	*pvm = sint1::load(&VM);
+	*pfm = sint1::load(&FM);
+	for(uint k = 0; k < VOLUME_BUFFER_COUNT; ++k)
+		pvx[k] = sint1::load(&VX[k]);
+	*pgx = sint1::load(&GX);
+}
+
+#define INTERIOR_LIPSCHITZ 1.7320508f //gradient bound of the trilinearly interpolated sdf
+
+#define MAJORANT_GRID_MIN_COLLISIONS 1.0f //expected tentative collisions in the leaf to step the sub-bricks instead
+
+//3D-DDA through the sub-brick majorant grids of the leaves along o+rd*s, up to se. The state is kept between the
+//tentative collisions, so that the majorant is only fetched when a cell boundary is crossed. The cells at the leaf
+//majorant smax bound the whole leaf, and are not stepped out of; the cell is sought again if the position has
+//moved past it. The leaves that smax already crosses with few collisions are tracked at smax as a single cell,
+//since the cell crossings would cost more than the collisions saved.
+struct MajorantGrid{
+	MajorantGrid(const sfloat4 &_o, const sfloat4 &_rd, const sfloat1 &s, const sfloat1 &_se, const sfloat4 &ce, const sint1 &_gx, const sfloat1 &_smax, const sfloat1 &msigmae, const sfloat1 &qm, RenderKernel *pkernel) : o(_o), rd(_rd), se(_se), smax(_smax), gx(_gx), pqgrid(pkernel->pscene->pqgrid){
+		um = sfloat1::And(qm,sfloat1::Greater(msigmae*smax*(se-s),sfloat1(MAJORANT_GRID_MIN_COLLISIONS)));
+		m = smax;
+		for(uint k = 0; k < 3; ++k)
+			tm[k] = sfloat1(FLT_MAX);
+		if(um.AllFalse())
+			return;
+		sfloat1 zr = sfloat1::zero();
+		gw = 2.0f*ce.v[3]/sfloat1((float)SCENE_QGRID);
+		for(uint k = 0; k < 3; ++k){
+			cb[k] = ce.v[k]-ce.v[3];
+			sfloat1 pm = sfloat1::GreaterOrEqual(rd.v[k],zr);
+			sp[k] = sfloat1::select(sfloat1(-1.0f),sfloat1::one(),pm);
+			sfloat1 zm = sfloat1::Or(sfloat1::Equal(rd.v[k],zr),sfloat1::AndNot(um,sint1::trueI()));
+			tr[k] = sfloat1::select(gw/rd.v[k],sfloat1(FLT_MAX),zm);
+			tn[k] = sfloat1::abs(tr[k]);
+		}
+		Seek(s,um);
+	}
+
+	//Move the lanes qm to the cell at s
+	void Seek(const sfloat1 &s, const sfloat1 &qm){
+		sfloat1 zr = sfloat1::zero();
+		sfloat1 gn1 = sfloat1((float)(SCENE_QGRID-1));
+		for(uint k = 0; k < 3; ++k){
+			sfloat1 g = (o.v[k]+rd.v[k]*s-cb[k])/gw;
+			ci[k] = sfloat1::select(ci[k],sfloat1::min(sfloat1::max(sfloat1::floor(g),zr),gn1),qm);
+			sfloat1 tb = s+(ci[k]+sfloat1::And(sfloat1::Greater(sp[k],zr),sfloat1::one())-g)*tr[k]; //next cell boundary
+			tm[k] = sfloat1::select(tm[k],sfloat1::select(sfloat1::max(tb,s),sfloat1(FLT_MAX),sfloat1::Equal(tn[k],sfloat1(FLT_MAX))),qm);
+		}
+		m = sfloat1::select(m,Fetch(qm),qm);
+	}
+
+	sfloat1 Fetch(const sfloat1 &qm) const{
+		sfloat1 gn = sfloat1((float)SCENE_QGRID);
+		return sfloat1::gather(pqgrid,gx+sint1::convert(ci[0]+gn*(ci[1]+gn*ci[2])),qm);
+	}
+
+	//Position of the next tentative collision after s in the lanes qm, for the unit exponential optical depth tau.
+	//Before sg (the interior gap) the majorant is 1, and up to sk (the sdf ball outside the surface) it's capped at
+	//mf. For residual tracking the majorants are taken relative to the control pc (0 for delta tracking). The lanes
+	//that don't collide before se return se. Returns the majorant at the collision in pms.
+	sfloat1 Step(sfloat1 s, sfloat1 tau, const sfloat1 &sg, const sfloat1 &sk, const sfloat1 &mf, const sfloat1 &pc, const sfloat1 &msigmae, sfloat1 qm, sfloat1 *pms){
+		sfloat1 ms = sfloat1::one();
+
+		sfloat1 gm = sfloat1::And(qm,sfloat1::Less(s,sg));
+		if(gm.AnyTrue()){
+			sfloat1 mr = sfloat1::max(sfloat1::one()-pc,pc);
+			sfloat1 dt = msigmae*mr*(sg-s);
+			sfloat1 hm = sfloat1::And(gm,sfloat1::Less(tau,dt));
+			s = sfloat1::select(s,s+tau/(msigmae*mr),hm);
+			ms = sfloat1::select(ms,mr,hm);
+			gm = sfloat1::AndNot(hm,gm);
+			tau = sfloat1::select(tau,tau-dt,gm);
+			s = sfloat1::select(s,sg,gm);
+			qm = sfloat1::AndNot(hm,qm);
+		}
+
+		if(um.AllFalse()){
+			//single cell at smax: exponential across the sdf ball and the rest of the leaf
+			sfloat1 mb = sfloat1::max(sfloat1::min(smax,mf)-pc,pc);
+			sfloat1 mr = sfloat1::max(smax-pc,pc);
+			sfloat1 a = sfloat1::max(sfloat1::min(sk,se)-s,sfloat1::zero());
+			sfloat1 ts = msigmae*mb*a;
+			sfloat1 bm = sfloat1::Less(tau,ts);
+			sfloat1 sc = sfloat1::select(s+a+(tau-ts)/(msigmae*mr),s+tau/(msigmae*mb),bm);
+			sc = sfloat1::min(sc,se);
+			*pms = sfloat1::select(ms,sfloat1::select(mr,mb,bm),qm);
+			return sfloat1::select(s,sc,qm);
+		}
+
+		for(;;){
+			qm = sfloat1::And(qm,sfloat1::Less(s,se));
+			if(qm.AllFalse())
+				break;
+			sfloat1 e = sfloat1::min(sfloat1::min(tm[0],tm[1]),tm[2]);
+			sfloat1 rm = sfloat1::And(qm,sfloat1::Less(e,s));
+			if(rm.AnyTrue()){
+				Seek(s,rm);
+				e = sfloat1::min(sfloat1::min(tm[0],tm[1]),tm[2]);
+			}
+			sfloat1 fm = sfloat1::GreaterOrEqual(m,smax);
+			e = sfloat1::select(sfloat1::min(e,se),se,fm);
+			sfloat1 bm = sfloat1::Less(s,sk);
+			e = sfloat1::max(sfloat1::select(e,sfloat1::min(e,sk),bm),s);
+
+			sfloat1 mr = sfloat1::max(sfloat1::select(m,sfloat1::min(m,mf),bm)-pc,pc);
+			sfloat1 dt = msigmae*mr*(e-s);
+			sfloat1 hm = sfloat1::And(qm,sfloat1::Less(tau,dt));
+			s = sfloat1::select(s,s+tau/(msigmae*mr),hm);
+			ms = sfloat1::select(ms,mr,hm);
+
+			qm = sfloat1::AndNot(hm,qm);
+			tau = sfloat1::select(tau,tau-dt,qm);
+			s = sfloat1::select(s,e,qm);
+
+			sfloat1 cm = sfloat1::zero();
+			sfloat1 am = sfloat1::AndNot(fm,sfloat1::And(qm,sfloat1::Less(e,se)));
+			for(uint k = 0; k < 3; ++k){
+				sfloat1 sm = sfloat1::And(am,sfloat1::LessOrEqual(tm[k],e));
+				ci[k] = sfloat1::min(sfloat1::max(sfloat1::select(ci[k],ci[k]+sp[k],sm),sfloat1::zero()),sfloat1((float)(SCENE_QGRID-1)));
+				tm[k] = sfloat1::select(tm[k],tm[k]+tn[k],sm);
+				cm = sfloat1::Or(cm,sm);
+			}
+			if(cm.AnyTrue())
+				m = sfloat1::select(m,Fetch(cm),cm);
+		}
+
+		*pms = ms;
+		return s;
+	}
+
+	sfloat4 o, rd;
+	sfloat1 se; //leaf exit
+	sfloat1 smax; //leaf majorant
+	sfloat1 um; //lanes stepping the grid
+	sfloat1 cb[3]; //leaf corner
+	sfloat1 gw; //cell width
+	sfloat1 ci[3]; //current cell
+	sfloat1 tm[3]; //next cell boundary along each axis
+	sfloat1 tr[3]; //-- cell spacing along the ray (signed)
+	sfloat1 tn[3]; //-- absolute
+	sfloat1 sp[3]; //cell step
+	sfloat1 m; //majorant of the current cell
+	sint1 gx;
+	const float *pqgrid;
+};
+
+#define FREEFLIGHT_REFILL_OCCUPANCY 0.5f //average fraction of the lanes tracking per leaf iteration, below which the lanes are refilled
+
+//Lane refill of the primary free-flight. The lanes finishing a sample (scattered, escaped or stopped by the depth
+//limit) are passed to finish() and restarted with the next sample of their pixel until sc samples are done, so that the
+//packet stays full while the other lanes are still tracking. The leaves are indexed per lane, which requires the full
+//traverser. Restarting breaks the coherence of the lanes, so the packet first runs the samples in lockstep (the
+//finished lanes wait for the others), and switches to the refill only if the lanes tracking per leaf drop below
+//FREEFLIGHT_REFILL_OCCUPANCY of those with samples left on average.
+struct FreeFlightRefill{
+	FreeFlightRefill() : lc(0), wc(0), refill(false){}
+	KernelOctree::OctreeFullTraverser *ptrv;
+	std::function<void (const sfloat1 &, const sfloat1 &, const sfloat1 &, const sfloat1 &, const sfloat1 &)> finish; //lanes, rm, td, mm, ri
+	sint1 sc; //samples left
+	sfloat1 am; //lanes with a sample in flight
+	sint1 li; //leaf index of each lane
+	uint lc, wc; //lanes tracking, and the lanes with samples left, summed over the leaf iterations in lockstep
+	bool refill;
+};
+
+//Woodcock tracking through the octree leaves. Returns the mask of rays that didn't scatter (escaped, or
+//stopped by the depth limit), the distance travelled and the depth limit mask. If pnode is given, it receives the
+//leaf where each ray scattered (the next leaf if in the interior gap before it). If pri is given, it receives the
+//radius of a ball around the scattering location known to be inside the surface (0 if none), bounded with the
+//sdf sampled there, or in the interior gaps with the narrow band width. Outside the surface, the sdf sampled at the
+//leaf entry and at each null collision bounds a ball free of the surface, which is crossed at the fog majorant (sphere
+//tracing). Elsewhere the majorants of the sub-brick grid are used. ptrv is expected to be initialized. If prf is given,
+//the finished lanes are refilled with the next samples (prs->v[2] is the sample index of each lane), and the results
+//are returned through prf->finish(), with pnode already updated.
+static sfloat1 FreeFlight(const sfloat4 &ro, const sfloat4 &rd, const sfloat1 &gm, const sfloat1 &depth, RenderKernel *pkernel, KernelOctree::BaseOctreeTraverser *ptrv, sint4 *prs, const sint1 &se, SAMPLER_DIM sd, sfloat1 *ptd, sfloat1 *pmm, dintN *pnode, sfloat1 *pri, FreeFlightRefill *prf = 0){
+	sfloat1 msigmaa = sfloat1(pkernel->msigmaa);
+	sfloat1 msigmas = sfloat1(pkernel->msigmas);
+	sfloat1 msigmae = msigmaa+msigmas;
+
+	sfloat1 qm = gm;
+	sfloat1 mm = sint1::trueI(); //not occluded
+	sfloat1 rm = sint1::trueI(); //not scattering
+	sfloat1 zr = sfloat1::zero();
+
+	sfloat1 td = sfloat1::zero(); //distance travelled
+	sfloat1 ri = sfloat1::zero();
+	if(prf){
+		prf->am = gm;
+		prf->li = sint1(0);
+	}
+	for(uint i = 0;; ++i){
+		duintN nodes;
+		sfloat1 tra, trb;
+
+		for(;;){
+			dintN mask;
+			if(prf){
+				duintN LI;
+				sint1::store((int*)LI.v,prf->li);
+				mask = prf->ptrv->GetLeaf(LI,&nodes,tra,trb);
+			}else mask = ptrv->GetLeaf(i,&nodes,tra,trb);
+			sint1 lm = sint1::load(&mask);
+
+			mm = sfloat1::Less(td,depth);
+			qm = sfloat1::And(qm,mm);
+
+			qm = sfloat1::And(qm,rm);
+			qm = sfloat1::And(qm,lm);
+			if(!prf)
+				break;
+
+			sfloat1 fm = sfloat1::AndNot(qm,prf->am); //finished lanes
+			if(fm.AllFalse())
+				break;
+			prf->finish(fm,rm,td,mm,ri);
+			prf->sc = prf->sc-sint1::And(fm,sint1(1));
+			prf->am = sfloat1::AndNot(fm,prf->am);
+			if(!prf->refill && (float)prf->lc < FREEFLIGHT_REFILL_OCCUPANCY*(float)prf->wc)
+				prf->refill = true;
+			if(!prf->refill && prf->am.AnyTrue())
+				break; //the finished lanes wait for the packet to empty
+			sfloat1 nm = sfloat1::AndNot(prf->am,sint1::Greater(prf->sc,sint1(0))); //restarted lanes, including the waiting ones
+			prf->am = sfloat1::Or(prf->am,nm);
+			if(nm.AllFalse())
+				break;
+			td = sfloat1::AndNot(nm,td);
+			ri = sfloat1::AndNot(nm,ri);
+			rm = sfloat1::Or(rm,nm);
+			qm = sfloat1::Or(qm,nm);
+			prf->li = sint1::AndNot(nm,prf->li);
+			prs->v[2] = prs->v[2]+sint1::And(nm,sint1(1));
+		}
+		if(qm.AllFalse())
+			break;
+		if(prf && !prf->refill){
+			prf->lc += __builtin_popcount(qm.MoveMask());
+			prf->wc += __builtin_popcount(sfloat1::Or(prf->am,sint1::Greater(prf->sc,sint1(0))).MoveMask());
+		}
+
+		sfloat1 lo = td; //local origin
+
+		//trb = sfloat1::min(trb,maxd);
+		sfloat1 tr0 = tra-td;
+		sfloat1 tr1 = trb-td;
+
+		sfloat4 r0 = ro+rd*tra;
+
+		sint1 sm = sfloat1::Greater(tra,td);
+
+		sfloat4 ce;
+		sfloat1 smax, sfog; //local max in this leaf, and outside the surface
+		sint1 vm, fm, vx[VOLUME_BUFFER_COUNT], gx; //vm true: next leaf is a sole fog; false: sdf exists, but fog may not
+		LoadLeaves(nodes,qm,pkernel,&ce,&smax,&sfog,&vm,&fm,vx,&gx);
+		const float *const *ppvol = pkernel->pscene->pvol;
+
+		sfloat1 dm = sfloat1::AndNot(vm,qm); //sdf lanes entering a new leaf
+		sfloat1 d0 = sfloat1::one();
+		if(dm.AnyTrue()){
+			SampleVoxelSpace<1>(r0,ce,ppvol+VOLUME_BUFFER_SDF,vx+VOLUME_BUFFER_SDF,&dm,pkernel->pscene->lvoxc,&d0);
+			d0 = sfloat1::select(sfloat1::one(),d0,dm);
+		}
+
+		sm = sfloat1::And(sm,sfloat1::Or(sfloat1::Greater(d0,zr),vm)); //skip if outside the surface or the next leaf is a sole fog
+
+		sm = sfloat1::And(sm,qm); //can't allow any further changes in 'td' if qm == 0
+		td = sfloat1::Or(sfloat1::And(sm,tra),sfloat1::AndNot(sm,td));
 
-	//Safe-guard to clamp indices. There's a rare case where indices go out bounds.
-	nc = float4::max(float4::min(nc,float4(lvoxc-1)),float4(0));
-	nf = float4::max(float4::min(nf,float4(lvoxc-1)),float4(0));
+		sfloat1 s0 = sfloat1::Or(sfloat1::And(sm,tr0),sfloat1::AndNot(sm,zr)); //positive distance skipped (moving to next leaf)
+		sfloat1 sk = sfloat1::select(s0,tr0+d0*(1.0f/INTERIOR_LIPSCHITZ),sfloat1::And(dm,sfloat1::Greater(d0,zr))); //end of the ball outside the surface
+
+		sm = qm;
+
+		MajorantGrid mg(ro+rd*lo,rd,sfloat1::max(s0,tr0),tr1,ce,gx,smax,msigmae,qm,pkernel);
+		sfloat1 u0; //the first step is stratified
+		if(prf){
+			sfloat1 fl = sfloat1::And(qm,sint1::Equal(prf->li,sint1(0)));
+			prf->li = prf->li+sint1(1);
+			u0 = fl.AnyTrue()?sfloat1::select(RNG_Sample(prs),pkernel->psampler->Sample(prs,se,sd),fl):RNG_Sample(prs);
+		}else u0 = i == 0?pkernel->psampler->Sample(prs,se,sd):RNG_Sample(prs);
+		for(sfloat1 sc = s0, u = u0, ms, sh, d, p;; u = RNG_Sample(prs)){
+			sm = sfloat1::And(sm,rm);
+			if(sfloat1(sm).AllFalse())
+				break;
+			sc = mg.Step(sc,-sfloat1::log(u),tr0,sk,sfog,zr,msigmae,sm,&ms);
+			td = sfloat1::Or(sfloat1::And(sm,lo+sc),sfloat1::AndNot(sm,td));
+
+			sm = sfloat1::And(sm,sfloat1::Less(sc,tr1)); //check if out of extents
+			sh = sfloat1::Or(sm,sfloat1::AndNot(rm,sint1::trueI())); //prevent modifications if rm == false
+			td = sfloat1::Or(sfloat1::AndNot(sh,trb),sfloat1::And(sh,td));
+
+			//if sm == false, this is always true (so rm won't be changed)
+			//-> unless the ray has run out of leafs
+			if(pri){
+				sfloat1 gs = sfloat1::AndNot(sfloat1::Greater(sc,tr0),sm); //scattered in the interior gap
+				ri = sfloat1::select(ri,sfloat1::max(-d0*(1.0f/INTERIOR_LIPSCHITZ)-(tra-td),sfloat1(pkernel->sdfband/INTERIOR_LIPSCHITZ)),gs);
+			}
+			rm = sfloat1::Or(sfloat1::And(sm,sfloat1::Greater(sc,tr0)),sfloat1::AndNot(sm,rm));
+
+			sfloat4 rc = ro+rd*td;
+
+			sh = sfloat1::And(sm,rm);
+			if(sh.AnyTrue()){
+				//sdf and fog are fetched in the same pass; fog is only used where outside the surface
+				sfloat1 vm1[VOLUME_BUFFER_COUNT], vr[VOLUME_BUFFER_COUNT];
+				vm1[VOLUME_BUFFER_SDF] = sfloat1::AndNot(vm,sh);
+				vm1[VOLUME_BUFFER_FOG] = sfloat1::And(fm,sh);
+				SampleVoxelSpace<VOLUME_BUFFER_COUNT>(rc,ce,ppvol,vx,vm1,pkernel->pscene->lvoxc,vr);
+				d = sfloat1::select(sfloat1::one(),vr[VOLUME_BUFFER_SDF],vm1[VOLUME_BUFFER_SDF]);
+				p = sfloat1::select(sfloat1(-1.0f),vr[VOLUME_BUFFER_FOG],sfloat1::And(vm1[VOLUME_BUFFER_FOG],sfloat1::Greater(d,zr)));
+				sk = sfloat1::select(sk,sc+sfloat1::max(d,zr)*(1.0f/INTERIOR_LIPSCHITZ),vm1[VOLUME_BUFFER_SDF]);
+			}else{
+				d = sfloat1::one();
+				p = sfloat1(-1.0f);
+			}
+			sfloat1 q = RNG_Sample(prs);
+
+			//if(p > q || d < 0) break;
+			sfloat1 rm1 = sfloat1::And(rm,sfloat1::And(sfloat1::Less(p/ms,q),sfloat1::Greater(d,zr)));
+			if(pri)
+				ri = sfloat1::select(ri,sfloat1::max(-d*(1.0f/INTERIOR_LIPSCHITZ),zr),sfloat1::AndNot(rm1,sh));
+			rm = rm1;
+		}
+
+		if(pnode){
+			dintN SM = dintN(sfloat1::AndNot(rm,qm)); //scattered in this leaf
+			for(uint j = 0; j < BLCLOUD_VSIZE; ++j)
+				if(SM.v[j] != 0)
+					pnode->v[j] = nodes.v[j];
+		}
+	}
+
+	*ptd = td;
+	*pmm = mm;
+	if(pri)
+		*pri = ri;
+	return rm;
+}
+
+//Free-flight of the rays leaving the scattering locations ro, where the ball of radius ri is inside the surface
+//(uniform density 1). The distance within the ball is sampled analytically without any traversal or lookups, and
+//only the rays leaving it are tracked, from the ball boundary on. Initializes ptrv, restarting from the leaves rn of
+//ro (0 if unknown). The rays scattered within the ball keep rn in pnode. Otherwise as FreeFlight().
+static sfloat1 InteriorFlight(const sfloat4 &ro, const sfloat4 &rd, const sfloat1 &gm, const sfloat1 &ri, const dintN &rn, RenderKernel *pkernel, KernelOctree::BaseOctreeTraverser *ptrv, sint4 *prs, const sint1 &se, SAMPLER_DIM sd, sfloat1 *ptd, sfloat1 *pmm, dintN *pnode, sfloat1 *pri){
+	sfloat1 zr = sfloat1::zero();
+	sfloat1 im = sfloat1::And(gm,sfloat1::Greater(ri,zr));
+	*pnode = rn;
+	if(im.AllFalse()){
+		ptrv->Initialize(ro,rd,gm,pkernel->pscene->pnodes,rn,pkernel->pparent);
+		return FreeFlight(ro,rd,gm,sfloat1(FLT_MAX),pkernel,ptrv,prs,se,sd,ptd,pmm,pnode,pri);
+	}
+
+	sfloat1 msigmae = sfloat1(pkernel->msigmaa+pkernel->msigmas);
+	sfloat1 t = -sfloat1::log(pkernel->psampler->Sample(prs,se,sd))/msigmae;
+	im = sfloat1::And(im,sfloat1::Less(t,ri)); //scattered within the ball
+
+	sfloat1 rm = sfloat1::AndNot(im,sint1::trueI());
+	sfloat1 td = sfloat1::And(im,t);
+	sfloat1 mm = sint1::trueI();
+	sfloat1 ri1 = sfloat1::And(im,ri-t);
+
+	sfloat1 gm1 = sfloat1::AndNot(im,gm);
+	if(gm1.AnyTrue()){
+		//the free-flight is memoryless, so the rest start over at the ball boundary, with fresh random numbers since the stratified sample was used
+		sfloat1 rb = sfloat1::And(gm1,ri);
+		sfloat4 rb4 = ro+rd*rb;
+		sint1 se1 = sint1(sfloat1::select(sfloat1(se),sfloat1(sint1(SAMPLER_MAX_EVENTS)),sfloat1::Greater(rb,zr)));
+		ptrv->Initialize(rb4,rd,gm1,pkernel->pscene->pnodes,rn,pkernel->pparent);
+
+		sfloat1 td1, mm1, ri2;
+		sfloat1 rm1 = FreeFlight(rb4,rd,gm1,sfloat1(FLT_MAX),pkernel,ptrv,prs,se1,sd,&td1,&mm1,pnode,&ri2);
+		rm = sfloat1::select(rm,rm1,gm1);
+		td = sfloat1::select(td,rb+td1,gm1);
+		mm = sfloat1::select(mm,mm1,gm1);
+		ri1 = sfloat1::select(ri1,ri2,gm1);
+	}
+
+	*ptd = td;
+	*pmm = mm;
+	if(pri)
+		*pri = ri1;
+	return rm;
+}
+
+//Extinction density (per unit msigmae) at rc in the leaves: 1 inside the surface, otherwise the fog clamped to
+//the majorant. If pd is given, it receives the sdf (1 where none).
+static sfloat1 SampleDensity(const sfloat4 &rc, const sfloat4 &ce, const sfloat1 &qm, const sfloat1 &smax, const sint1 &vm, const sint1 &fm, const sint1 *pvx, RenderKernel *pkernel, sfloat1 *pd){
+	sfloat1 vm1[VOLUME_BUFFER_COUNT], vr[VOLUME_BUFFER_COUNT];
+	vm1[VOLUME_BUFFER_SDF] = sfloat1::AndNot(vm,qm);
+	vm1[VOLUME_BUFFER_FOG] = sfloat1::And(fm,qm);
+	SampleVoxelSpace<VOLUME_BUFFER_COUNT>(rc,ce,pkernel->pscene->pvol,pvx,vm1,pkernel->pscene->lvoxc,vr);
+	sfloat1 d = sfloat1::select(sfloat1::one(),vr[VOLUME_BUFFER_SDF],vm1[VOLUME_BUFFER_SDF]);
+	sfloat1 p = sfloat1::min(sfloat1::max(vr[VOLUME_BUFFER_FOG],sfloat1::zero()),smax);
+	if(pd)
+		*pd = d;
+	return sfloat1::select(p,sfloat1::one(),sfloat1::LessOrEqual(d,sfloat1::zero()));
+}
+
+//Mask of the lanes dm entering an sdf leaf at r0 from inside the surface; the gap before the leaf is then inside
+//the volume, since the interior nodes were removed
+static sfloat1 InteriorGap(const sfloat4 &r0, const sfloat4 &ce, sfloat1 dm, const sint1 *pvx, RenderKernel *pkernel){
+	if(dm.AnyTrue()){
+		sfloat1 d0;
+		SampleVoxelSpace<1>(r0,ce,pkernel->pscene->pvol+VOLUME_BUFFER_SDF,pvx+VOLUME_BUFFER_SDF,&dm,pkernel->pscene->lvoxc,&d0);
+		dm = sfloat1::And(dm,sfloat1::LessOrEqual(d0,sfloat1::zero()));
+	}
+	return dm;
+}
+
+//Deterministic optical depth (per unit msigmae) along the rays, ray marching each leaf with lvoxc midpoint steps.
+//The density is the same as the one tracked by FreeFlight(). ptrv is expected to be initialized.
+static sfloat1 OpticalDepth(const sfloat4 &ro, const sfloat4 &rd, const sfloat1 &gm, RenderKernel *pkernel, KernelOctree::BaseOctreeTraverser *ptrv){
+	sfloat1 zr = sfloat1::zero();
+	sfloat1 tau = sfloat1::zero();
+	sfloat1 td = sfloat1::zero(); //end of the previous leaf
+	for(uint i = 0;; ++i){
+		duintN nodes;
+		sfloat1 tra, trb;
+
+		dintN mask = ptrv->GetLeaf(i,&nodes,tra,trb);
+		sfloat1 qm = sfloat1::And(gm,sint1::load(&mask));
+		if(qm.AllFalse())
+			break;
+
+		sfloat4 ce;
+		sfloat1 smax, sfog;
+		sint1 vm, fm, vx[VOLUME_BUFFER_COUNT], gx;
+		LoadLeaves(nodes,qm,pkernel,&ce,&smax,&sfog,&vm,&fm,vx,&gx);
+
+		sfloat1 dm = InteriorGap(ro+rd*tra,ce,sfloat1::AndNot(vm,sfloat1::And(qm,sfloat1::Greater(tra,td))),vx,pkernel);
+		tau += sfloat1::And(dm,tra-td);
+
+		sfloat1 ta = sfloat1::max(tra,td);
+		sfloat1 h = sfloat1::And(qm,sfloat1::max(trb-ta,zr)/sfloat1((float)pkernel->pscene->lvoxc));
+		for(uint k = 0; k < pkernel->pscene->lvoxc; ++k)
+			tau += h*SampleDensity(ro+rd*(ta+h*((float)k+0.5f)),ce,qm,smax,vm,fm,vx,pkernel,0);
+
+		td = sfloat1::select(td,trb,qm);
+	}
+
+	return tau;
+}
+
+#define RATIO_TRACKING_RR 0.1f //transmittance below which russian roulette is played
+
+//Residual ratio tracking: transmittance along the light rays. Within each leaf the density sampled at the middle
+//of the segment is used as a control, attenuated analytically, and the residual is ratio tracked against the
+//largest deviation the sub-brick majorants allow. Instead of stopping at the first tentative collision, each one weights
+//the transmittance, so the estimate is fractional rather than a binary hit or miss, and exact in homogeneous leaves.
+//The interior gaps have a constant density and are attenuated analytically. After each collision outside the
+//surface, the sdf ball is tracked with the residual majorant of the fog alone. The lanes outside gm are left at one.
+//ptrv is expected to be initialized.
+static sfloat1 Transmittance(const sfloat4 &ro, const sfloat4 &rd, const sfloat1 &gm, RenderKernel *pkernel, KernelOctree::BaseOctreeTraverser *ptrv, sint4 *prs, const sint1 &se){
+	sfloat1 msigmae = sfloat1(pkernel->msigmaa+pkernel->msigmas);
+	sfloat1 zr = sfloat1::zero();
+	sfloat1 tr = sfloat1::one();
+	sfloat1 td = sfloat1::zero(); //end of the previous leaf
+	for(uint i = 0;; ++i){
+		duintN nodes;
+		sfloat1 tra, trb;
+
+		dintN mask = ptrv->GetLeaf(i,&nodes,tra,trb);
+		sfloat1 qm = sfloat1::And(sfloat1::And(gm,sint1::load(&mask)),sfloat1::Greater(tr,zr));
+		if(qm.AllFalse())
+			break;
+
+		sfloat4 ce;
+		sfloat1 smax, sfog;
+		sint1 vm, fm, vx[VOLUME_BUFFER_COUNT], gx;
+		LoadLeaves(nodes,qm,pkernel,&ce,&smax,&sfog,&vm,&fm,vx,&gx);
+
+		sfloat1 dm = InteriorGap(ro+rd*tra,ce,sfloat1::AndNot(vm,sfloat1::And(qm,sfloat1::Greater(tra,td))),vx,pkernel);
+		tr = sfloat1::select(tr,tr*sfloat1::exp(-msigmae*(tra-td)),dm);
+
+		sfloat1 ta = sfloat1::max(tra,td);
+		sfloat1 ls = sfloat1::max(trb-ta,zr);
+		sfloat1 pc = SampleDensity(ro+rd*(ta+0.5f*ls),ce,qm,smax,vm,fm,vx,pkernel,0); //control
+		sfloat1 pr = sfloat1::max(smax-pc,pc); //residual majorant
+		tr = sfloat1::select(tr,tr*sfloat1::exp(-msigmae*pc*ls),qm);
+
+		sfloat1 sm = sfloat1::And(qm,sfloat1::Greater(pr,zr));
+		sfloat1 u0 = i == 0?pkernel->psampler->Sample(prs,se,SAMPLER_DIM_LIGHTFLIGHT):RNG_Sample(prs); //the first step is stratified
+		MajorantGrid mg(ro,rd,ta,trb,ce,gx,smax,msigmae,sm,pkernel);
+		for(sfloat1 t = ta, sk = ta, u = u0, ms, d;; u = RNG_Sample(prs)){
+			t = mg.Step(t,-sfloat1::log(u),ta,sk,sfloat1::min(sfog,smax),pc,msigmae,sm,&ms);
+			sm = sfloat1::And(sm,sfloat1::Less(t,trb));
+			if(sm.AllFalse())
+				break;
+			sfloat1 p = SampleDensity(ro+rd*t,ce,sm,smax,vm,fm,vx,pkernel,&d);
+			tr = sfloat1::select(tr,tr*(sfloat1::one()-(p-pc)/ms),sm);
+			sk = sfloat1::select(sk,t+sfloat1::max(d,zr)*(1.0f/INTERIOR_LIPSCHITZ),sfloat1::AndNot(vm,sm));
+
+			sfloat1 rr = sfloat1::And(sm,sfloat1::Less(tr,sfloat1(RATIO_TRACKING_RR)));
+			if(rr.AnyTrue()){
+				sfloat1 q = RNG_Sample(prs)*RATIO_TRACKING_RR;
+				tr = sfloat1::select(tr,sfloat1::AndNot(sfloat1::GreaterOrEqual(q,tr),sfloat1(RATIO_TRACKING_RR)),rr);
+			}
+			sm = sfloat1::And(sm,sfloat1::Greater(tr,zr));
+		}
+
+		td = sfloat1::select(td,trb,qm);
+	}
+
+	return tr;
+}
+
+//Transmittance of the light rays leaving the interior ball of radius ri around ro. The ball is attenuated
+//analytically, and russian roulette is played before any traversal, so that the rays deep inside the surface are
+//rarely traced. Initializes ptrv, restarting from the leaves rn of ro (0 if unknown). Otherwise as Transmittance().
+static sfloat1 InteriorTransmittance(const sfloat4 &ro, const sfloat4 &rd, const sfloat1 &gm, const sfloat1 &ri, const dintN &rn, RenderKernel *pkernel, KernelOctree::BaseOctreeTraverser *ptrv, sint4 *prs, const sint1 &se){
+	sfloat1 zr = sfloat1::zero();
+	sfloat1 im = sfloat1::And(gm,sfloat1::Greater(ri,zr));
+	if(im.AllFalse()){
+		ptrv->Initialize(ro,rd,gm,pkernel->pscene->pnodes,rn,pkernel->pparent);
+		return Transmittance(ro,rd,gm,pkernel,ptrv,prs,se);
+	}
+
+	sfloat1 rb = sfloat1::And(im,ri);
+	sfloat1 tb = sfloat1::exp(-sfloat1(pkernel->msigmaa+pkernel->msigmas)*rb);
+	sfloat1 rr = sfloat1::And(im,sfloat1::Less(tb,sfloat1(RATIO_TRACKING_RR)));
+	if(rr.AnyTrue()){
+		sfloat1 q = RNG_Sample(prs)*RATIO_TRACKING_RR;
+		tb = sfloat1::select(tb,sfloat1::AndNot(sfloat1::GreaterOrEqual(q,tb),sfloat1(RATIO_TRACKING_RR)),rr);
+	}
+
+	sfloat1 gm1 = sfloat1::And(gm,sfloat1::Greater(tb,zr));
+	if(gm1.AllFalse())
+		return tb;
+	sfloat4 rb4 = ro+rd*rb;
+	ptrv->Initialize(rb4,rd,gm1,pkernel->pscene->pnodes,rn,pkernel->pparent);
+	return tb*Transmittance(rb4,rd,gm1,pkernel,ptrv,prs,se);
+}
+
+#define TRANSMITTANCE_CACHE_SIZE 128 //grid points per axis
+
+//Bake the transmittance toward each sun into a corner-aligned grid over the root node. The rays are marched from
+//the grid points along the central direction of the sun, so the cone of the light is not accounted for.
+static bool BakeTransmittance(RenderKernel *pkernel){
+	const uint n = TRANSMITTANCE_CACHE_SIZE, n3 = n*n*n;
+	uint lc = KernelSampler::BaseLight::lights.size();
+	for(uint l = 0; l < lc; ++l)
+		if(!dynamic_cast<KernelSampler::SunLight*>(KernelSampler::BaseLight::lights[l]))
+			return false;
+	if(!(pkernel->ptcache = (float*)_mm_malloc(lc*n3*sizeof(float),BLCLOUD_VALIGN)))
+		return false;
+
+	float4 rce = float4::load(&pkernel->pscene->pnodes[0].ce);
+	dfloat4 ce = dfloat4(rce);
+	float vs = 2.0f*ce.w/(float)(n-1);
+	sfloat1 msigmae = sfloat1(pkernel->msigmaa+pkernel->msigmas);
+
+	for(uint l = 0; l < lc; ++l){
+		const dfloat3 &sd = dynamic_cast<KernelSampler::SunLight*>(KernelSampler::BaseLight::lights[l])->direction;
+		sfloat4 rd = sfloat4(float4(sd.x,sd.y,sd.z,0.0f));
+		float *pt = pkernel->ptcache+l*n3;
+		tbb::parallel_for(tbb::blocked_range<uint>(0,n*n),[&](const tbb::blocked_range<uint> &nr){
+			KernelOctree::OctreePacketTraverser steptrv;
+			for(uint i = nr.begin(); i < nr.end(); ++i){
+				uint y = i%n, z = i/n;
+				for(uint x = 0; x < n; x += BLCLOUD_VSIZE){
+					dfloatN X;
+					for(uint j = 0; j < BLCLOUD_VSIZE; ++j)
+						X.v[j] = ce.x-ce.w+vs*(float)(x+j);
+					sfloat4 ro;
+					ro.v[0] = sfloat1::load(&X);
+					ro.v[1] = sfloat1(ce.y-ce.w+vs*(float)y);
+					ro.v[2] = sfloat1(ce.z-ce.w+vs*(float)z);
+					ro.v[3] = sfloat1::one();
+
+					sfloat1 gm = sint1::trueI();
+					steptrv.Initialize(ro,rd,gm,pkernel->pscene->pnodes);
+					sfloat1 tr = sfloat1::exp(-msigmae*OpticalDepth(ro,rd,gm,pkernel,&steptrv));
+					sfloat1::store(pt+n*(n*z+y)+x,tr);
+				}
+			}
+		});
+	}
+
+	return true;
+}
+
+//Direct lighting with the cached transmittance: sum of the lights evaluated at lrd, each attenuated by its own
+//transmittance at p. Points outside the grid are moved along lrd to the root node boundary first.
+static sfloat4 CachedLight(const sfloat4 &p, const sfloat4 &lrd, const sfloat1 &gm, RenderKernel *pkernel){
+	const uint n = TRANSMITTANCE_CACHE_SIZE;
+	sfloat4 rce = sfloat4(float4::load(&pkernel->pscene->pnodes[0].ce));
+	sfloat1 t0 = sfloat1::zero(), t1 = sfloat1(FLT_MAX);
+	for(uint k = 0; k < 3; ++k){
+		sfloat1 ri = 1.0f/lrd.v[k];
+		sfloat1 ta = (rce.v[k]-rce.v[3]-p.v[k])*ri;
+		sfloat1 tb = (rce.v[k]+rce.v[3]-p.v[k])*ri;
+		t0 = sfloat1::max(t0,sfloat1::min(ta,tb));
+		t1 = sfloat1::min(t1,sfloat1::max(ta,tb));
+	}
+	sfloat1 hm = sfloat1::And(gm,sfloat1::LessOrEqual(t0,t1)); //misses are unoccluded
+	sfloat4 pc = p+lrd*t0;
+
+	sfloat4 c = sfloat4::zero();
+	for(uint l = 0; l < KernelSampler::BaseLight::lights.size(); ++l){
+		sfloat4 e = KernelSampler::BaseLight::lights[l]->Evaluate(lrd);
+		sfloat1 em = sfloat1::And(gm,sfloat1::Greater(e.v[0]+e.v[1]+e.v[2],sfloat1::zero()));
+		if(em.AllFalse())
+			continue;
+		sfloat1 tm = sfloat1::And(em,hm), tr;
+		sint1 offs = sint1(l*n*n*n);
+		SampleVoxelSpace<1>(pc,rce,&pkernel->ptcache,&offs,&tm,n,&tr);
+		tr = sfloat1::select(sfloat1::one(),tr,tm);
+		for(uint i = 0; i < 3; ++i)
+			c.v[i] += sfloat1::And(em,e.v[i]*tr);
+	}
+	c.v[3] = sfloat1::one();
+	return c;
+}
+
+//Radiance from the lights (lc) and the sky/environment (le) reaching the rays that escaped the volume
+static void EscapeRadiance(const sfloat4 &rd, RenderKernel *pkernel, sfloat4 *plc, sfloat4 *ple);
+
+//Light and environment rays, which don't scatter further: the radiance of the lights (weighted by wl) and the sky
+//(we) attenuated by the ratio tracked transmittance. se: sampler event of the first step.
+static std::tuple<sfloat4,sfloat4> LightRay(const sfloat4 &ro, const sfloat4 &rd, const sfloat1 &gm, const sfloat1 &ri, const dintN &rn, RenderKernel *pkernel, sint4 *prs, uint se, const sfloat4 &wl, const sfloat4 &we){
+	KernelOctree::OctreeStepTraverser steptrv;
+	KernelOctree::OctreeHDDATraverser hddatrv(pkernel->phdda);
+	KernelOctree::BaseOctreeTraverser *ptrv = pkernel->phdda?(KernelOctree::BaseOctreeTraverser*)&hddatrv:&steptrv;
+	sfloat1 tr = InteriorTransmittance(ro,rd,gm,ri,rn,pkernel,ptrv,prs,sint1(se));
+#ifdef USE_EMBREE
+	sfloat1 maxd = sfloat1(MAX_OCCLUSION_DIST);
+	if(pkernel->psceneocc)
+		tr = sfloat1::AndNot(pkernel->psceneocc->Intersect(ro,rd,gm,maxd),tr);
+#endif
+
+	std::tuple<sfloat4,sfloat4> ctt;
+	sfloat4 &lc = std::get<0>(ctt);
+	sfloat4 &le = std::get<1>(ctt);
+	EscapeRadiance(rd,pkernel,&lc,&le);
+	lc *= wl*tr;
+	le *= we*tr;
+	lc.v[3] = sfloat1::one();
+	le.v[3] = lc.v[3];
+	return ctt;
+}
+
+static void EscapeRadiance(const sfloat4 &rd, RenderKernel *pkernel, sfloat4 *plc, sfloat4 *ple){
+	*plc = KernelSampler::BaseLight::EvaluateAll(rd);
+
+#ifdef USE_ARHOSEK_SKYMODEL
+	//skylighting
+	sfloat1 rdz = rd.v[2];
+	sfloat1 sth = sfloat1::sqrt(1.0f-rd.v[2]*rd.v[2]);
+	sfloat1 cth = rdz;
+	sfloat1 slth = sfloat1::sqrt(1.0f-pkernel->skydir.z*pkernel->skydir.z);
+	sfloat1 clth = pkernel->skydir.z;
+	sfloat1 slph = pkernel->skydir.y;
+	sfloat1 clph = pkernel->skydir.x;
+
+	sfloat1 rdd = rd.v[0]/rd.v[1];
+	sfloat1 acr = 1.0f/sfloat1::sqrt(rdd*rdd+1.0f); //cos(ph = atan(rdd))
+	sfloat1 czp = acr*(rdd*slph+clph); //cos(zr-ph)
+	sfloat1 cph = sth*slth*czp+cth*clth;
+
+	sfloat1 gmma = sfloat1::acos(cph);
+	sfloat1 gacs = sfloat1::saturate(cph);
+	sfloat1 thcs = sfloat1::max(rdz,sfloat1::zero());
+	sfloat1 raym = gacs*gacs;
+	sfloat4 &ca = *ple;
+	for(uint i = 0; i < 3; ++i){
+		sfloat1 caf[9];
+		for(uint j = 0; j < 9; ++j)
+			caf[j] = sfloat1(pkernel->pskyms->configs[i][j]);
+		//arhosek_tristim_skymodel_radiance(pkernel->pskyms,sth,sga,0)
+		sfloat1 expm = sfloat1::exp(caf[4]*gmma);
+		sfloat1 miem = (sfloat1::one()+raym)/sfloat1::pow(sfloat1::one()+caf[8]*caf[8]-2.0f*caf[8]*gacs,sfloat1(1.5f));
+		sfloat1 zenh = sfloat1::sqrt(thcs);
+		ca.v[i] = (sfloat1::one()+caf[0]*sfloat1::exp(caf[1]/(thcs+0.01f)))*(caf[2]+caf[3]*expm+caf[5]*raym+caf[6]*miem+caf[7]*zenh);
+		ca.v[i] *= pkernel->pskyms->radiances[i];
+		ca.v[i] = 1e-3f*sfloat1::pow(ca.v[i],2.2f); //convert to linear and adjust exposure
+	}
+#else
+	*ple = pkernel->penv->Evaluate(rd);
+	for(uint i = 0; i < 3; ++i)
+		ple->v[i] = sfloat1::pow(ple->v[i],2.2f);
+#endif
+}
+
+//Multiple importance sampling: sample the phase function (srd) and the lights (lrd) for a scattering event,
+//and return the balance heuristic weights for both directions. The lights are sampled as a mixture, i.e. one light
+//per event chosen in proportion to its irradiance, so the light pdf is the selection weighted sum of all pdfs. If the environment is sampled explicitly (penvs),
+//the sky radiance is estimated separately with the phase and environment (erd) directions: pw1 weights the light
+//and pw1e the sky radiance along srd. The weights apply only to the radiance of the escaping rays, not to the
+//further scattering along srd.
+static void SampleScattering(const sfloat4 &rd, RenderKernel *pkernel, sint4 *prs, const sint1 &se, sfloat4 *psrd, sfloat4 *plrd, sfloat4 *perd, sfloat4 *pw1, sfloat4 *pw1e, sfloat4 *pw2, sfloat4 *pw3){
+	sfloat1 u1 = pkernel->psampler->Sample(prs,se,SAMPLER_DIM_PHASE);
+	sfloat1 u2 = pkernel->psampler->Sample(prs,se,(SAMPLER_DIM)(SAMPLER_DIM_PHASE+1));
+	*psrd = pkernel->ppf->Sample(rd,u1,u2);//HG_Sample(rd,prs);
+
+	sfloat1 u3 = pkernel->psampler->Sample(prs,se,SAMPLER_DIM_LIGHT);
+	sfloat1 u4 = pkernel->psampler->Sample(prs,se,(SAMPLER_DIM)(SAMPLER_DIM_LIGHT+1));
+	*plrd = KernelSampler::BaseLight::SampleAll(rd,u3,u4);
+
+	//pdfs for the balance heuristic w_x = p_x/sum(p_i,i=0..N)
+	sfloat4 p1 = pkernel->ppf->EvaluateRGB(sfloat4::dot3(*psrd,rd));//HG_Phase(sfloat4::dot3(srd,rd));
+	sfloat1 p2 = KernelSampler::BaseLight::PdfAll(*plrd);//L_Pdf(lrd,la);
+
+	//(HG_Phase(X)*SampleVolume(X)*p1/(p1+L_Pdf(X)))/p1 => (HG_Phase(X)=p1)*SampleVolume(X)/(p1+L_Pdf(X)) = p1*SampleVolume(X)/(p1+L_Pdf(X))
+	//(HG_Phase(Y)*SampleVolume(Y)*p2/(HG_Phase(Y)+p2))/p2 => HG_phase(Y)*SampleVolume(Y)/(HG_Phase(Y)+p2)
+
+	sfloat4 p3 = pkernel->ppf->EvaluateRGB(sfloat4::dot3(*plrd,rd));
+	*pw1 = p1/(p1+KernelSampler::BaseLight::PdfAll(*psrd));
+	*pw2 = p3/(p3+p2);
+
+	if(!pkernel->penvs){
+		*pw1e = sfloat4(1.0f); //sky radiance through the phase sampling only
+		return;
+	}
+
+	sfloat1 u5 = pkernel->psampler->Sample(prs,se,SAMPLER_DIM_ENV);
+	sfloat1 u6 = pkernel->psampler->Sample(prs,se,(SAMPLER_DIM)(SAMPLER_DIM_ENV+1));
+	*perd = pkernel->penvs->Sample(u5,u6);
+
+	sfloat1 p4 = pkernel->penvs->Pdf(*perd);
+	sfloat4 p5 = pkernel->ppf->EvaluateRGB(sfloat4::dot3(*perd,rd));
+	*pw1e = p1/(p1+pkernel->penvs->Pdf(*psrd));
+	*pw3 = p5/(p5+p4);
+}
+
+static std::tuple<sfloat4,sfloat4> SampleVolume(sfloat4, const sfloat4 &, const sfloat1 &, RenderKernel *, KernelOctree::BaseOctreeTraverser *, sint4 *, uint, uint, const sfloat1 &, uint, SAMPLER_DIM, const sfloat4 &, const sfloat4 &, const sfloat1 &, const sfloat1 &, const dintN &);
+
+//Russian roulette: survival probability of the paths of throughput tp leaving the scattering event r. Once rrdepth
+//events have been traced the paths survive in proportion to their throughput.
+static inline sfloat1 Survival(const sfloat1 &tp, const sint1 &r, RenderKernel *pkernel){
+	if(pkernel->rrdepth == 0)
+		return sfloat1::one();
+	return sfloat1::select(sfloat1::min(tp,sfloat1::one()),sfloat1::one(),sint1::Less(r+sint1(1),sint1(pkernel->rrdepth)));
+}
+
+//In-scattered light and sky radiance at the scattering locations rc (lanes gm) of order r, for the rays arriving
+//along rd with throughput tp, and the interior ball ri around them. The phase ray continues the path, while the light
+//and environment rays add the direct radiance with MIS. All of them restart the traversal from the leaves rn of rc.
+static std::tuple<sfloat4,sfloat4> InScattering(const sfloat4 &rc, const sfloat4 &rd, const sfloat1 &gm, RenderKernel *pkernel, sint4 *prs, uint r, const sfloat1 &tp, const sfloat1 &ri, const dintN &rn){
+	sfloat1 msigmas = sfloat1(pkernel->msigmas);
+	sfloat1 msigmae = sfloat1(pkernel->msigmaa)+msigmas;
+
+	sfloat4 srd, lrd, erd, w1, w1e, w2, w3;
+	SampleScattering(rd,pkernel,prs,sint1(r),&srd,&lrd,&erd,&w1,&w1e,&w2,&w3);
+
+	//continue the path only if it survives the roulette
+	sfloat1 tp1 = tp*msigmas/msigmae;
+	sfloat1 q = Survival(tp1,sint1(r),pkernel);
+	sfloat1 sm = gm;
+	if(sfloat1::Less(q,sfloat1::one()).AnyTrue())
+		sm = sfloat1::And(gm,sfloat1::Less(RNG_Sample(prs),q));
+	sfloat1 qr = sfloat1::select(sfloat1::zero(),sfloat1::one()/q,sm);
+
+	//need two samples - with the phase sampling keep on the recursion while for the light do only single scattering
+	//estimator S(1)*f1*w1/p1+S(2)*f2*w2/p2 /= woodcock pdf
+	//the light ray is used for the lights only, and the environment ray for the sky
+	std::tuple<sfloat4,sfloat4> S1;
+	if(sm.AnyTrue())
+		S1 = SampleVolume(rc,srd,sm,pkernel,0,prs,r+1,1,FLT_MAX,r+1,SAMPLER_DIM_FREEFLIGHT,w1,w1e,tp1*qr,ri,rn);
+	else S1 = std::make_tuple(sfloat4::zero(),sfloat4::zero());
+	sfloat4 dif1 = std::get<0>(S1)*qr, sky1 = std::get<1>(S1)*qr;
+	sfloat4 dif2;
+	if(pkernel->ptcache)
+		dif2 = CachedLight(rc,lrd,gm,pkernel)*w2;
+	else dif2 = std::get<0>(LightRay(rc,lrd,gm,ri,rn,pkernel,prs,r,w2,sfloat4::zero()));
+
+	std::tuple<sfloat4,sfloat4> ctt;
+	std::get<0>(ctt) = (dif1+dif2)*msigmas/msigmae;//s1*p1/(p1+L_Pdf(srd,la))+s2*p3/(p3+p2);
+	std::get<1>(ctt) = sky1*msigmas/msigmae;
+	if(pkernel->penvs){
+		std::tuple<sfloat4,sfloat4> S3 = LightRay(rc,erd,gm,ri,rn,pkernel,prs,r,sfloat4::zero(),w3);
+		std::get<1>(ctt) += std::get<1>(S3)*msigmas/msigmae;
+	}
+	return ctt;
+}
 
-	duint3 a = duint3((uint)nf.get<0>(),(uint)nf.get<1>(),(uint)nf.get<2>());
-	duint3 b = duint3((uint)nc.get<0>(),(uint)nc.get<1>(),(uint)nc.get<2>());
+#define OCTAVE_EXTINCTION 0.5f //extinction scale per octave (a)
+#define OCTAVE_SCATTERING 0.5f //contribution scale per octave (b)
+#define OCTAVE_ECCENTRICITY 0.5f //phase anisotropy scale per octave (c)
 
-	uint lvoxc2 = lvoxc*lvoxc;
-	float4 ua = float4(pvol[a.z*lvoxc2+a.y*lvoxc+a.x],pvol[a.z*lvoxc2+b.y*lvoxc+a.x],
-		pvol[b.z*lvoxc2+a.y*lvoxc+a.x],pvol[b.z*lvoxc2+b.y*lvoxc+a.x]); //([x0,y0,z0],[x0,y1,z0],[x0,y0,z1],[x0,y1,z1])
-	float4 ub = float4(pvol[a.z*lvoxc2+a.y*lvoxc+b.x],pvol[a.z*lvoxc2+b.y*lvoxc+b.x],
-		pvol[b.z*lvoxc2+a.y*lvoxc+b.x],pvol[b.z*lvoxc2+b.y*lvoxc+b.x]); //([x1,y0,z0],[x1,y1,z0],[x1,y0,z1],[x1,y1,z1])
-	float4 u = float4::lerp(ua,ub,nl.splat<0>()); //([x,y0,z0],[x,y1,z0],[x,y0,z1],[x,y1,z1])
+//Approximate multiple scattering (Wrenninge et al., "Oz: The Great and Volumetric"): single scattering repeated over
+//octaves, each with the extinction, contribution and phase anisotropy scaled by a, b and c. The optical depth toward
+//the light and along a phase sampled sky direction is marched once and shared by all the octaves. The anisotropy is
+//reduced by blending the phase function toward isotropic, which works for any phase function.
+static std::tuple<sfloat4,sfloat4> OctaveScattering(const sfloat4 &rc, const sfloat4 &rd, const sfloat1 &gm, RenderKernel *pkernel, sint4 *prs){
+	sfloat1 msigmas = sfloat1(pkernel->msigmas);
+	sfloat1 msigmae = sfloat1(pkernel->msigmaa)+msigmas;
+
+	sfloat1 u1 = pkernel->psampler->Sample(prs,sint1(0),SAMPLER_DIM_PHASE);
+	sfloat1 u2 = pkernel->psampler->Sample(prs,sint1(0),(SAMPLER_DIM)(SAMPLER_DIM_PHASE+1));
+	sfloat4 srd = pkernel->ppf->Sample(rd,u1,u2);
+
+	sfloat1 u3 = pkernel->psampler->Sample(prs,sint1(0),SAMPLER_DIM_LIGHT);
+	sfloat1 u4 = pkernel->psampler->Sample(prs,sint1(0),(SAMPLER_DIM)(SAMPLER_DIM_LIGHT+1));
+	sfloat4 lrd = KernelSampler::BaseLight::SampleAll(rd,u3,u4);
+	sfloat1 lp = sfloat1::max(KernelSampler::BaseLight::PdfAll(lrd),1e-30f);
+
+	sfloat4 pl = pkernel->ppf->EvaluateRGB(sfloat4::dot3(lrd,rd));
+	sfloat4 ps = sfloat4::max(pkernel->ppf->EvaluateRGB(sfloat4::dot3(srd,rd)),sfloat4(1e-30f));
+
+	KernelOctree::OctreePacketTraverser steptrv;
+	steptrv.Initialize(rc,lrd,gm,pkernel->pscene->pnodes);
+	sfloat1 tl = msigmae*OpticalDepth(rc,lrd,gm,pkernel,&steptrv);
+	steptrv.Initialize(rc,srd,gm,pkernel->pscene->pnodes);
+	sfloat1 ts = msigmae*OpticalDepth(rc,srd,gm,pkernel,&steptrv);
+
+	//the light ray is used for the lights only, and the phase ray for the sky
+	sfloat4 lc, le, lc1, le1;
+	EscapeRadiance(lrd,pkernel,&lc,&le1);
+	EscapeRadiance(srd,pkernel,&lc1,&le);
+
+	sfloat4 fl = sfloat4::zero(), fs = sfloat4::zero();
+	float a = 1.0f, b = 1.0f, c = 1.0f;
+	for(uint i = 0; i < pkernel->octaves; ++i){
+		//phase blended toward isotropic, relative to the sampled phase for the sky direction
+		fl += (pl*c+sfloat4((1.0f-c)/(4.0f*SM_PI)))*sfloat1::exp(-a*tl)*b;
+		fs += (sfloat4(c)+sfloat4((1.0f-c)/(4.0f*SM_PI))/ps)*sfloat1::exp(-a*ts)*b;
+		a *= OCTAVE_EXTINCTION;
+		b *= OCTAVE_SCATTERING;
+		c *= OCTAVE_ECCENTRICITY;
+	}
 
-	float4 va = u.swizzle<0,2,0,2>();
-	float4 vb = u.swizzle<1,3,1,3>();
-	float4 v = float4::lerp(va,vb,nl.splat<1>()); //([x,y,z0],[x,y,z1],-,-)
+	std::tuple<sfloat4,sfloat4> ctt;
+	std::get<0>(ctt) = fl*lc*(msigmas/(msigmae*lp));
+	std::get<1>(ctt) = fs*le*(msigmas/msigmae);
+	std::get<0>(ctt).v[3] = sfloat1::zero();
+	std::get<1>(ctt).v[3] = sfloat1::zero();
+	return ctt;
+}
 
-	float4 wa = v.splat<0>();
-	float4 wb = v.splat<1>();
-	float4 w = float4::lerp(wa,wb,nl.splat<2>()); //([x,y,z],-,-,-)
+//Radiance cache lookup: in-scattered light and sky radiance interpolated from the corners of the leaves where the
+//lanes m scattered
+static std::tuple<sfloat4,sfloat4> CachedInScattering(const sfloat4 &p, const dintN &nodes, const sfloat1 &m, RenderKernel *pkernel){
+	sfloat4 ce = sfloat4::zero();
+	dintN M = dintN(m), OF;
+	for(uint j = 0; j < BLCLOUD_VSIZE; ++j){
+		if(M.v[j] != 0){
+			const OctreeNode &node = pkernel->pscene->pnodes[nodes.v[j]];
+			ce.set(j,float4::load(&node.ce));
+			OF.v[j] = 8*node.leaf;
+		}else OF.v[j] = 0;
+	}
+	sint1 offs[RADIANCE_CACHE_CHANNELS];
+	sfloat1 pm[RADIANCE_CACHE_CHANNELS], vr[RADIANCE_CACHE_CHANNELS];
+	for(uint k = 0; k < RADIANCE_CACHE_CHANNELS; ++k){
+		offs[k] = sint1::load(&OF);
+		pm[k] = m;
+	}
+	SampleVoxelSpace<RADIANCE_CACHE_CHANNELS>(p,ce,pkernel->prcache,offs,pm,2,vr);
 
-	return w.get<0>();
+	std::tuple<sfloat4,sfloat4> ctt;
+	for(uint k = 0; k < 3; ++k){
+		std::get<0>(ctt).v[k] = vr[k];
+		std::get<1>(ctt).v[k] = vr[3+k];
+	}
+	std::get<0>(ctt).v[3] = sfloat1::zero();
+	std::get<1>(ctt).v[3] = sfloat1::zero();
+	return ctt;
 }
 
-static std::tuple<sfloat4,sfloat4> SampleVolume(sfloat4 ro, const sfloat4 &rd, const sfloat1 &gm, RenderKernel *pkernel, KernelOctree::BaseOctreeTraverser *ptrv, sint4 *prs, uint r, uint samples, const sfloat1 &depth){
+//se, sd: sampler event and dimension of the first free-flight step
+//wl, we: MIS weights for the light and sky radiance if the ray escapes
+//tp: path throughput for the russian roulette
+//ri: radius of the interior ball around ro, see FreeFlight()
+//rn: leaves of ro to restart the traversal from (0 if unknown)
+static std::tuple<sfloat4,sfloat4> SampleVolume(sfloat4 ro, const sfloat4 &rd, const sfloat1 &gm, RenderKernel *pkernel, KernelOctree::BaseOctreeTraverser *ptrv, sint4 *prs, uint r, uint samples, const sfloat1 &depth, uint se, SAMPLER_DIM sd, const sfloat4 &wl, const sfloat4 &we, const sfloat1 &tp, const sfloat1 &ri, const dintN &rn){
 	KernelOctree::BaseOctreeTraverser *ptrv1;
 	KernelOctree::OctreeStepTraverser steptrv;
-	if(ptrv){ //using preallocated caching full traverser (first primary ray for which the path is always identical)
-		ptrv->Initialize(ro,rd,gm,&pkernel->pscene->ob);
+	KernelOctree::OctreeHDDATraverser hddatrv(pkernel->phdda);
+	if(ptrv) //using preallocated caching full traverser (first primary ray for which the path is always identical), initialized by the caller
 		ptrv1 = ptrv;
-	}else ptrv1 = &steptrv;
+	else if(pkernel->phdda)
+		ptrv1 = &hddatrv;
+	else ptrv1 = &steptrv;
 
 	//sfloat4 c = sfloat4::zero();
 	std::tuple<sfloat4,sfloat4> ctt;
@@ -190,131 +1173,20 @@ static std::tuple<sfloat4,sfloat4> SampleVolume(sfloat4 ro, const sfloat4 &rd, c
 	//finally, sample with given density and position
 	sample();*/
 
-	sfloat1 msigmaa = sfloat1(pkernel->msigmaa);
-	sfloat1 msigmas = sfloat1(pkernel->msigmas);
-	sfloat1 msigmae = msigmaa+msigmas;
+	bool cached = pkernel->prcache[0] && r >= pkernel->cachedepth && r < pkernel->scattevs;
 
 	for(uint s = 0; s < samples; ++s){
-		sfloat1 qm = gm;
-		sfloat1 mm = sint1::trueI(); //not occluded
-		sfloat1 rm = sint1::trueI(); //not scattering
-		sfloat1 zr = sfloat1::zero();
-
-		if(!ptrv) //using local step traverser - initialize here
-			ptrv1->Initialize(ro,rd,gm,&pkernel->pscene->ob);
-
-		sfloat1 td = sfloat1::zero(); //distance travelled
-		for(uint i = 0;; ++i){
-			duintN nodes;
-			sfloat1 tra, trb;
-
-			dintN mask = ptrv1->GetLeaf(i,&nodes,tra,trb);
-			sint1 lm = sint1::load(&mask);
-
-#ifdef USE_EMBREE
-			mm = sfloat1::Less(td,maxd);
-#endif
-			mm = sfloat1::Less(td,depth);
-			qm = sfloat1::And(qm,mm);
-
-			qm = sfloat1::And(qm,rm);
-			qm = sfloat1::And(qm,lm);
-			if(qm.AllFalse())
-				break;
-
-			sfloat4 ce = sfloat4::zero();
-			sfloat1 lo = td; //local origin
-
-			for(uint j = 0; j < BLCLOUD_VSIZE; ++j)
-				if(mask.v[j] != 0)
-					ce.set(j,float4::load(&pkernel->pscene->ob[nodes.v[j]].ce));
-
-			//trb = sfloat1::min(trb,maxd);
-			sfloat1 tr0 = tra-td;
-			sfloat1 tr1 = trb-td;
-
-			sfloat4 r0 = ro+rd*tra;
-
-			sint1 sm = sfloat1::Greater(tra,td);
-			dintN SM = dintN(sm);
-
-			dfloatN smax1, dist1, rho1;
-
-			dintN QM = dintN(qm);
-			dintN VM; //true: next leaf is a sole fog; false: sdf exists, but fog may not
-			for(uint j = 0; j < BLCLOUD_VSIZE; ++j){
-				if(QM.v[j] != 0){
-					if(pkernel->pscene->ob[nodes.v[j]].volx[VOLUME_BUFFER_SDF] != ~0u){
-						smax1.v[j] = 1.0f;
-						VM.v[j] = 0;
-					}else{
-						smax1.v[j] = pkernel->pscene->ob[nodes.v[j]].qval[VOLUME_BUFFER_FOG];
-						VM.v[j] = 1;
-					}
-
-					if(SM.v[j] != 0 && VM.v[j] == 0)
-						dist1.v[j] = SampleVoxelSpace(r0.get(j),pkernel->pscene->pvol[VOLUME_BUFFER_SDF]+pkernel->pscene->lvoxc3*pkernel->pscene->ob[nodes.v[j]].volx[VOLUME_BUFFER_SDF],ce.get(j),pkernel->pscene->lvoxc);
-					else dist1.v[j] = 1.0f;
-				}else VM.v[j] = 0;
-			}
-			sfloat1 d0 = sfloat1::load(&dist1);
-			sint1 vm = sint1::load(&VM);
-
-			sm = sfloat1::And(sm,sfloat1::Greater(d0,zr));
-			sm = sfloat1::Or(sm,vm); //skip if the next leaf is a sole fog
-
-			sm = sfloat1::And(sm,qm); //can't allow any further changes in 'td' if qm == 0
-			td = sfloat1::Or(sfloat1::And(sm,tra),sfloat1::AndNot(sm,td));
-
-			sfloat1 s0 = sfloat1::Or(sfloat1::And(sm,tr0),sfloat1::AndNot(sm,zr)); //positive distance skipped (moving to next leaf)
-
-			sm = qm;
-
-			sfloat1 smax = sfloat1::load(&smax1);//sfloat1(1.0f); //local max in this leaf
-			for(sfloat1 sr = -log_ps(RNG_Sample(prs))/(msigmae*smax), sc, sh;; sr -= log_ps(RNG_Sample(prs))/(msigmae*smax)){
-				sm = sfloat1::And(sm,rm);
-				if(sfloat1(sm).AllFalse())
-					break;
-				sc = s0+sr;
-				td = sfloat1::Or(sfloat1::And(sm,lo+sc),sfloat1::AndNot(sm,td));
-
-				sm = sfloat1::And(sm,sfloat1::Less(sc,tr1)); //check if out of extents
-				sh = sfloat1::Or(sm,sfloat1::AndNot(rm,sint1::trueI())); //prevent modifications if rm == false
-				td = sfloat1::Or(sfloat1::AndNot(sh,trb),sfloat1::And(sh,td));
-
-				//if sm == false, this is always true (so rm won't be changed)
-				//-> unless the ray has run out of leafs
-				rm = sfloat1::Or(sfloat1::And(sm,sfloat1::Greater(sc,tr0)),sfloat1::AndNot(sm,rm));
-
-				sfloat4 rc = ro+rd*td;
-
-				sh = sfloat1::And(sm,rm);
-				dintN SH = dintN(sh);
-				for(uint j = 0; j < BLCLOUD_VSIZE; ++j){
-					if(SH.v[j] != 0){
-						if(VM.v[j] == 0){
-							dist1.v[j] = SampleVoxelSpace(rc.get(j),pkernel->pscene->pvol[VOLUME_BUFFER_SDF]+pkernel->pscene->lvoxc3*pkernel->pscene->ob[nodes.v[j]].volx[VOLUME_BUFFER_SDF],ce.get(j),pkernel->pscene->lvoxc);
-							//have to check if fog exists
-							if(dist1.v[j] > 0.0f && pkernel->pscene->ob[nodes.v[j]].volx[VOLUME_BUFFER_FOG] != ~0u)
-								rho1.v[j] = SampleVoxelSpace(rc.get(j),pkernel->pscene->pvol[VOLUME_BUFFER_FOG]+pkernel->pscene->lvoxc3*pkernel->pscene->ob[nodes.v[j]].volx[VOLUME_BUFFER_FOG],ce.get(j),pkernel->pscene->lvoxc);
-							else rho1.v[j] = -1.0f;
-						}else{
-							dist1.v[j] = 1.0f;
-							rho1.v[j] = SampleVoxelSpace(rc.get(j),pkernel->pscene->pvol[VOLUME_BUFFER_FOG]+pkernel->pscene->lvoxc3*pkernel->pscene->ob[nodes.v[j]].volx[VOLUME_BUFFER_FOG],ce.get(j),pkernel->pscene->lvoxc);
-						}
-					}else{
-						dist1.v[j] = 1.0f;
-						rho1.v[j] = -1.0f;
-					}
-				}
-				sfloat1 d = sfloat1::load(&dist1);
-				sfloat1 p = sfloat1::load(&rho1);
-				sfloat1 q = RNG_Sample(prs);
-
-				//if(p > q || d < 0) break;
-				rm = sfloat1::And(rm,sfloat1::And(sfloat1::Less(p/smax,q),sfloat1::Greater(d,zr)));
-			}
+		sfloat1 td, mm, ri1 = sfloat1::zero();
+		dintN nodes = dintN(0); //scattering leaves
+		sfloat1 rm;
+		if(!ptrv && !cached && !pkernel->psceneocc) //the secondary rays may start in the interior; the cache needs the leaves
+			rm = InteriorFlight(ro,rd,gm,ri,rn,pkernel,ptrv1,prs,sint1(se),sd,&td,&mm,&nodes,&ri1);
+		else{
+			if(!ptrv) //using local step traverser - initialize here
+				ptrv1->Initialize(ro,rd,gm,pkernel->pscene->pnodes,rn,pkernel->pparent);
+			rm = FreeFlight(ro,rd,gm,depth,pkernel,ptrv1,prs,sint1(se),sd,&td,&mm,&nodes,pkernel->psceneocc?0:&ri1); //the surfaces may be inside
 		}
+		sfloat1 zr = sfloat1::zero();
 
 		//sample E(rc)/T here
 		//T should be the value at rc; T(rc)
@@ -323,46 +1195,9 @@ static std::tuple<sfloat4,sfloat4> SampleVolume(sfloat4 ro, const sfloat4 &rd, c
 		sfloat4 le = sfloat4::zero();
 		//skip (sky)lighting calculations if all the incident rays scatter (don't reach sun or sky)
 		if(rm.AnyTrue() && r > 0){
-			for(uint i = 0, n = KernelSampler::BaseLight::lights.size(); i < n; ++i)
-				lc += KernelSampler::BaseLight::lights[i]->Evaluate(rd);
-
-#ifdef USE_ARHOSEK_SKYMODEL
-			//skylighting
-			sfloat1 rdz = rd.v[2];
-			sfloat1 sth = sfloat1::sqrt(1.0f-rd.v[2]*rd.v[2]);
-			sfloat1 cth = rdz;
-			sfloat1 slth = sfloat1::sqrt(1.0f-pkernel->skydir.z*pkernel->skydir.z);
-			sfloat1 clth = pkernel->skydir.z;
-			sfloat1 slph = pkernel->skydir.y;
-			sfloat1 clph = pkernel->skydir.x;
-
-			sfloat1 rdd = rd.v[0]/rd.v[1];
-			sfloat1 acr = 1.0f/sfloat1::sqrt(rdd*rdd+1.0f); //cos(ph = atan(rdd))
-			sfloat1 czp = acr*(rdd*slph+clph); //cos(zr-ph)
-			sfloat1 cph = sth*slth*czp+cth*clth;
-
-			sfloat1 gmma = sfloat1::acos(cph);
-			sfloat1 gacs = sfloat1::saturate(cph);
-			sfloat1 thcs = sfloat1::max(rdz,sfloat1::zero());
-			sfloat1 raym = gacs*gacs;
-			sfloat4 &ca = le;
-			for(uint i = 0; i < 3; ++i){
-				sfloat1 caf[9];
-				for(uint j = 0; j < 9; ++j)
-					caf[j] = sfloat1(pkernel->pskyms->configs[i][j]);
-				//arhosek_tristim_skymodel_radiance(pkernel->pskyms,sth,sga,0)
-				sfloat1 expm = exp_ps(caf[4]*gmma);
-				sfloat1 miem = (sfloat1::one()+raym)/sfloat1::pow(sfloat1::one()+caf[8]*caf[8]-2.0f*caf[8]*gacs,sfloat1(1.5f));
-				sfloat1 zenh = sfloat1::sqrt(thcs);
-				ca.v[i] = (sfloat1::one()+caf[0]*exp_ps(caf[1]/(thcs+0.01f)))*(caf[2]+caf[3]*expm+caf[5]*raym+caf[6]*miem+caf[7]*zenh);
-				ca.v[i] *= pkernel->pskyms->radiances[i];
-				ca.v[i] = 1e-3f*sfloat1::pow(ca.v[i],2.2f); //convert to linear and adjust exposure
-			}
-#else
-			le = pkernel->penv->Evaluate(rd);
-			for(uint i = 0; i < 3; ++i)
-				le.v[i] = sfloat1::pow(le.v[i],2.2f);
-#endif
+			EscapeRadiance(rd,pkernel,&lc,&le);
+			lc *= wl;
+			le *= we;
 
 			lc.v[3] = sfloat1::one(); //alpha doesn't matter when r > 0
 			le.v[3] = lc.v[3];
@@ -385,38 +1220,33 @@ static std::tuple<sfloat4,sfloat4> SampleVolume(sfloat4 ro, const sfloat4 &rd, c
 		rm = sfloat1::Or(rm,sfloat1::AndNot(mm,sint1::trueI())); //ensure that no scattering occurs if occluded
 
 		if(r < pkernel->scattevs && rm.AnyFalse()){
-			//multiple importance sampling: sample the phase function and lights
-			//TODO: choose randomly one the lights. Multiply the final estimate (s2) with the total number of lights (ref776).
-			sfloat1 u1 = RNG_Sample(prs), u2 = RNG_Sample(prs);
-			sfloat4 srd = pkernel->ppf->Sample(rd,u1,u2);//HG_Sample(rd,prs);
-
-			sfloat1 u3 = RNG_Sample(prs), u4 = RNG_Sample(prs);
-			sfloat4 lrd = KernelSampler::BaseLight::lights[0]->Sample(rd,u3,u4);
-
-			//pdfs for the balance heuristic w_x = p_x/sum(p_i,i=0..N)
-			sfloat4 p1 = pkernel->ppf->EvaluateRGB(sfloat4::dot3(srd,rd));//HG_Phase(sfloat4::dot3(srd,rd));
-			sfloat1 p2 = KernelSampler::BaseLight::lights[0]->Pdf(lrd);//L_Pdf(lrd,la);
-
-			//need two samples - with the phase sampling keep on the recursion while for the light do only single scattering
 			sfloat1 gm1 = sfloat1::AndNot(rm,sint1::trueI());
-
 			sfloat4 rc = ro+rd*td;
 
-			//estimator S(1)*f1*w1/p1+S(2)*f2*w2/p2 /= woodcock pdf
-			std::tuple<sfloat4,sfloat4> S1 = SampleVolume(rc,srd,gm1,pkernel,0,prs,r+1,1,FLT_MAX);
-			std::tuple<sfloat4,sfloat4> S2 = SampleVolume(rc,lrd,gm1,pkernel,0,prs,pkernel->scattevs,1,FLT_MAX);
-			sfloat4 &dif1 = std::get<0>(S1), &sky1 = std::get<1>(S1);
-			sfloat4 &dif2 = std::get<0>(S2), sky2 = sfloat4(0.0f);//&sky2 = std::get<1>(S2);
-
-			//(HG_Phase(X)*SampleVolume(X)*p1/(p1+L_Pdf(X)))/p1 => (HG_Phase(X)=p1)*SampleVolume(X)/(p1+L_Pdf(X)) = p1*SampleVolume(X)/(p1+L_Pdf(X))
-			//(HG_Phase(Y)*SampleVolume(Y)*p2/(HG_Phase(Y)+p2))/p2 => HG_phase(Y)*SampleVolume(Y)/(HG_Phase(Y)+p2)
-
-			sfloat4 p3 = pkernel->ppf->EvaluateRGB(sfloat4::dot3(lrd,rd));
-			sfloat4 w1 = p1/(p1+KernelSampler::BaseLight::lights[0]->Pdf(srd));
-			sfloat4 w2 = p3/(p3+p2);
-
-			sfloat4 cl1 = (dif1*w1+dif2*w2)*msigmas/msigmae;//s1*p1/(p1+L_Pdf(srd,la))+s2*p3/(p3+p2);
-			sfloat4 cs1 = (sky1*w1+sky2*w2)*msigmas/msigmae;
+			//terminate the path with the cached radiance after cachedepth events
+			std::tuple<sfloat4,sfloat4> S;
+			if(cached)
+				S = CachedInScattering(rc,nodes,gm1,pkernel);
+			else{
+				//split the first event: the sample index is expanded so that every split gets its own sampler sequence
+				uint splits = r == 0?pkernel->splits:1;
+				sint1 sn = prs->v[2];
+				S = std::make_tuple(sfloat4::zero(),sfloat4::zero());
+				for(uint j = 0; j < splits; ++j){
+					if(splits > 1)
+						prs->v[2] = sn*sint1(splits)+sint1(j);
+					std::tuple<sfloat4,sfloat4> S1 = pkernel->flags & KERNEL_OCTAVES?
+						OctaveScattering(rc,rd,gm1,pkernel,prs):InScattering(rc,rd,gm1,pkernel,prs,r,tp,ri1,nodes);
+					std::get<0>(S) += std::get<0>(S1);
+					std::get<1>(S) += std::get<1>(S1);
+				}
+				prs->v[2] = sn;
+				if(splits > 1){
+					std::get<0>(S) *= 1.0f/(float)splits;
+					std::get<1>(S) *= 1.0f/(float)splits;
+				}
+			}
+			sfloat4 &cl1 = std::get<0>(S), &cs1 = std::get<1>(S);
 
 			cl.v[0] += sfloat1::Or(sfloat1::And(rm,lc.v[0]),sfloat1::AndNot(rm,cl1.v[0]));
 			cl.v[1] += sfloat1::Or(sfloat1::And(rm,lc.v[1]),sfloat1::AndNot(rm,cl1.v[1]));
@@ -439,28 +1269,147 @@ static std::tuple<sfloat4,sfloat4> SampleVolume(sfloat4 ro, const sfloat4 &rd, c
 			cs.v[2] += sfloat1::Or(sfloat1::And(rm,le.v[2]),sfloat1::AndNot(rm,zr));
 			cs.v[3] += le.v[3];
 		}
+
+		if(r == 0)
+			prs->v[2] += sint1(1); //next sample of the pixel
 	}
 
 	return ctt;
 }
 
+#define RADIANCE_CACHE_BATCH 16 //paths per cache point between the error estimates
+#define RADIANCE_CACHE_ERROR 0.02f //relative standard error of the converged points
+#define RADIANCE_CACHE_MIN_LUMINANCE 1e-3f
+#define RADIANCE_CACHE_MAX_UNCONVERGED 0.01f //fraction of the points left unconverged before a warning
+
+//Fill the radiance cache: estimate the in-scattered radiance at the corners of every leaf, averaged over uniformly
+//distributed incident directions. The full paths are traced up to scattevs, so the cache holds the remaining
+//scattering orders regardless of the depth it's used at. Each point is sampled in batches until the relative error
+//of its luminance falls below RADIANCE_CACHE_ERROR, or cachesamples paths have been traced.
+static bool BakeRadiance(RenderKernel *pkernel){
+	const OctreeNode *pnodes = pkernel->pscene->pnodes;
+	std::vector<uint> leaves(pkernel->pscene->leafc); //node of each leaf, whose index is the cache slot
+	for(uint i = 0; i < pkernel->pscene->nodec; ++i)
+		if(pnodes[i].leaf != ~0u)
+			leaves[pnodes[i].leaf] = i;
+
+	uint np = 8*leaves.size(), nq = BLCLOUD_VSIZE*((np+BLCLOUD_VSIZE-1)/BLCLOUD_VSIZE);
+	float *pc = (float*)_mm_malloc(RADIANCE_CACHE_CHANNELS*nq*sizeof(float),BLCLOUD_VALIGN);
+	if(!pc)
+		return false;
+
+	uint batches = std::max((pkernel->cachesamples+RADIANCE_CACHE_BATCH-1)/RADIANCE_CACHE_BATCH,2u);
+	std::atomic<uint> unconvc(0);
+	tbb::parallel_for(tbb::blocked_range<uint>(0,nq/BLCLOUD_VSIZE),[&](const tbb::blocked_range<uint> &nr){
+		for(uint i = nr.begin(); i < nr.end(); ++i){
+			dintN Q;
+			dfloatN P[3];
+			for(uint j = 0; j < BLCLOUD_VSIZE; ++j){
+				uint q = std::min(BLCLOUD_VSIZE*i+j,np-1);
+				const dfloat4 &ce = pnodes[leaves[q/8]].ce;
+				P[0].v[j] = ce.x+(q&1?ce.w:-ce.w);
+				P[1].v[j] = ce.y+(q&2?ce.w:-ce.w);
+				P[2].v[j] = ce.z+(q&4?ce.w:-ce.w);
+				Q.v[j] = q;
+			}
+			sfloat4 rc;
+			for(uint k = 0; k < 3; ++k)
+				rc.v[k] = sfloat1::load(&P[k]);
+			rc.v[3] = sfloat1::one();
+
+			sint1 q = sint1::load(&Q);
+			sint4 rs;
+			RNG_Init(&rs,q);
+			rs.v[3] = RNG_Hash(q);
+
+			sfloat4 cl = sfloat4::zero(), cs = sfloat4::zero();
+			sfloat1 n = sfloat1::zero(), m2 = sfloat1::zero(); //paths and luminance second moment of the points
+			sfloat1 gm = sint1::trueI(); //points still sampled
+			for(uint b = 0; b < batches && gm.AnyTrue(); ++b){
+				for(uint s = 0; s < RADIANCE_CACHE_BATCH; ++s){
+					sfloat1 z = 1.0f-2.0f*RNG_Sample(&rs);
+					sfloat1 rz = sfloat1::sqrt(sfloat1::max(1.0f-z*z,sfloat1::zero()));
+					sfloat1 sph, cph;
+					sfloat1::sincos(2.0f*SM_PI*RNG_Sample(&rs),&sph,&cph);
+					sfloat4 rd;
+					rd.v[0] = rz*cph;
+					rd.v[1] = rz*sph;
+					rd.v[2] = z;
+					rd.v[3] = sfloat1::zero();
+
+					std::tuple<sfloat4,sfloat4> S = InScattering(rc,rd,gm,pkernel,&rs,0,sfloat1::one(),sfloat1::zero(),dintN(0));
+					sfloat4 sl = std::get<0>(S), se = std::get<1>(S);
+					for(uint k = 0; k < 3; ++k){
+						cl.v[k] += sfloat1::And(gm,sl.v[k]);
+						cs.v[k] += sfloat1::And(gm,se.v[k]);
+					}
+					sfloat1 y = 0.2126f*(sl.v[0]+se.v[0])+0.7152f*(sl.v[1]+se.v[1])+0.0722f*(sl.v[2]+se.v[2]);
+					m2 += sfloat1::And(gm,y*y);
+					n += sfloat1::And(gm,sfloat1::one());
+					rs.v[2] += sint1(1);
+				}
+				if(b == 0)
+					continue; //at least two batches for the error
+				sfloat1 m = (0.2126f*(cl.v[0]+cs.v[0])+0.7152f*(cl.v[1]+cs.v[1])+0.0722f*(cl.v[2]+cs.v[2]))/n;
+				sfloat1 v = sfloat1::max(m2-n*m*m,sfloat1::zero())/(n-sfloat1::one()); //per-path variance
+				sfloat1 e = RADIANCE_CACHE_ERROR*sfloat1::max(m,sfloat1(RADIANCE_CACHE_MIN_LUMINANCE));
+				gm = sfloat1::AndNot(sfloat1::Less(v,e*e*n),gm);
+			}
+			dintN GM = dintN(gm);
+			for(uint j = 0; j < BLCLOUD_VSIZE; ++j)
+				if(GM.v[j] != 0 && BLCLOUD_VSIZE*i+j < np)
+					unconvc.fetch_add(1);
+			cl /= n;
+			cs /= n;
+			for(uint k = 0; k < 3; ++k){
+				sfloat1::store(pc+k*nq+BLCLOUD_VSIZE*i,cl.v[k]);
+				sfloat1::store(pc+(3+k)*nq+BLCLOUD_VSIZE*i,cs.v[k]);
+			}
+		}
+	});
+
+	//enabled only now, so that the paths above are fully traced
+	for(uint k = 0; k < RADIANCE_CACHE_CHANNELS; ++k)
+		pkernel->prcache[k] = pc+k*nq;
+	DebugPrintf("Baked the radiance cache, %u leaves.\n",(uint)leaves.size());
+	if((float)unconvc > RADIANCE_CACHE_MAX_UNCONVERGED*(float)np)
+		DebugPrintf("Warning: radiance cache didn't converge at %u of %u points within %u samples. The error of the cached radiance stays in the terminated paths regardless of the render samples; increase the cache samples or the cache depth.\n",(uint)unconvc,np,RADIANCE_CACHE_BATCH*batches);
+
+	return true;
+}
+
 static void K_ParallelRender(RenderKernel *pkernel, uint x0, uint y0, uint rx, uint ry, std::function<void (const sfloat4 &, const sfloat4 &, const sfloat1 &, uint, uint, sint4 &)> func){
 		matrix44 viewi = matrix44::load(&pkernel->viewi);
 		matrix44 proji = matrix44::load(&pkernel->proji);
 		//
+		dfloatN vpx, vpy; //pixel offsets within the packet
+		for(uint i = 0; i < BLCLOUD_VSIZE; ++i){
+			vpx.v[i] = (float)RenderKernel::vpattern[i].y;
+			vpy.v[i] = (float)RenderKernel::vpattern[i].x;
+		}
+		sfloat1 spx = sfloat1::load(&vpx);
+		sfloat1 spy = sfloat1::load(&vpy);
+		//packets may extend over the tile edges if the tile size isn't a multiple of the pattern
+		uint qx = (rx+BLCLOUD_VX-1)/BLCLOUD_VX;
+		uint qy = (ry+BLCLOUD_VY-1)/BLCLOUD_VY;
+		sfloat1 tx1 = sfloat1((float)(x0+rx));
+		sfloat1 ty1 = sfloat1((float)(y0+ry));
 #define BLCLOUD_MT
 #ifdef BLCLOUD_MT
-	tbb::parallel_for(tbb::blocked_range2d<size_t>(y0,y0+ry/BLCLOUD_VY,x0,x0+rx/BLCLOUD_VX),[&](const tbb::blocked_range2d<size_t> &nr){
+	tbb::parallel_for(tbb::blocked_range2d<size_t>(y0,y0+qy,x0,x0+qx),[&](const tbb::blocked_range2d<size_t> &nr){
 		for(uint y = nr.rows().begin(); y < nr.rows().end(); ++y){
 			for(uint x = nr.cols().begin(); x < nr.cols().end(); ++x){
 #else
 	{
-		for(uint y = y0; y < y0+ry/BLCLOUD_VY; ++y){
-			for(uint x = x0; x < x0+rx/BLCLOUD_VX; ++x){
+		for(uint y = y0; y < y0+qy; ++y){
+			for(uint x = x0; x < x0+qx; ++x){
 #endif
+				sfloat1 px = sfloat1((float)(BLCLOUD_VX*(x-x0)+x0))+spx;
+				sfloat1 py = sfloat1((float)(BLCLOUD_VY*(y-y0)+y0))+spy;
+
 				sfloat4 posh;
-				posh.v[0] = -(2.0f*(sfloat1((float)(BLCLOUD_VX*(x-x0)+x0)+0.5f)+sfloat1(0,1,0,1))/sfloat1((float)pkernel->w)-sfloat1::one());
-				posh.v[1] = -(2.0f*(sfloat1((float)(BLCLOUD_VY*(y-y0)+y0)+0.5f)+sfloat1(0,0,1,1))/sfloat1((float)pkernel->h)-sfloat1::one());
+				posh.v[0] = -(2.0f*(px+0.5f)/sfloat1((float)pkernel->w)-sfloat1::one());
+				posh.v[1] = -(2.0f*(py+0.5f)/sfloat1((float)pkernel->h)-sfloat1::one());
 				posh.v[2] = sfloat1::zero();
 				posh.v[3] = sfloat1::one();
 
@@ -472,11 +1421,35 @@ static void K_ParallelRender(RenderKernel *pkernel, uint x0, uint y0, uint rx, u
 				sfloat1 gm = sfloat1::And(
 					sfloat1::And(sfloat1::Greater(posh.v[0],-sfloat1::one()),sfloat1::Less(posh.v[0],sfloat1::one())),
 					sfloat1::And(sfloat1::Greater(posh.v[1],-sfloat1::one()),sfloat1::Less(posh.v[1],sfloat1::one())));
+				gm = sfloat1::And(gm,sfloat1::And(sfloat1::Less(px,tx1),sfloat1::Less(py,ty1)));
+
+				if(pkernel->activec < rx*ry){
+					//skip the pixels that have already converged
+					dintN wmask = dintN(gm);
+					for(uint i = 0; i < BLCLOUD_VSIZE; ++i)
+						if(wmask.v[i] != 0)
+							wmask.v[i] = pkernel->pactive[(BLCLOUD_VY*(y-y0)+RenderKernel::vpattern[i].x)*rx+BLCLOUD_VX*(x-x0)+RenderKernel::vpattern[i].y];
+					gm = sint1::load(&wmask);
+					if(gm.AllFalse())
+						continue;
+				}
 
+				//continue the rng sequence of the packet from the previous pass
+				dintN *prngs = &pkernel->prngs[4*((y-y0)*qx+(x-x0))];
 				sint4 rngs;
-				RNG_Init(&rngs);
+				for(uint i = 0; i < 4; ++i)
+					rngs.v[i] = sint1::load(&prngs[i]);
+
+				//sample index of the pixels for the samplers
+				dintN wmask = dintN(gm), spp;
+				for(uint i = 0; i < BLCLOUD_VSIZE; ++i)
+					spp.v[i] = wmask.v[i] != 0?pkernel->pspp[(BLCLOUD_VY*(y-y0)+RenderKernel::vpattern[i].x)*rx+BLCLOUD_VX*(x-x0)+RenderKernel::vpattern[i].y]:0;
+				rngs.v[2] = sint1::load(&spp);
 
 				func(ro,rd,gm,x,y,rngs);
+
+				for(uint i = 0; i < 4; ++i)
+					prngs[i] = dintN(rngs.v[i]);
 			}
 		}
 #ifdef BLCLOUD_MT
@@ -496,27 +1469,62 @@ RenderKernel::~RenderKernel(){
 
 bool RenderKernel::Initialize(const Scene *pscene, const SceneOcclusion *psceneocc, const dmatrix44 *pviewi, const dmatrix44 *pproji,
 	 KernelSampler::PhaseFunction *ppf, KernelSampler::BaseEnv *penv, float *pdepth,
-	 uint scattevs, float msigmas, float msigmaa, uint tilex, uint tiley, uint w, uint h, uint flags){
+	 uint scattevs, uint cachedepth, uint cachesamples, uint rrdepth, uint splits, uint octaves, float msigmas, float msigmaa, float threshold, uint tilex, uint tiley, uint w, uint h, uint flags){
 	for(uint i = 0; i < BUFFER_COUNT; ++i)
-		if(!(phb[i] = (dfloat4*)_mm_malloc(tilex*tiley*16,16)))
+		if(!(phb[i] = (dfloat4*)_mm_malloc(tilex*tiley*16,16)) || !(pacc[i] = new(std::nothrow) double[4*tilex*tiley]))
 			return false;
+	if(!(pm2 = new(std::nothrow) double[2*tilex*tiley]) || !(pspp = new(std::nothrow) uint[tilex*tiley]) || !(pactive = new(std::nothrow) int[tilex*tiley]))
+		return false;
+	uint packets = ((tilex+BLCLOUD_VX-1)/BLCLOUD_VX)*((tiley+BLCLOUD_VY-1)/BLCLOUD_VY);
+	if(!(prngs = (dintN*)_mm_malloc(4*packets*sizeof(dintN),BLCLOUD_VALIGN)))
+		return false;
+	if(!(pparent = new(std::nothrow) uint[pscene->nodec]))
+		return false;
+	pparent[0] = 0;
+	for(uint i = 0; i < pscene->nodec; ++i)
+		for(uint j = 0, m = pscene->pnodes[i].mask; m != 0; m &= m-1, ++j)
+			pparent[pscene->pnodes[i].chn+j] = i;
+	ptraversers = new tbb::enumerable_thread_specific<KernelOctree::OctreeFullTraverser>();
+	pleaves = new KernelOctree::OctreeLeafArena();
 	this->pdepth = pdepth;
 
 	this->pscene = pscene;
 	this->psceneocc = psceneocc;
 	this->scattevs = scattevs;
+	this->cachedepth = cachedepth;
+	this->cachesamples = cachesamples;
+
+	//the space between the leaves inside the surface lies beyond the narrow band, where the sdf is clamped
+	sdfband = 0.0f;
+	for(uint i = 0; i < pscene->leafc; ++i)
+		if(pscene->pleafdata[i].volx[VOLUME_BUFFER_SDF] != ~0u)
+			sdfband = std::max(sdfband,-pscene->pleafdata[i].qval[VOLUME_BUFFER_SDF]);
+	this->rrdepth = rrdepth;
+	this->splits = std::max(splits,1u);
+	this->octaves = octaves;
 	this->msigmas = msigmas;
 	this->msigmaa = msigmaa;
+	this->threshold = threshold;
 	this->w = w;
 	this->h = h;
 	this->tilew = 0;
 	this->tileh = 0;
+	this->samplec = 0;
 	this->flags = flags;
 	viewi = *pviewi;
 	proji = *pproji;
 
 	this->ppf = ppf;
 	this->penv = penv;
+#ifndef USE_ARHOSEK_SKYMODEL
+	this->penvs = dynamic_cast<KernelSampler::NullEnv*>(penv)?0:penv;
+#else
+	this->penvs = 0;
+#endif
+	if(flags & KERNEL_SOBOL){
+		psampler = &SobolSampler::gsobol;
+		DebugPrintf("Using Sobol sampler.\n");
+	}else psampler = &RandomSampler::grandom;
 
 #ifdef USE_ARHOSEK_SKYMODEL
 	skydir = dynamic_cast<KernelSampler::SunLight*>(KernelSampler::BaseLight::lights[0])->direction;
@@ -525,23 +1533,174 @@ bool RenderKernel::Initialize(const Scene *pscene, const SceneOcclusion *psceneo
 	pskyms = arhosek_rgb_skymodelstate_alloc_init(7.0,0.15,se);
 #endif
 
-	if(KernelSampler::BaseLight::lights.size() != 1)
-		DebugPrintf("Warning: only one directional light is currently properly supported.\n");
+	KernelSampler::BaseLight::InitializeSelection();
+	DebugPrintf("Sampling %u lights.\n",(uint)KernelSampler::BaseLight::lights.size());
+
+	if(threshold > 0.0f)
+		DebugPrintf("Adaptive sampling enabled, threshold %f.\n",threshold);
+
+	if(flags & KERNEL_OCTAVES){
+		if(psceneocc)
+			DebugPrintf("Warning: approximate multiple scattering ignores the surface occlusion of the light rays.\n");
+		DebugPrintf("Using approximate multiple scattering, %u octaves.\n",octaves);
+	}
+
+	phdda = 0;
+	if(flags & KERNEL_HDDA){
+		if(!(phdda = new(std::nothrow) KernelOctree::OctreeHDDAGrid()) || !phdda->Initialize(pscene->pnodes,pscene->nodec)){
+			DebugPrintf("Warning: HDDA traversal requires the leaves at a single depth, traversing the octree.\n");
+			delete phdda;
+			phdda = 0;
+		}else DebugPrintf("Using HDDA traversal of the secondary and light rays.\n");
+	}
+
+	ptcache = 0;
+	if(flags & KERNEL_SUNCACHE && !(flags & KERNEL_OCTAVES)){
+		if(psceneocc)
+			DebugPrintf("Warning: transmittance cache doesn't support surface occlusion, tracing the light rays.\n");
+		else if(!BakeTransmittance(this)){
+			DebugPrintf("Warning: failed to bake the transmittance cache (only suns are supported), tracing the light rays.\n");
+			_mm_free(ptcache);
+			ptcache = 0;
+		}else DebugPrintf("Baked the transmittance cache, %u^3 points per light.\n",TRANSMITTANCE_CACHE_SIZE);
+	}
+
+	for(uint i = 0; i < RADIANCE_CACHE_CHANNELS; ++i)
+		prcache[i] = 0;
+	if(cachedepth > 0 && cachedepth < scattevs && !(flags & KERNEL_OCTAVES)){
+		if(psceneocc)
+			DebugPrintf("Warning: radiance cache doesn't support surface occlusion, tracing the full paths.\n");
+		else if(!BakeRadiance(this))
+			DebugPrintf("Error: failed to allocate the radiance cache, tracing the full paths.\n");
+		else DebugPrintf("Using the radiance cache after %u scattering events.\n",cachedepth);
+	}
+
+	if(flags & KERNEL_WAVEFRONT){
+		if(psceneocc)
+			DebugPrintf("Warning: wavefront integrator doesn't support surface occlusion, using the recursive integrator.\n");
+		else DebugPrintf("Using wavefront integrator.\n");
+	}
 
 	DebugPrintf("Initialized render kernel.\n");
 
 	return true;
 }
 
-void RenderKernel::Render(uint x0, uint y0, uint tilex, uint tiley, uint samples){
-	//feenableexcept(FE_ALL_EXCEPT&~FE_INEXACT);
-	tbb::enumerable_thread_specific<KernelOctree::OctreeFullTraverser> traversers; //share the full traverser object among pixels to save list
-	//
+//Start a new pass. Accumulation restarts if the tile or the pass type changes, otherwise the samples of this pass
+//are added to the previous ones.
+void RenderKernel::BeginPass(uint x0, uint y0, uint tilex, uint tiley, PASS pass){
+	if(samplec > 0 && x0 == accx && y0 == accy && tilex == tilew && tiley == tileh && pass == accpass)
+		return;
+	accx = x0;
+	accy = y0;
+	accpass = pass;
 	tilew = tilex;
 	tileh = tiley;
-	//
+	samplec = 0;
+	activec = tilex*tiley;
+	pleaves->Reset(x0,y0,tilex,tiley);
+	for(uint i = 0; i < BUFFER_COUNT; ++i)
+		memset(pacc[i],0,4*tilex*tiley*sizeof(double));
+	memset(pm2,0,2*tilex*tiley*sizeof(double));
+	memset(pspp,0,tilex*tiley*sizeof(uint));
+	for(uint i = 0, n = tilex*tiley; i < n; ++i)
+		pactive[i] = -1;
+	//key the packet streams by the pixel and pass type
+	uint qx = (tilex+BLCLOUD_VX-1)/BLCLOUD_VX;
+	for(uint i = 0, n = qx*((tiley+BLCLOUD_VY-1)/BLCLOUD_VY); i < n; ++i){
+		dintN key;
+		for(uint j = 0; j < BLCLOUD_VSIZE; ++j)
+			key.v[j] = 2*((y0+BLCLOUD_VY*(i/qx)+vpattern[j].x)*w+x0+BLCLOUD_VX*(i%qx)+vpattern[j].y)+pass;
+		dintN px;
+		for(uint j = 0; j < BLCLOUD_VSIZE; ++j)
+			px.v[j] = (BLCLOUD_VY*(i/qx)+vpattern[j].x)*tilex+BLCLOUD_VX*(i%qx)+vpattern[j].y;
+		sint4 rngs;
+		RNG_Init(&rngs,sint1::load(&key));
+		rngs.v[3] = SamplerSeed(sint1::load(&px),x0,y0,w);
+		for(uint j = 0; j < 4; ++j)
+			prngs[4*i+j] = dintN(rngs.v[j]);
+	}
+}
+
+#define ADAPTIVE_BATCHES 4 //batches per Render() call
+#define ADAPTIVE_MIN_BATCHES 8 //before the error can be estimated
+#define ADAPTIVE_MAX_BOOST 4 //max samples given to a pixel per call, relative to the requested count
+#define ADAPTIVE_MIN_LUMINANCE 1e-3
+
+static inline double Luminance(double r, double g, double b){
+	return 0.2126*r+0.7152*g+0.0722*b;
+}
+
+//Add the last pass (phb) to the accumulation buffers of the active pixels. Only the first bufferc buffers were
+//written by the pass, the rest are left at zero. With adaptive sampling, the error of each pixel is estimated from
+//the variance of the pass (batch) means, and the pixels below the threshold are deactivated.
+void RenderKernel::Accumulate(uint samples, uint bufferc){
+	std::atomic<uint> convc(0);
+	tbb::parallel_for(tbb::blocked_range<uint>(0,tilew*tileh),[&](const tbb::blocked_range<uint> &nr){
+		for(uint i = nr.begin(); i < nr.end(); ++i){
+			if(pactive[i] == 0)
+				continue;
+			for(uint j = 0; j < bufferc; ++j){
+				pacc[j][4*i+0] += phb[j][i].x;
+				pacc[j][4*i+1] += phb[j][i].y;
+				pacc[j][4*i+2] += phb[j][i].z;
+				pacc[j][4*i+3] += phb[j][i].w;
+			}
+			pspp[i] += samples;
+			if(threshold <= 0.0f)
+				continue;
+
+			double yb = 0.0;
+			for(uint j = 0; j < bufferc; ++j)
+				yb += Luminance(phb[j][i].x,phb[j][i].y,phb[j][i].z);
+			pm2[2*i+0] += yb*yb/(double)samples; //n_j*m_j^2
+			pm2[2*i+1] += 1.0;
+			if(pm2[2*i+1] < ADAPTIVE_MIN_BATCHES)
+				continue;
+
+			double n = (double)pspp[i];
+			double m = 0.0;
+			for(uint j = 0; j < bufferc; ++j)
+				m += Luminance(pacc[j][4*i+0],pacc[j][4*i+1],pacc[j][4*i+2]);
+			m /= n;
+			double v = std::max(pm2[2*i+0]-n*m*m,0.0)/(pm2[2*i+1]-1.0); //per-sample variance
+			if(sqrt(v/n) <= threshold*std::max(m,ADAPTIVE_MIN_LUMINANCE)){
+				pactive[i] = 0;
+				convc.fetch_add(1);
+			}
+		}
+	});
+	activec -= convc;
+}
+
+void RenderKernel::Render(uint x0, uint y0, uint tilex, uint tiley, uint samples){
+	BeginPass(x0,y0,tilex,tiley,PASS_RENDER);
+	if(threshold <= 0.0f){
+		RenderPass(x0,y0,tilex,tiley,samples);
+		Accumulate(samples,BUFFER_COUNT);
+	}else{
+		//Split the samples into batches. The budget of the converged pixels is given to the remaining ones.
+		uint batch = std::max(samples/ADAPTIVE_BATCHES,1u);
+		uint64_t budget = (uint64_t)samples*tilex*tiley;
+		for(uint i = 0; i < ADAPTIVE_MAX_BOOST*samples && activec > 0; i += batch){
+			uint s = (uint)std::min((uint64_t)batch,budget/activec);
+			if(s == 0)
+				break;
+			RenderPass(x0,y0,tilex,tiley,s);
+			budget -= (uint64_t)s*activec;
+			Accumulate(s,BUFFER_COUNT);
+		}
+	}
+	samplec += samples;
+}
+
+void RenderKernel::RenderPass(uint x0, uint y0, uint tilex, uint tiley, uint samples){
+	if(flags & KERNEL_WAVEFRONT && !psceneocc && RenderWavefront(x0,y0,tilex,tiley,samples))
+		return;
+	//feenableexcept(FE_ALL_EXCEPT&~FE_INEXACT);
 	K_ParallelRender(this,x0,y0,tilex,tiley,[&](const sfloat4 &ro, const sfloat4 &rd, const sfloat1 &gm, uint x, uint y, sint4 &rngs)->void{
-		KernelOctree::OctreeFullTraverser &traverser = traversers.local();
+		KernelOctree::OctreeFullTraverser &traverser = ptraversers->local(); //share the full traverser object among pixels to save list
+		traverser.Initialize(ro,rd,gm,pscene->pnodes,pleaves,(y-y0)*((tilex+BLCLOUD_VX-1)/BLCLOUD_VX)+(x-x0));
 
 		dintN wmask = dintN(gm);
 		dfloatN Depth;
@@ -553,7 +1712,7 @@ void RenderKernel::Render(uint x0, uint y0, uint tilex, uint tiley, uint samples
 
 		sfloat1 depth = sfloat1::load(&Depth);
 
-		std::tuple<sfloat4,sfloat4> ctt = SampleVolume(ro,rd,gm,this,&traverser,&rngs,0,samples,depth);
+		std::tuple<sfloat4,sfloat4> ctt = SampleVolume(ro,rd,gm,this,&traverser,&rngs,0,samples,depth,0,SAMPLER_DIM_FREEFLIGHT,sfloat4(1.0f),sfloat4(1.0f),sfloat1::one(),sfloat1::zero(),dintN(0));
 		sfloat4 &cl = std::get<0>(ctt);
 		sfloat4 &cs = std::get<1>(ctt);
 
@@ -566,13 +1725,376 @@ void RenderKernel::Render(uint x0, uint y0, uint tilex, uint tiley, uint samples
 	//fedisableexcept(FE_ALL_EXCEPT&~FE_INEXACT);
 }
 
+//------------------------------------------------------------------------------
+//Wavefront integrator. Instead of recursing at every scattering event, the path state is kept in SoA queues and
+//processed in stages: free-flight of the primary rays, scattering (phase/light sampling), and free-flight of the
+//phase and light rays. Each stage appends only the active lanes to the next queue, so the stages always work on
+//full packets. The estimator is the same as with SampleVolume().
+//The queues are sorted by the producing packet before each stage, and the radiance is added to the pixels in the
+//queue order, so the packets and the sums don't depend on the thread scheduling and a tile renders the same every
+//time.
+
+#define WAVEFRONT_CAPACITY (1<<18) //max paths per queue and wave
+
+enum PATH_FIELD{
+	PATH_RO = 0, //origin, or the scattering location
+	PATH_RD = 3, //direction
+	PATH_TP = 6, //throughput (rgb)
+	PATH_WL = 9, //MIS weight of the light radiance if the ray escapes (rgb)
+	PATH_WE = 12, //-- sky radiance
+	PATH_RI = 15, //radius of the interior ball around the origin
+	PATH_FLOAT_COUNT = 16
+};
+
+class PathQueue{
+public:
+	PathQueue() : n(0){
+		for(uint i = 0; i < PATH_FLOAT_COUNT; ++i)
+			pf[i] = 0;
+		ppx = 0;
+		pr = 0;
+		pk = 0;
+		ps = 0;
+		pn = 0;
+		po = 0;
+	}
+
+	~PathQueue(){
+		for(uint i = 0; i < PATH_FLOAT_COUNT; ++i)
+			_mm_free(pf[i]);
+		_mm_free(ppx);
+		_mm_free(pr);
+		_mm_free(pk);
+		_mm_free(ps);
+		_mm_free(pn);
+		_mm_free(po);
+	}
+
+	bool Initialize(uint capacity){
+		capacity = BLCLOUD_VSIZE*((capacity+BLCLOUD_VSIZE-1)/BLCLOUD_VSIZE);
+		for(uint i = 0; i < PATH_FLOAT_COUNT; ++i)
+			if(!(pf[i] = (float*)_mm_malloc(capacity*sizeof(float),BLCLOUD_VALIGN)))
+				return false;
+		if(!(ppx = (int*)_mm_malloc(capacity*sizeof(int),BLCLOUD_VALIGN)) || !(pr = (int*)_mm_malloc(capacity*sizeof(int),BLCLOUD_VALIGN)) ||
+			!(pk = (int*)_mm_malloc(capacity*sizeof(int),BLCLOUD_VALIGN)) || !(ps = (int*)_mm_malloc(capacity*sizeof(int),BLCLOUD_VALIGN)) ||
+			!(pn = (int*)_mm_malloc(capacity*sizeof(int),BLCLOUD_VALIGN)) || !(po = (uint64_t*)_mm_malloc(capacity*sizeof(uint64_t),BLCLOUD_VALIGN)))
+			return false;
+		n = 0;
+		return true;
+	}
+
+	//append the lanes where m != 0. The order key identifies the push: producing packet, and the push within it.
+	void Push(const sfloat4 &ro, const sfloat4 &rd, const sfloat4 &tp, const sfloat4 &wl, const sfloat4 &we, const sfloat1 &ri, const dintN &rn, const sint1 &px, const sint1 &r, const sint1 &k, const sint1 &sn, const sfloat1 &m, uint64_t order){
+		int mask = m.MoveMask();
+		if(mask == 0)
+			return;
+		dfloatN f[PATH_FLOAT_COUNT];
+		for(uint i = 0; i < 3; ++i){
+			sfloat1::store(&f[PATH_RO+i],ro.v[i]);
+			sfloat1::store(&f[PATH_RD+i],rd.v[i]);
+			sfloat1::store(&f[PATH_TP+i],tp.v[i]);
+			sfloat1::store(&f[PATH_WL+i],wl.v[i]);
+			sfloat1::store(&f[PATH_WE+i],we.v[i]);
+		}
+		sfloat1::store(&f[PATH_RI],ri);
+		dintN PX = dintN(px);
+		dintN R = dintN(r);
+		dintN K = dintN(k);
+		dintN S = dintN(sn);
+		for(uint b = n.fetch_add(__builtin_popcount(mask)); mask != 0; mask &= mask-1, ++b){
+			uint j = __builtin_ctz(mask);
+			for(uint i = 0; i < PATH_FLOAT_COUNT; ++i)
+				pf[i][b] = f[i].v[j];
+			ppx[b] = PX.v[j];
+			pr[b] = R.v[j];
+			pk[b] = K.v[j];
+			ps[b] = S.v[j];
+			pn[b] = rn.v[j];
+			po[b] = BLCLOUD_VSIZE*order+j;
+		}
+	}
+
+	//sort the entries by the order key, undoing the order in which the threads appended them
+	void Sort(){
+		std::vector<std::pair<uint64_t, uint>> ks(n);
+		for(uint i = 0; i < n; ++i)
+			ks[i] = std::make_pair(po[i],i);
+		tbb::parallel_sort(ks.begin(),ks.end());
+		std::vector<float> tf(n);
+		for(uint i = 0; i < PATH_FLOAT_COUNT; ++i){
+			for(uint j = 0; j < n; ++j)
+				tf[j] = pf[i][ks[j].second];
+			std::copy(tf.begin(),tf.end(),pf[i]);
+		}
+		std::vector<int> ti(n);
+		for(int *pi : {ppx,pr,pk,ps,pn}){
+			for(uint j = 0; j < n; ++j)
+				ti[j] = pi[ks[j].second];
+			std::copy(ti.begin(),ti.end(),pi);
+		}
+		for(uint j = 0; j < n; ++j)
+			po[j] = ks[j].first;
+	}
+
+	//load the packet i, return the mask of valid lanes
+	sfloat1 Load(uint i, sfloat4 *pro, sfloat4 *prd, sfloat4 *ptp, sfloat4 *pwl, sfloat4 *pwe, sfloat1 *pri, dintN *prn, sint1 *ppx1, sint1 *pr1, sint1 *pk1, sint1 *ps1) const{
+		uint b = BLCLOUD_VSIZE*i;
+		for(uint j = 0; j < 3; ++j){
+			pro->v[j] = sfloat1::load(pf[PATH_RO+j]+b);
+			prd->v[j] = sfloat1::load(pf[PATH_RD+j]+b);
+			ptp->v[j] = sfloat1::load(pf[PATH_TP+j]+b);
+			pwl->v[j] = sfloat1::load(pf[PATH_WL+j]+b);
+			pwe->v[j] = sfloat1::load(pf[PATH_WE+j]+b);
+		}
+		pro->v[3] = sfloat1::one();
+		prd->v[3] = sfloat1::zero();
+		ptp->v[3] = sfloat1::zero();
+		pwl->v[3] = sfloat1::zero();
+		pwe->v[3] = sfloat1::zero();
+		*pri = sfloat1::load(pf[PATH_RI]+b);
+		*ppx1 = sint1::load(ppx+b);
+		*pr1 = sint1::load(pr+b);
+		*pk1 = sint1::load(pk+b);
+		*ps1 = sint1::load(ps+b);
+		*prn = dintN(pn+b);
+		return sint1::Less(sint1::index()+sint1(b),sint1(n));
+	}
+
+	uint Packets() const{
+		return (n+BLCLOUD_VSIZE-1)/BLCLOUD_VSIZE;
+	}
+
+	float *pf[PATH_FLOAT_COUNT];
+	int *ppx; //tile pixel index
+	int *pr; //scattering events
+	int *pk; //rng key of the path segment
+	int *ps; //sample index of the pixel
+	int *pn; //leaf of the origin, 0 if unknown
+	uint64_t *po; //order key
+	std::atomic<uint> n;
+};
+
+//radiance gathered by the entries of the queue being processed, added to the pixels once the stage is done
+struct WavefrontRadiance{
+	WavefrontRadiance(uint capacity) : cl(BLCLOUD_VSIZE*((capacity+BLCLOUD_VSIZE-1)/BLCLOUD_VSIZE),dfloat4(0.0f)), cs(cl){}
+	//add rgb of the lanes where m != 0 to the entries of the packet i
+	static void Accumulate(std::vector<dfloat4> &buf, const sfloat4 &c, uint i, const sfloat1 &m){
+		for(int mask = m.MoveMask(); mask != 0; mask &= mask-1){
+			uint j = __builtin_ctz(mask);
+			float4::store(&buf[BLCLOUD_VSIZE*i+j],float4::load(&buf[BLCLOUD_VSIZE*i+j])+c.get(j));
+		}
+	}
+	//add the entries to their pixels in the queue order, and clear them
+	void Resolve(const PathQueue &q, dfloat4 *pl, dfloat4 *pe){
+		for(uint i = 0; i < q.n; ++i){
+			float4::store(&pl[q.ppx[i]],float4::load(&pl[q.ppx[i]])+float4::load(&cl[i]));
+			float4::store(&pe[q.ppx[i]],float4::load(&pe[q.ppx[i]])+float4::load(&cs[i]));
+			cl[i] = dfloat4(0.0f);
+			cs[i] = dfloat4(0.0f);
+		}
+	}
+	std::vector<dfloat4> cl;
+	std::vector<dfloat4> cs;
+};
+
+bool RenderKernel::RenderWavefront(uint x0, uint y0, uint tilex, uint tiley, uint samples){
+	//primary waves process several samples at once while the paths fit in the queues
+	uint npx = BLCLOUD_VX*((tilex+BLCLOUD_VX-1)/BLCLOUD_VX)*BLCLOUD_VY*((tiley+BLCLOUD_VY-1)/BLCLOUD_VY);
+	uint wsamples = std::max(WAVEFRONT_CAPACITY/(npx*splits),1u);
+	uint capacity = std::min(wsamples,samples)*npx*splits; //the first events are split
+
+	PathQueue qs, qr, ql, qe; //scattering events, phase rays, light rays, environment rays
+	if(!qs.Initialize(capacity) || !qr.Initialize(capacity) || !ql.Initialize(capacity) || (penvs && !qe.Initialize(capacity))){
+		DebugPrintf("Error: failed to allocate the path queues, falling back to the recursive integrator.\n");
+		return false;
+	}
+	WavefrontRadiance wr(capacity);
+
+	sfloat1 msigmas = sfloat1(this->msigmas);
+	sfloat1 msigmae = sfloat1(this->msigmaa)+msigmas;
+	sfloat1 msigmar = msigmas/msigmae;
+
+	//free-flight of the phase (light == false), or transmittance of the light/environment rays
+	auto TraceStage = [&](PathQueue &qi, bool light)->void{
+		qi.Sort();
+		tbb::parallel_for(tbb::blocked_range<uint>(0,qi.Packets()),[&](const tbb::blocked_range<uint> &nr){
+			KernelOctree::OctreeStepTraverser steptrv;
+			KernelOctree::OctreeHDDATraverser hddatrv(phdda);
+			KernelOctree::BaseOctreeTraverser *ptrv = phdda?(KernelOctree::BaseOctreeTraverser*)&hddatrv:&steptrv;
+			for(uint i = nr.begin(); i < nr.end(); ++i){
+				sfloat4 ro, rd, tp, wgl, wge;
+				sfloat1 ri;
+				dintN rn;
+				sint1 px, r, k, sn;
+				sfloat1 gm = qi.Load(i,&ro,&rd,&tp,&wgl,&wge,&ri,&rn,&px,&r,&k,&sn);
+
+				sint4 rs;
+				RNG_Init(&rs,k);
+				rs.v[2] = sn;
+				rs.v[3] = SamplerSeed(px,x0,y0,w);
+
+				if(light){
+					sfloat1 tr = InteriorTransmittance(ro,rd,gm,ri,rn,this,ptrv,&rs,r);
+					sfloat1 em = sfloat1::And(gm,sfloat1::Greater(tr,sfloat1::zero()));
+					if(em.AnyTrue()){
+						sfloat4 lc, le;
+						EscapeRadiance(rd,this,&lc,&le);
+						WavefrontRadiance::Accumulate(wr.cl,lc*tp*wgl*tr,i,em); //zero wgl for the environment rays
+						WavefrontRadiance::Accumulate(wr.cs,le*tp*wge*tr,i,em); //zero wge for the light rays
+					}
+					continue;
+				}
+
+				sfloat1 td, mm, ri1;
+				dintN nodes = dintN(0); //scattering leaves
+				sfloat1 rm;
+				if(prcache[0]){ //the cache needs the leaves
+					ptrv->Initialize(ro,rd,gm,pscene->pnodes,rn,pparent);
+					rm = FreeFlight(ro,rd,gm,sfloat1(FLT_MAX),this,ptrv,&rs,r,SAMPLER_DIM_FREEFLIGHT,&td,&mm,&nodes,&ri1);
+				}else rm = InteriorFlight(ro,rd,gm,ri,rn,this,ptrv,&rs,r,SAMPLER_DIM_FREEFLIGHT,&td,&mm,&nodes,&ri1);
+
+				sfloat1 em = sfloat1::And(gm,rm); //escaped
+				if(em.AnyTrue()){
+					sfloat4 lc, le;
+					EscapeRadiance(rd,this,&lc,&le);
+					WavefrontRadiance::Accumulate(wr.cl,lc*tp*wgl,i,em);
+					WavefrontRadiance::Accumulate(wr.cs,le*tp*wge,i,em);
+				}
+
+				sfloat1 sm = sfloat1::AndNot(rm,sfloat1::And(gm,sint1::Less(r,sint1(scattevs))));
+				if(prcache[0]){
+					//terminate with the cached radiance after cachedepth events
+					sfloat1 cm = sfloat1::AndNot(sint1::Less(r,sint1(cachedepth)),sm);
+					if(cm.AnyTrue()){
+						std::tuple<sfloat4,sfloat4> S = CachedInScattering(ro+rd*td,nodes,cm,this);
+						WavefrontRadiance::Accumulate(wr.cl,std::get<0>(S)*tp,i,cm);
+						WavefrontRadiance::Accumulate(wr.cs,std::get<1>(S)*tp,i,cm);
+						sm = sfloat1::AndNot(cm,sm);
+					}
+				}
+				qs.Push(ro+rd*td,rd,tp,wgl,wge,ri1,nodes,px,r,RNG_Next(&rs),sn,sm,(uint64_t)i<<32);
+			}
+		});
+		wr.Resolve(qi,phb[0],phb[1]);
+	};
+
+	for(uint s0 = 0; s0 < samples; s0 += wsamples){
+		uint sn = std::min(wsamples,samples-s0);
+		qs.n = 0;
+
+		K_ParallelRender(this,x0,y0,tilex,tiley,[&](const sfloat4 &ro, const sfloat4 &rd, const sfloat1 &gm, uint x, uint y, sint4 &rngs)->void{
+			KernelOctree::OctreeFullTraverser &traverser = ptraversers->local();
+
+			dintN wmask = dintN(gm);
+			dfloatN Depth;
+			dintN PX;
+			if(pdepth && flags & KERNEL_DEPTHCOMP){
+				for(uint i = 0; i < BLCLOUD_VSIZE; ++i)
+					if(wmask.v[i] != 0)
+						Depth.v[i] = pdepth[(BLCLOUD_VY*(y-y0)+y0+vpattern[i].x)*w+BLCLOUD_VX*(x-x0)+x0+vpattern[i].y];
+			}else Depth = dfloatN(FLT_MAX);
+			for(uint i = 0; i < BLCLOUD_VSIZE; ++i)
+				PX.v[i] = (BLCLOUD_VY*(y-y0)+vpattern[i].x)*tilex+BLCLOUD_VX*(x-x0)+vpattern[i].y;
+
+			sfloat1 depth = sfloat1::load(&Depth);
+			sint1 px = sint1::load(&PX);
+
+			//the primary path is identical for every sample
+			traverser.Initialize(ro,rd,gm,pscene->pnodes,pleaves,(y-y0)*((tilex+BLCLOUD_VX-1)/BLCLOUD_VX)+(x-x0));
+
+			//the lanes finishing early continue with the next samples of their pixels
+			sfloat1 alpha = sfloat1::zero();
+			dintN nodes = dintN(0); //scattering leaves, updated before finish()
+			uint64_t order = (uint64_t)((y-y0)*((tilex+BLCLOUD_VX-1)/BLCLOUD_VX)+(x-x0))<<32;
+			FreeFlightRefill rf;
+			rf.ptrv = &traverser;
+			rf.sc = sint1::And(gm,sint1(sn));
+			rf.finish = [&](const sfloat1 &fm, const sfloat1 &rm, const sfloat1 &td, const sfloat1 &mm, const sfloat1 &ri)->void{
+				sfloat1 sm = sfloat1::AndNot(rm,fm); //scattered
+				alpha += sfloat1::And(sm,sfloat1::one()); //alpha = 1 when scattering
+
+				if(scattevs > 0)
+					qs.Push(ro+rd*td,rd,sfloat4(1.0f),sfloat4(1.0f),sfloat4(1.0f),ri,nodes,px,sint1(0),RNG_Next(&rngs),rngs.v[2],sfloat1::And(sm,mm),order++);
+			};
+			rngs.v[2] = rngs.v[2]+sint1(s0); //sample index of the wave
+			sfloat1 td, mm, ri;
+			FreeFlight(ro,rd,gm,depth,this,&traverser,&rngs,sint1(0),SAMPLER_DIM_FREEFLIGHT,&td,&mm,&nodes,&ri,&rf);
+
+			for(uint i = 0; i < BLCLOUD_VSIZE; ++i)
+				if(wmask.v[i] != 0){
+					float4 a = float4(0.0f,0.0f,0.0f,alpha.get(i));
+					for(uint j = 0; j < BUFFER_COUNT; ++j)
+						float4::store(&phb[j][PX.v[i]],s0 == 0?a:float4::load(&phb[j][PX.v[i]])+a);
+				}
+		});
+
+		while(qs.n > 0){
+			qr.n = 0;
+			ql.n = 0;
+			qe.n = 0;
+			qs.Sort();
+			tbb::parallel_for(tbb::blocked_range<uint>(0,qs.Packets()),[&](const tbb::blocked_range<uint> &nr){
+				for(uint i = nr.begin(); i < nr.end(); ++i){
+					sfloat4 rc, rd, tp, wgl, wge;
+					sfloat1 ri;
+					dintN rn;
+					sint1 px, r, k, sn;
+					sfloat1 gm = qs.Load(i,&rc,&rd,&tp,&wgl,&wge,&ri,&rn,&px,&r,&k,&sn);
+
+					sint4 rs;
+					RNG_Init(&rs,k);
+					rs.v[2] = sn;
+					rs.v[3] = SamplerSeed(px,x0,y0,w);
+
+					//the first events are split, and every path after them carries the 1/splits weight, which is
+					//excluded from the roulette
+					sfloat4 tp1 = tp*msigmar;
+					sfloat1 fm = sfloat1::And(gm,sint1::Equal(r,sint1(0)));
+					uint ns = fm.AnyTrue()?splits:1;
+					sfloat1 tq = sfloat1::max(sfloat1::max(tp1.v[0],tp1.v[1]),tp1.v[2]);
+					sfloat1 q = Survival(sfloat1::select(tq*sfloat1((float)splits),tq,fm),r,this);
+					tp1 = tp1*sfloat1::select(sfloat1::one(),sfloat1(1.0f/(float)splits),fm);
+
+					for(uint j = 0; j < ns; ++j){
+						sfloat1 m = j == 0?gm:fm;
+						if(ns > 1)
+							rs.v[2] = sint1(sfloat1::select(sfloat1(sn),sfloat1(sn*sint1(splits)+sint1(j)),fm));
+
+						sfloat4 srd, lrd, erd, w1, w1e, w2, w3;
+						SampleScattering(rd,this,&rs,r,&srd,&lrd,&erd,&w1,&w1e,&w2,&w3);
+
+						sfloat1 sm = m;
+						if(sfloat1::Less(q,sfloat1::one()).AnyTrue())
+							sm = sfloat1::And(m,sfloat1::Less(RNG_Sample(&rs),q));
+						uint64_t order = ((uint64_t)i<<32)+j;
+						qr.Push(rc,srd,tp1/q,w1,w1e,ri,rn,px,r+sint1(1),RNG_Next(&rs),rs.v[2],sm,order);
+						if(ptcache)
+							WavefrontRadiance::Accumulate(wr.cl,CachedLight(rc,lrd,m,this)*w2*tp1,i,m);
+						else ql.Push(rc,lrd,tp1,w2,sfloat4::zero(),ri,rn,px,r,RNG_Next(&rs),rs.v[2],m,order); //r: scattering order of the light ray origin
+						if(penvs)
+							qe.Push(rc,erd,tp1,sfloat4::zero(),w3,ri,rn,px,r,RNG_Next(&rs),rs.v[2],m,order);
+					}
+				}
+			});
+			wr.Resolve(qs,phb[0],phb[1]);
+			qs.n = 0;
+
+			TraceStage(ql,true);
+			if(penvs)
+				TraceStage(qe,true);
+			TraceStage(qr,false);
+		}
+	}
+
+	return true;
+}
+
 void RenderKernel::Shadow(uint x0, uint y0, uint tilex, uint tiley, uint samples){
 	//feenableexcept(FE_ALL_EXCEPT&~FE_INEXACT);
-	tilew = tilex;
-	tileh = tiley;
-	//
+	BeginPass(x0,y0,tilex,tiley,PASS_SHADOW);
 	sfloat4 zfar = mul(float4(0,0,1,1),matrix44::load(&proji)).get(0);
 	sfloat1 clip_end = -zfar.v[2]/zfar.v[3];
+	float4 le = KernelSampler::BaseLight::IrradianceAll();
 
 	K_ParallelRender(this,x0,y0,tilex,tiley,[&](const sfloat4 &ro, const sfloat4 &rd, const sfloat1 &gm, uint x, uint y, sint4 &rngs)->void{
 		dintN wmask = dintN(gm);
@@ -592,17 +2114,23 @@ void RenderKernel::Shadow(uint x0, uint y0, uint tilex, uint tiley, uint samples
 
 		sfloat4 cs = sfloat4::zero();
 		for(uint i = 0; i < samples; ++i){
-			sfloat1 u3 = RNG_Sample(&rngs), u4 = RNG_Sample(&rngs);
-			sfloat4 lrd = KernelSampler::BaseLight::lights[0]->Sample(rd,u3,u4);
-
-			std::tuple<sfloat4,sfloat4> S2 = SampleVolume(ro1,lrd,gm1,this,0,&rngs,scattevs,1,FLT_MAX);
-			cs += std::get<0>(S2)/float4::load(&dynamic_cast<KernelSampler::SunLight*>(KernelSampler::BaseLight::lights[0])->color); //normalize by the intensity
+			sfloat1 u3 = psampler->Sample(&rngs,sint1(0),SAMPLER_DIM_LIGHT);
+			sfloat1 u4 = psampler->Sample(&rngs,sint1(0),(SAMPLER_DIM)(SAMPLER_DIM_LIGHT+1));
+			sfloat4 lrd = KernelSampler::BaseLight::SampleAll(rd,u3,u4);
+			sfloat1 lp = sfloat1::max(KernelSampler::BaseLight::PdfAll(lrd),1e-30f);
+
+			sfloat4 lc = ptcache?CachedLight(ro1,lrd,gm1,this):
+				std::get<0>(LightRay(ro1,lrd,gm1,sfloat1::zero(),dintN(0),this,&rngs,0,sfloat4(1.0f),sfloat4::zero()));
+			cs += lc/(sfloat4(le)*lp); //normalize by the total irradiance
+			rngs.v[2] += sint1(1);
 		}
 
 		for(uint i = 0; i < BLCLOUD_VSIZE; ++i)
 			if(wmask.v[i] != 0)
 				float4::store(&phb[0][(BLCLOUD_VY*(y-y0)+vpattern[i].x)*tilex+BLCLOUD_VX*(x-x0)+vpattern[i].y],cs.get(i)); //test
 	});
+	Accumulate(samples,1); //shadow only, BUFFER_ENVIRONMENT is not written
+	samplec += samples;
 	//fedisableexcept(FE_ALL_EXCEPT&~FE_INEXACT);
 }
 
@@ -610,13 +2138,36 @@ void RenderKernel::Destroy(){
 #ifdef USE_ARHOSEK_SKYMODEL
 	arhosekskymodelstate_free(pskyms);
 #endif
-	for(uint i = 0; i < BUFFER_COUNT; ++i)
+	for(uint i = 0; i < BUFFER_COUNT; ++i){
 		_mm_free(phb[i]);
+		delete []pacc[i];
+	}
+	delete []pm2;
+	delete []pspp;
+	delete []pactive;
+	_mm_free(prngs);
+	_mm_free(ptcache);
+	_mm_free(prcache[0]);
+	delete []pparent;
+	delete ptraversers;
+	delete pleaves;
+	delete phdda;
 }
 
+//(row,column) of each lane
 dint3 RenderKernel::vpattern[BLCLOUD_VSIZE] = {
+#if BLCLOUD_VSIZE == 16
+	dint3(0,0,0),dint3(0,1,0),dint3(0,2,0),dint3(0,3,0),
+	dint3(1,0,0),dint3(1,1,0),dint3(1,2,0),dint3(1,3,0),
+	dint3(2,0,0),dint3(2,1,0),dint3(2,2,0),dint3(2,3,0),
+	dint3(3,0,0),dint3(3,1,0),dint3(3,2,0),dint3(3,3,0)
+#elif BLCLOUD_VSIZE == 8
+	dint3(0,0,0),dint3(0,1,0),dint3(0,2,0),dint3(0,3,0),
+	dint3(1,0,0),dint3(1,1,0),dint3(1,2,0),dint3(1,3,0)
+#else
 	dint3(0,0,0),
 	dint3(0,1,0),
 	dint3(1,0,0),
 	dint3(1,1,0)
+#endif
 };
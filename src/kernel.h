@@ -2,18 +2,33 @@
 #define KERNEL_H
 
 #define KERNEL_DEPTHCOMP 0x1
+#define KERNEL_WAVEFRONT 0x2 //queue-based integrator instead of recursion
+#define KERNEL_SOBOL 0x4 //low-discrepancy sampler
+#define KERNEL_SUNCACHE 0x8 //light-space transmittance cache instead of the light rays
+#define KERNEL_OCTAVES 0x10 //approximate multiple scattering instead of the recursion
+#define KERNEL_HDDA 0x20 //secondary and light rays traverse the VDB-like leaf grid instead of the octree
+
+#define RADIANCE_CACHE_CHANNELS 6 //in-scattered light rgb, sky rgb
 
 namespace KernelSampler{
 class PhaseFunction;
 class BaseEnv;
 }
 
+namespace KernelOctree{
+class OctreeFullTraverser;
+class OctreeLeafArena;
+class OctreeHDDAGrid;
+}
+
 class RenderKernel{
 public:
 	RenderKernel();
 	~RenderKernel();
-	bool Initialize(const class Scene *, const class SceneOcclusion *, const dmatrix44 *, const dmatrix44 *, KernelSampler::PhaseFunction *, KernelSampler::BaseEnv *, float *, uint, float, float, uint, uint, uint, uint, uint);
+	bool Initialize(const class Scene *, const class SceneOcclusion *, const dmatrix44 *, const dmatrix44 *, KernelSampler::PhaseFunction *, KernelSampler::BaseEnv *, float *, uint, uint, uint, uint, uint, uint, float, float, float, uint, uint, uint, uint, uint);
 	void Render(uint, uint, uint, uint, uint);
+	void RenderPass(uint, uint, uint, uint, uint);
+	bool RenderWavefront(uint, uint, uint, uint, uint);
 	void Shadow(uint, uint, uint, uint, uint);
 	void Destroy();
 	//
@@ -23,8 +38,27 @@ public:
 		BUFFER_COUNT
 	};
 
-	dfloat4 *phb[BUFFER_COUNT]; //host buffer
+	enum PASS{
+		PASS_RENDER,
+		PASS_SHADOW
+	};
+
+	void BeginPass(uint, uint, uint, uint, PASS);
+	void Accumulate(uint, uint);
+
+	dfloat4 *phb[BUFFER_COUNT]; //host buffer (last pass)
+	double *pacc[BUFFER_COUNT]; //accumulated rgba of the current tile
+	double *pm2; //adaptive sampling: luminance second moment of the batch means (sum n*m^2) and the batch count
+	uint *pspp; //samples accumulated to each pixel
+	int *pactive; //pixel still receives samples (-1) or has converged (0)
+	dintN *prngs; //rng state of every packet in the tile, kept between the passes
+	tbb::enumerable_thread_specific<KernelOctree::OctreeFullTraverser> *ptraversers;
+	KernelOctree::OctreeLeafArena *pleaves; //primary leaf lists of the tile, kept between the passes
+	KernelOctree::OctreeHDDAGrid *phdda; //leaf grid of the secondary and light rays, 0 if they traverse the octree
 	float *pdepth; //source depth for compositing shadow calculations
+	float *ptcache; //baked transmittance toward each light, 0 if the light rays are traced
+	float *prcache[RADIANCE_CACHE_CHANNELS]; //in-scattered radiance at the corners of each leaf (OctreeNode::leaf), 0 if disabled
+	uint *pparent; //parent of each node, for restarting the secondary rays from the scattering leaf
 
 	const class Scene *pscene;
 	const class SceneOcclusion *psceneocc;
@@ -35,6 +69,8 @@ public:
 
 	KernelSampler::PhaseFunction *ppf;
 	KernelSampler::BaseEnv *penv;
+	KernelSampler::BaseEnv *penvs; //environment sampled explicitly at the scattering events, 0 if none
+	const class BaseSampler *psampler;
 
 	dmatrix44 viewi;
 	dmatrix44 proji;
@@ -44,14 +80,27 @@ public:
 #endif
 	//uint samples;
 	uint scattevs; //max number of scattering events
+	uint cachedepth; //scattering events before the paths are terminated with the radiance cache, 0 to disable
+	uint cachesamples; //max paths per radiance cache point
+	uint rrdepth; //scattering events before the russian roulette is played, 0 to disable
+	uint splits; //light samples and continuations traced from the first scattering event
+	uint octaves; //approximate multiple scattering octaves
 	float msigmas; //macroscopic scattering cross section
 	float msigmaa; //-- absorption
+	float sdfband; //sdf narrow band half width, i.e. min depth of the interior between the leaves
+	float threshold; //adaptive sampling relative error threshold, 0 to disable
 	//
 	uint w;
 	uint h;
 	//tile size (from last Render())
 	uint tilew;
 	uint tileh;
+	//tile being accumulated
+	uint accx;
+	uint accy;
+	PASS accpass;
+	uint samplec; //accumulated sample count (requested per pixel)
+	uint activec; //pixels not yet converged
 	//
 	uint flags;
 	//
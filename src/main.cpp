@@ -266,6 +266,10 @@ static PyObject * DRE_BeginRender(PyObject *pself, PyObject *pargs){
 	static char cachedir[256];
 	strncpy(cachedir,PyUnicode_AsUTF8(pycachedir),sizeof(cachedir));
 
+	PyObject *pytrav = PyObject_GetAttrString(pyperf,"traversal");
+	bool hdda = PyUnicode_AsUTF8(pytrav)[0] == 'H';
+	Py_DECREF(pytrav);
+
 	Py_DECREF(pycachedir);
 	Py_DECREF(pyperf);
 	/////
@@ -517,8 +521,14 @@ static PyObject * DRE_BeginRender(PyObject *pself, PyObject *pargs){
 
 	PyObject *pysampling = PyObject_GetAttrString(pscene,"blcloudsampling");
 	uint scattevs = PyGetUint(pysampling,"scatterevs");
+	uint cachedepth = PyGetUint(pysampling,"cachedepth");
+	uint cachesamples = PyGetUint(pysampling,"cachesamples");
+	uint rrdepth = PyGetUint(pysampling,"rrdepth");
+	uint splits = PyGetUint(pysampling,"splits");
+	uint octavec = PyGetUint(pysampling,"octaves");
 	float msigmas = PyGetFloat(pysampling,"msigmas");
 	float msigmaa = PyGetFloat(pysampling,"msigmaa");
+	float threshold = PyGetFloat(pysampling,"threshold");
 	PyObject *pypf = PyObject_GetAttrString(pysampling,"phasef");
 	const char *pypfs = PyUnicode_AsUTF8(pypf);
 	KernelSampler::PhaseFunction *ppf;
@@ -535,6 +545,14 @@ static PyObject * DRE_BeginRender(PyObject *pself, PyObject *pargs){
 		break;
 	}
 	Py_DECREF(pypf);
+	PyObject *pyintg = PyObject_GetAttrString(pysampling,"integrator");
+	bool wavefront = PyUnicode_AsUTF8(pyintg)[0] == 'W';
+	bool octaves = PyUnicode_AsUTF8(pyintg)[0] == 'O';
+	Py_DECREF(pyintg);
+	PyObject *pysmpl = PyObject_GetAttrString(pysampling,"sampler");
+	bool sobol = PyUnicode_AsUTF8(pysmpl)[0] == 'S';
+	Py_DECREF(pysmpl);
+	bool suncache = PyGetBool(pysampling,"suncache");
 	Py_DECREF(pysampling);
 
 	PyObject *pygrid = PyObject_GetAttrString(pscene,"blcloudgrid");
@@ -582,6 +600,9 @@ static PyObject * DRE_BeginRender(PyObject *pself, PyObject *pargs){
 				((float*)penvt)[px] = PyFloat_AsDouble(pni);
 			Py_DECREF(ppi);
 			Py_DECREF(ppixels);
+
+			if(!KernelSampler::MapEnv::genv.InitializeSampling())
+				DebugPrintf("Error: failed to allocate the environment sampling tables.\n");
 		}
 
 		Py_DECREF(pytex);
@@ -631,8 +652,8 @@ static PyObject * DRE_BeginRender(PyObject *pself, PyObject *pargs){
 
 		gpkernel = new RenderKernel();
 		gpkernel->Initialize(gpscene,gpsceneocc,
-			&sviewi,&sproji,ppf,penv,pdepth,scattevs,msigmas,msigmaa,tilex,tiley,w,h,
-			depthcomp?KERNEL_DEPTHCOMP:0);
+			&sviewi,&sproji,ppf,penv,pdepth,scattevs,cachedepth,cachesamples,rrdepth,splits,octavec,msigmas,msigmaa,threshold,tilex,tiley,w,h,
+			(depthcomp?KERNEL_DEPTHCOMP:0)|(wavefront?KERNEL_WAVEFRONT:0)|(sobol?KERNEL_SOBOL:0)|(suncache?KERNEL_SUNCACHE:0)|(octaves?KERNEL_OCTAVES:0)|(hdda?KERNEL_HDDA:0));
 
 		SceneData::SmokeCache::DeleteAll();
 		SceneData::ParticleSystem::DeleteAll();
@@ -733,18 +754,25 @@ static PyObject * DRE_QueryResult(PyObject *pself, PyObject *pargs){
 		DebugPrintf("Invalid arguments\n");
 		return 0;
 	}
-	dfloat4 **ppbuf = &gpkernel->phb[bindex];
+	const double *pbuf = gpkernel->pacc[bindex];
 
 	uint l = gpkernel->tilew*gpkernel->tileh;
 	PyObject *prt = PyList_New(l);
 	for(uint i = 0; i < l; ++i){
-		PyObject *pc = Py_BuildValue("[f,f,f,f]",(*ppbuf)[i].x,(*ppbuf)[i].y,(*ppbuf)[i].z,(*ppbuf)[i].w);
+		double fd = gpkernel->pspp[i] > 0?1.0/(double)gpkernel->pspp[i]:0.0; //average over all the accumulated samples
+		PyObject *pc = Py_BuildValue("[f,f,f,f]",pbuf[4*i+0]*fd,pbuf[4*i+1]*fd,pbuf[4*i+2]*fd,pbuf[4*i+3]*fd);
 		PyList_SET_ITEM(prt,i,pc);
 	}
 
 	return prt;
 }
 
+static PyObject * DRE_QuerySamples(PyObject *pself, PyObject *pargs){
+	if(!gpkernel)
+		return 0;
+	return Py_BuildValue("(I,I)",gpkernel->samplec,gpkernel->activec);
+}
+
 static PyMethodDef g_blmethods[] = {
 	{"BeginRender",DRE_BeginRender,METH_VARARGS,"Import the scene and configuration, construct the volumes."}, //CreateDevice
 	{"Render",DRE_Render,METH_VARARGS,"Render single tile with given rectangle and sample count."},
@@ -752,6 +780,7 @@ static PyMethodDef g_blmethods[] = {
 	{"EndRender",DRE_EndRender,METH_NOARGS,"Release the scene and render resource."},
 	{"QueryStatus",DRE_QueryStatus,METH_NOARGS,"Check scene construction status."},
 	{"QueryResult",DRE_QueryResult,METH_VARARGS,"Check tile render status."},
+	{"QuerySamples",DRE_QuerySamples,METH_NOARGS,"Get the number of samples accumulated to the current tile, and the number of pixels not yet converged."},
 	{0,0,0,0}
 };
 
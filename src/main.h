@@ -6,6 +6,8 @@ __attribute__ ((aligned(16)))
 #include <smmintrin.h> //SSE4
 #include <immintrin.h> //AVX2
 #include <math.h> //powf
+#define USE_SSE2
+#include "sse_mathfun.h"
 #include "smmath.inl"
 #include "SMMathPort.inl"
 
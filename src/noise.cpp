@@ -2,9 +2,6 @@
 #include "node.h"
 #include "noise.h"
 
-#define USE_SSE2
-#include "sse_mathfun.h"
-
 namespace PerlinNoise{
 
 static const dfloat3 g_perlin_data[512+2] = {
@@ -374,7 +371,7 @@ sfloat4 fhash(sfloat4 p){
 	};
 	sfloat4 v;
 	for(uint i = 0; i < 3; ++i){
-		v.v[i] = sin_ps(sfloat4::dot3(p,c[i]))*sfloat1(25.5e3f); //^^
+		v.v[i] = sfloat1::sin(sfloat4::dot3(p,c[i]))*sfloat1(25.5e3f); //^^
 		v.v[i] -= sfloat1::floor(v.v[i]);
 	}
 	v.v[3] = sfloat1::zero();
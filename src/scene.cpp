@@ -829,8 +829,9 @@ std::vector<Surface *> Surface::objs;
 
 #undef STRDUP
 
-Scene::Scene(){
-	//
+Scene::Scene() : pqgrid(0), pnodes(0), pleafdata(0), nodec(0), leafc(0){
+	for(uint i = 0; i < VOLUME_BUFFER_COUNT; ++i)
+		pvol[i] = 0;
 }
 
 Scene::~Scene(){
@@ -856,6 +857,7 @@ void Scene::Initialize(float s, uint maxd, float qb, uint smask, bool cache, con
 			psampler[i] = new FloatGridBoxSampler(*pgrid[i]); //non-cached, thread safe version
 			pvol[i] = new float[lvoxc3*leafx[i]];
 		}
+		pqgrid = new float[SCENE_QGRID3*ob.size()];
 	}catch(std::bad_alloc &ba){
 		DebugPrintf("FATAL: bad allocation: %s\n",ba.what());
 	}
@@ -904,20 +906,142 @@ void Scene::Initialize(float s, uint maxd, float qb, uint smask, bool cache, con
 					ob[i].qval[VOLUME_BUFFER_FOG] = openvdb::math::Max(ob[i].qval[VOLUME_BUFFER_FOG],pvol[VOLUME_BUFFER_FOG][ob[i].volx[VOLUME_BUFFER_FOG]*lvoxc3+j]);
 				}
 			}
+			//Sub-brick majorants. Each cell covers the samples the trilinear interpolation within it may use, so the
+			//neighbouring cells share the samples on their common faces.
+			for(uint j = 0; j < SCENE_QGRID3; ++j){
+				uint c[3] = {j%SCENE_QGRID,(j/SCENE_QGRID)%SCENE_QGRID,j/(SCENE_QGRID*SCENE_QGRID)};
+				uint a[3], b[3];
+				for(uint k = 0; k < 3; ++k){
+					a[k] = c[k]*(uN-1)/SCENE_QGRID;
+					b[k] = ((c[k]+1)*(uN-1)+SCENE_QGRID-1)/SCENE_QGRID;
+				}
+				float qm = 0.0f;
+				for(uint z = a[2]; z <= b[2]; ++z)
+					for(uint y = a[1]; y <= b[1]; ++y)
+						for(uint x = a[0]; x <= b[0]; ++x){
+							uint v = uN*(uN*z+y)+x;
+							if(ob[i].volx[VOLUME_BUFFER_SDF] != ~0u && pvol[VOLUME_BUFFER_SDF][ob[i].volx[VOLUME_BUFFER_SDF]*lvoxc3+v] <= 0.0f)
+								qm = 1.0f;
+							if(ob[i].volx[VOLUME_BUFFER_FOG] != ~0u)
+								qm = openvdb::math::Max(qm,pvol[VOLUME_BUFFER_FOG][ob[i].volx[VOLUME_BUFFER_FOG]*lvoxc3+v]);
+						}
+				pqgrid[SCENE_QGRID3*i+j] = qm;
+			}
 		}
 	});
 
 	for(uint i = 0; i < VOLUME_BUFFER_COUNT; ++i)
 		delete psampler[i];
 
+	FreezeOctree();
+
 	float msdf = (float)(leafx[VOLUME_BUFFER_SDF]*lvoxc3*sizeof(float))/1e6f;
 	float mfog = (float)(leafx[VOLUME_BUFFER_FOG]*lvoxc3*sizeof(float))/1e6f;
-	DebugPrintf("Volume size = %f MB\n  SDF = %f MB\n  Fog = %f MB\n",msdf+mfog,msdf,mfog);
+	float mqgrid = (float)(leafc*SCENE_QGRID3*sizeof(float))/1e6f;
+	float moctree = (float)(nodec*sizeof(OctreeNode)+leafc*sizeof(OctreeLeaf))/1e6f;
+	DebugPrintf("Volume size = %f MB\n  SDF = %f MB\n  Fog = %f MB\n  Majorants = %f MB\nOctree = %f MB (%u nodes, %u leaves)\n",msdf+mfog+mqgrid,msdf,mfog,mqgrid,moctree,nodec,leafc);
 	//
 }
 
+//Copy the octree into the frozen arrays. The children of each node are stored contiguously, and the sibling blocks
+//depth first, so that a subtree occupies a contiguous range after its root. The children are visited in the index
+//order, so the leaves and their bricks are renumbered in the Morton order of their positions, and the neighbouring
+//leaves are mostly neighbours in memory too. The leaf data and the sub-brick majorants are stored in the same order,
+//one per leaf, and the build time octree is released.
+void Scene::FreezeOctree(){
+	std::vector<uint> order; //build time index of each frozen node
+	order.reserve(ob.size());
+	order.push_back(0);
+	std::vector<uint> stack(1,0); //frozen nodes whose children are yet to be placed
+	std::vector<uint> bricks[VOLUME_BUFFER_COUNT]; //new index of each brick, ~0u if not referenced
+	uint brickc[VOLUME_BUFFER_COUNT] = {};
+	for(uint i = 0; i < VOLUME_BUFFER_COUNT; ++i)
+		bricks[i].assign(pvol[i]?leafx[i]:0,~0u);
+	leafc = 0;
+	for(uint i = 0; i < ob.size(); ++i)
+		if(ob[i].volx[VOLUME_BUFFER_SDF] != ~0u || ob[i].volx[VOLUME_BUFFER_FOG] != ~0u)
+			++leafc;
+	if(!(pnodes = (OctreeNode*)_mm_malloc(ob.size()*sizeof(OctreeNode),64)) || !(pleafdata = (OctreeLeaf*)_mm_malloc(std::max(leafc,1u)*sizeof(OctreeLeaf),64))){
+		DebugPrintf("FATAL: bad allocation: frozen octree\n");
+		return;
+	}
+	leafc = 0;
+	while(!stack.empty()){
+		uint i = stack.back();
+		stack.pop_back();
+		const OctreeStructure &n = ob[order[i]];
+		OctreeNode &m = pnodes[i];
+		m.ce = n.ce;
+		m.chn = order.size();
+		m.mask = 0;
+		m.pad = 0;
+		for(uint j = 0; j < 8; ++j)
+			if(n.chn[j] != 0){
+				m.mask |= 1u<<j;
+				order.push_back(n.chn[j]);
+			}
+		for(uint j = order.size(); j-- > m.chn;)
+			stack.push_back(j); //first child on top
+		if(m.mask == 0)
+			m.chn = 0;
+		if(n.volx[VOLUME_BUFFER_SDF] == ~0u && n.volx[VOLUME_BUFFER_FOG] == ~0u){
+			m.leaf = ~0u;
+			continue;
+		}
+		m.leaf = leafc++;
+		for(uint j = 0; j < VOLUME_BUFFER_COUNT; ++j){
+			uint x = n.volx[j];
+			if(x != ~0u && !bricks[j].empty()){
+				if(bricks[j][x] == ~0u)
+					bricks[j][x] = brickc[j]++;
+				x = bricks[j][x];
+			}
+			pleafdata[m.leaf].volx[j] = x;
+			pleafdata[m.leaf].qval[j] = n.qval[j];
+		}
+	}
+	nodec = order.size();
+
+	//Permute the bricks in place, following the cycles of the permutation. The unreferenced bricks (the fog removed
+	//inside the surface) are moved to the end and dropped from the count.
+	for(uint i = 0; i < VOLUME_BUFFER_COUNT; ++i){
+		if(bricks[i].empty())
+			continue;
+		uint c = brickc[i];
+		for(uint j = 0; j < bricks[i].size(); ++j)
+			if(bricks[i][j] == ~0u)
+				bricks[i][j] = c++;
+		for(uint j = 0; j < bricks[i].size(); ++j)
+			while(bricks[i][j] != j){
+				uint k = bricks[i][j];
+				std::swap_ranges(pvol[i]+lvoxc3*j,pvol[i]+lvoxc3*(j+1),pvol[i]+lvoxc3*k);
+				std::swap(bricks[i][j],bricks[i][k]);
+			}
+		leafx[i] = brickc[i];
+	}
+
+	if(pqgrid){
+		try{
+			float *pqgrid1 = new float[SCENE_QGRID3*leafc];
+			for(uint i = 0; i < nodec; ++i)
+				if(pnodes[i].leaf != ~0u)
+					memcpy(pqgrid1+SCENE_QGRID3*pnodes[i].leaf,pqgrid+SCENE_QGRID3*order[i],SCENE_QGRID3*sizeof(float));
+			delete []pqgrid;
+			pqgrid = pqgrid1;
+		}catch(std::bad_alloc &ba){
+			DebugPrintf("FATAL: bad allocation: %s\n",ba.what());
+		}
+	}
+
+	ob.clear();
+	ob.shrink_to_fit();
+}
+
 void Scene::Destroy(){
 	for(uint i = 0; i < VOLUME_BUFFER_COUNT; ++i)
 		delete []pvol[i];
+	delete []pqgrid;
+	_mm_free(pnodes);
+	_mm_free(pleafdata);
 	ob.clear();
 }
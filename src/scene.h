@@ -18,6 +18,9 @@ public:
 	dfloat3 se;
 };
 
+#define SCENE_QGRID 4 //majorant grid cells per leaf axis
+#define SCENE_QGRID3 (SCENE_QGRID*SCENE_QGRID*SCENE_QGRID)
+
 class OctreeStructure{
 public:
 	OctreeStructure();
@@ -30,6 +33,27 @@ public:
 	float qval[VOLUME_BUFFER_COUNT];
 };
 
+//Octree frozen for rendering, in a plain aligned array. The present children of each node are contiguous, so that
+//only the first child and the child mask are stored. The leaf data is kept separately (OctreeLeaf), so that the
+//traversal touches only the 32 byte nodes.
+class OctreeNode{
+public:
+	dfloat4 ce; //(center.xyz,extent)
+	uint chn; //first child
+	uint mask; //present children
+	uint leaf; //leaf data index, ~0u if not a leaf
+	uint pad;
+	inline uint Child(uint i) const{
+		return mask&(1u<<i)?chn+__builtin_popcount(mask&((1u<<i)-1)):0; //0 if not present, as in OctreeStructure
+	}
+};
+
+class OctreeLeaf{
+public:
+	uint volx[VOLUME_BUFFER_COUNT]; //leaf volume index
+	float qval[VOLUME_BUFFER_COUNT]; //as in OctreeStructure
+};
+
 class Octree{
 public:
 	Octree(uint);
@@ -148,14 +172,20 @@ public:
 	Scene();
 	~Scene();
 	void Initialize(float, uint, float, uint, bool, const char *);
+	void FreezeOctree();
 	void Destroy();
 	float *pvol[VOLUME_BUFFER_COUNT];
+	float *pqgrid; //majorant extinction density of the sub-bricks, SCENE_QGRID3 per leaf: 1 where the surface may be, otherwise the max fog
 	uint lvoxc;
 	uint index;
 	uint leafx[VOLUME_BUFFER_COUNT];
 	uint lvoxc3;
 	tbb::concurrent_vector<Octree> root;
-	tbb::concurrent_vector<OctreeStructure> ob;
+	tbb::concurrent_vector<OctreeStructure> ob; //build time octree, emptied by FreezeOctree()
+	OctreeNode *pnodes; //frozen octree
+	OctreeLeaf *pleafdata;
+	uint nodec;
+	uint leafc;
 };
 
 #endif
@@ -1,9 +1,39 @@
 #ifndef SMMATH_INL
 #define SMMATH_INL
 
+//Packet width follows the instruction set unless explicitly overridden (-DBLCLOUD_VSIZE=4 etc.)
+#ifndef BLCLOUD_VSIZE
+#if defined(USE_AVX512)
+#define BLCLOUD_VSIZE 16 //512-bit vectors
+#elif defined(USE_AVX2)
+#define BLCLOUD_VSIZE 8 //256-bit vectors
+#else
 #define BLCLOUD_VSIZE 4 //128-bit vectors
+#endif
+#endif
+
+//Pixel pattern of a single packet (BLCLOUD_VX*BLCLOUD_VY = BLCLOUD_VSIZE)
+#if BLCLOUD_VSIZE == 16
+#ifndef USE_AVX512
+#error "16-wide packets require USE_AVX512"
+#endif
+#define BLCLOUD_VX 4
+#define BLCLOUD_VY 4
+#elif BLCLOUD_VSIZE == 8
+#ifndef USE_AVX2
+#error "8-wide packets require USE_AVX2"
+#endif
+#define BLCLOUD_VX 4
+#define BLCLOUD_VY 2
+#elif BLCLOUD_VSIZE == 4
 #define BLCLOUD_VX 2
 #define BLCLOUD_VY 2
+#else
+#error "BLCLOUD_VSIZE must be 4, 8 or 16"
+#endif
+
+#define BLCLOUD_VALIGN (4*BLCLOUD_VSIZE) //packet alignment in bytes
+#define BLCLOUD_VMASK ((1<<BLCLOUD_VSIZE)-1) //movemask of a full packet
 
 #ifdef USE_AVX2
 #define FL_PERMUTE(v,c) _mm_permute_ps(v,c)
@@ -13,6 +43,33 @@
 #define IL_PERMUTE(v,c) _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(v),_mm_castsi128_ps(v),c))//_mm_shuffle_epi32(v,c)
 #endif
 
+//Raw packet types and the intrinsics shared by all widths
+#if BLCLOUD_VSIZE == 16
+typedef __m512 vfloatN;
+typedef __m512i vintN;
+#define VL_PS(f) _mm512_##f##_ps
+#define VL_EPI32(f) _mm512_##f##_epi32
+#define VL_SI(f) _mm512_##f##_si512
+#define VL_CASTPS_SI(v) _mm512_castps_si512(v)
+#define VL_CASTSI_PS(v) _mm512_castsi512_ps(v)
+#elif BLCLOUD_VSIZE == 8
+typedef __m256 vfloatN;
+typedef __m256i vintN;
+#define VL_PS(f) _mm256_##f##_ps
+#define VL_EPI32(f) _mm256_##f##_epi32
+#define VL_SI(f) _mm256_##f##_si256
+#define VL_CASTPS_SI(v) _mm256_castps_si256(v)
+#define VL_CASTSI_PS(v) _mm256_castsi256_ps(v)
+#else
+typedef __m128 vfloatN;
+typedef __m128i vintN;
+#define VL_PS(f) _mm_##f##_ps
+#define VL_EPI32(f) _mm_##f##_epi32
+#define VL_SI(f) _mm_##f##_si128
+#define VL_CASTPS_SI(v) _mm_castps_si128(v)
+#define VL_CASTSI_PS(v) _mm_castsi128_ps(v)
+#endif
+
 #define SM_PI 3.14159265358979f
 #define SM_LN2 0.69315f
 
@@ -28,7 +85,7 @@ public:
 	}
 
 	float v[BLCLOUD_VSIZE];
-} __attribute__((aligned(16)));
+} __attribute__((aligned(BLCLOUD_VALIGN)));
 
 class dfloat3{
 public:
@@ -108,7 +165,7 @@ public:
 	}
 
 	int v[BLCLOUD_VSIZE];
-} __attribute__((aligned(16)));
+} __attribute__((aligned(BLCLOUD_VALIGN)));
 
 class dint3{
 public:
@@ -137,7 +194,7 @@ public:
 	}
 
 	uint v[BLCLOUD_VSIZE];
-} __attribute__((aligned(16)));
+} __attribute__((aligned(BLCLOUD_VALIGN)));
 
 class duint3{
 public:
@@ -166,14 +223,16 @@ public:
 	}
 
 	sfloat1(float a){
-		v = _mm_set1_ps(a);
+		v = VL_PS(set1)(a);
 	}
 
+#if BLCLOUD_VSIZE == 4
 	sfloat1(float x, float y, float z, float w){
 		v = _mm_set_ps(w,z,y,x);
 	}
+#endif
 
-	sfloat1(const __m128 &_v){
+	sfloat1(const vfloatN &_v){
 		v = _v;
 	}
 
@@ -183,65 +242,65 @@ public:
 
 	sfloat1(const sint1 &s);
 
-	inline operator __m128() const{
+	inline operator vfloatN() const{
 		return v;
 	}
 
 	inline sfloat1 operator+(const sfloat1 &s) const{
-		return _mm_add_ps(v,s.v);
+		return VL_PS(add)(v,s.v);
 	}
 
 	inline void operator+=(const sfloat1 &s){
-		v = _mm_add_ps(v,s.v);
+		v = VL_PS(add)(v,s.v);
 	}
 
 	inline sfloat1 operator-() const{
-		return _mm_sub_ps(_mm_setzero_ps(),v);
+		return VL_PS(sub)(VL_PS(setzero)(),v);
 	}
 
 	inline sfloat1 operator-(const sfloat1 &s) const{
-		return _mm_sub_ps(v,s.v);
+		return VL_PS(sub)(v,s.v);
 	}
 
 	inline void operator-=(const sfloat1 &s){
-		v = _mm_sub_ps(v,s.v);
+		v = VL_PS(sub)(v,s.v);
 	}
 
 	inline sfloat1 operator*(const sfloat1 &s) const{
-		return _mm_mul_ps(v,s.v);
+		return VL_PS(mul)(v,s.v);
 	}
 
 	inline void operator*=(const sfloat1 &s){
-		v = _mm_mul_ps(v,s.v);
+		v = VL_PS(mul)(v,s.v);
 	}
 
 	inline sfloat1 operator/(const sfloat1 &s) const{
-		return _mm_div_ps(v,s.v);
+		return VL_PS(div)(v,s.v);
 	}
 
 	inline void operator/=(const sfloat1 &s){
-		v = _mm_div_ps(v,s.v);
+		v = VL_PS(div)(v,s.v);
 	}
 
 	inline sfloat1 operator+(float s) const{
-		return _mm_add_ps(v,_mm_set1_ps(s));
+		return VL_PS(add)(v,VL_PS(set1)(s));
 	}
 
 	inline sfloat1 operator-(float s) const{
-		return _mm_sub_ps(v,_mm_set1_ps(s));
+		return VL_PS(sub)(v,VL_PS(set1)(s));
 	}
 
 	inline sfloat1 operator*(float s) const{
-		return _mm_mul_ps(v,_mm_set1_ps(s));
+		return VL_PS(mul)(v,VL_PS(set1)(s));
 	}
 
 	inline sfloat1 operator/(float s) const{
-		return _mm_div_ps(v,_mm_set1_ps(s));
+		return VL_PS(div)(v,VL_PS(set1)(s));
 	}
 
 	inline sfloat1 madd(const sfloat1 &b, const sfloat1 &c) const{
 #ifdef USE_AVX2
-		return _mm_fmadd_ps(v,b.v,c.v);
+		return VL_PS(fmadd)(v,b.v,c.v);
 #else
 		return v*b.v+c.v;
 #endif
@@ -249,7 +308,7 @@ public:
 
 	inline sfloat1 msub(const sfloat1 &b, const sfloat1 &c) const{
 #ifdef USE_AVX2
-		return _mm_fmsub_ps(v,b.v,c.v);
+		return VL_PS(fmsub)(v,b.v,c.v);
 #else
 		return v*b.v-c.v;
 #endif
@@ -257,16 +316,30 @@ public:
 
 	template<uint x>
 	inline float get() const{
+#if BLCLOUD_VSIZE == 4
 		__m128 t = FL_PERMUTE(v,_MM_SHUFFLE(x,x,x,x));
 		return _mm_cvtss_f32(t);
+#else
+		return ((const float*)&v)[x];
+#endif
+	}
+
+	inline float get(uint x) const{
+		return ((const float*)&v)[x];
 	}
 
 	/*inline float4 get4() const{ //TODO: incomplete type
 		return float4(v);
 	}*/
 
-	inline __m128 get4() const{
+	inline __m128 get4() const{ //first four lanes
+#if BLCLOUD_VSIZE == 16
+		return _mm512_castps512_ps128(v);
+#elif BLCLOUD_VSIZE == 8
+		return _mm256_castps256_ps128(v);
+#else
 		return v;
+#endif
 	}
 
 	/*template<>
@@ -274,6 +347,7 @@ public:
 		return _mm_cvtss_f32(v);
 	}*/
 
+#if BLCLOUD_VSIZE == 4
 	template<uint x>
 	inline __m128 splat4() const{
 		return FL_PERMUTE(v,_MM_SHUFFLE(x,x,x,x));
@@ -307,58 +381,69 @@ public:
 		pdst[3] = psrc[d];
 		return r;
 	}
+#endif
+
+	inline int MoveMask() const{
+#if BLCLOUD_VSIZE == 16
+		return _mm512_cmplt_epi32_mask(_mm512_castps_si512(v),_mm512_setzero_si512());
+#else
+		return VL_PS(movemask)(v);
+#endif
+	}
 
 	inline bool AllTrue() const{
-		return _mm_movemask_ps(v) == 0b1111;
+		return MoveMask() == BLCLOUD_VMASK;
 	}
 
 	inline bool AllFalse() const{
-		return _mm_movemask_ps(v) == 0;
+		return MoveMask() == 0;
 	}
 
 	inline bool AnyTrue() const{
-		return _mm_movemask_ps(v) > 0;
+		return MoveMask() != 0;
 	}
 
 	inline bool AnyFalse() const{
-		return _mm_movemask_ps(v) != 0b1111;
+		return MoveMask() != BLCLOUD_VMASK;
 	}
 
 	//------------------------------------------------------------------------------
 	//Arithmetic operations and dual input functions are defined as static members
 
 	static inline sfloat1 zero(){
-		return _mm_setzero_ps();
+		return VL_PS(setzero)();
 	}
 
 	static inline sfloat1 one(){
-		return _mm_set1_ps(1.0f);
+		return VL_PS(set1)(1.0f);
 	}
 
 	static inline sfloat1 select(const sfloat1 &a, const sfloat1 &b, const sfloat1 &c){
-		__m128 t1 = _mm_andnot_ps(c.v,a.v);
-		__m128 t2 = _mm_and_ps(c.v,b.v);
-		return _mm_or_ps(t1,t2);
+		return sfloat1::Or(sfloat1::AndNot(c,a),sfloat1::And(c,b));
 	}
 
 	static inline sfloat1 min(const sfloat1 &a, const sfloat1 &b){
-		return _mm_min_ps(a.v,b.v);
+		return VL_PS(min)(a.v,b.v);
 	}
 
 	static inline sfloat1 max(const sfloat1 &a, const sfloat1 &b){
-		return _mm_max_ps(a.v,b.v);
+		return VL_PS(max)(a.v,b.v);
 	}
 
 	static inline sfloat1 saturate(const sfloat1 &s){
-		return _mm_max_ps(_mm_min_ps(s.v,_mm_set1_ps(1.0f)),_mm_set1_ps(0.0f));
+		return VL_PS(max)(VL_PS(min)(s.v,VL_PS(set1)(1.0f)),VL_PS(set1)(0.0f));
 	}
 
 	static inline sfloat1 saturate2(const sfloat1 &s){
-		return _mm_max_ps(_mm_min_ps(s.v,_mm_set1_ps(1.0f)),_mm_set1_ps(-1.0f));
+		return VL_PS(max)(VL_PS(min)(s.v,VL_PS(set1)(1.0f)),VL_PS(set1)(-1.0f));
 	}
 
 	static inline sfloat1 floor(const sfloat1 &s){
-#ifdef USE_SSE4
+#if BLCLOUD_VSIZE == 16
+		return _mm512_roundscale_ps(s.v,_MM_FROUND_TO_NEG_INF|_MM_FROUND_NO_EXC);
+#elif BLCLOUD_VSIZE == 8
+		return _mm256_floor_ps(s.v);
+#elif defined(USE_SSE4)
 		return _mm_floor_ps(s.v);
 #else
 		//TODO: fix
@@ -375,7 +460,11 @@ public:
 	}
 
 	static inline sfloat1 ceil(const sfloat1 &s){
-#ifdef USE_SSE4
+#if BLCLOUD_VSIZE == 16
+		return _mm512_roundscale_ps(s.v,_MM_FROUND_TO_POS_INF|_MM_FROUND_NO_EXC);
+#elif BLCLOUD_VSIZE == 8
+		return _mm256_ceil_ps(s.v);
+#elif defined(USE_SSE4)
 		return _mm_ceil_ps(s.v);
 #else
 		sfloat1 r;
@@ -395,20 +484,39 @@ public:
 	}
 
 	static inline sfloat1 sqrt(const sfloat1 &s){
-		return _mm_sqrt_ps(s.v);
+		return VL_PS(sqrt)(s.v);
 	}
 
 	static inline sfloat1 pow(const sfloat1 &s, const sfloat1 &p){
-		__attribute__((aligned(16))) float a[4];
-		__attribute__((aligned(16))) float b[4];
-		_mm_store_ps(a,s.v);
-		_mm_store_ps(b,p.v);
-		sfloat1 r = sfloat1(
-			powf(a[0],b[0]),
-			powf(a[1],b[1]),
-			powf(a[2],b[2]),
-			powf(a[3],b[3]));
-		return r;
+		__attribute__((aligned(BLCLOUD_VALIGN))) float a[BLCLOUD_VSIZE];
+		__attribute__((aligned(BLCLOUD_VALIGN))) float b[BLCLOUD_VSIZE];
+		VL_PS(store)(a,s.v);
+		VL_PS(store)(b,p.v);
+		for(uint i = 0; i < BLCLOUD_VSIZE; ++i)
+			a[i] = powf(a[i],b[i]);
+		return VL_PS(load)(a);
+	}
+
+	//sse_mathfun transcendentals, evaluated in 128-bit parts for the wider packets
+#define SM_MATHFUN(f)\
+	static inline sfloat1 f(const sfloat1 &s){\
+		union{vfloatN v; __m128 q[BLCLOUD_VSIZE/4];} a = {s.v};\
+		for(uint i = 0; i < BLCLOUD_VSIZE/4; ++i)\
+			a.q[i] = f##_ps(a.q[i]);\
+		return a.v;\
+	}
+	SM_MATHFUN(log)
+	SM_MATHFUN(exp)
+	SM_MATHFUN(sin)
+	SM_MATHFUN(cos)
+#undef SM_MATHFUN
+
+	static inline void sincos(const sfloat1 &s, sfloat1 *ps, sfloat1 *pc){
+		union{vfloatN v; __m128 q[BLCLOUD_VSIZE/4];} a = {s.v}, rs, rc;
+		for(uint i = 0; i < BLCLOUD_VSIZE/4; ++i)
+			sincos_ps(a.q[i],&rs.q[i],&rc.q[i]);
+		ps->v = rs.v;
+		pc->v = rc.v;
 	}
 
 	static inline sfloat1 acos(const sfloat1 &s){
@@ -446,85 +554,127 @@ public:
 
 	static inline sfloat1 abs(const sfloat1 &s){
 		sfloat1 r;
-		r.v = _mm_setzero_ps();
-		r.v = _mm_sub_ps(r.v,s.v);
-		r.v = _mm_max_ps(r.v,s.v);
+		r.v = VL_PS(setzero)();
+		r.v = VL_PS(sub)(r.v,s.v);
+		r.v = VL_PS(max)(r.v,s.v);
 		return r;
 	}
 
+#if BLCLOUD_VSIZE == 16
+#define SM_CMP(a,b,c) _mm512_castsi512_ps(_mm512_maskz_set1_epi32(_mm512_cmp_ps_mask(a,b,c),-1))
+#elif BLCLOUD_VSIZE == 8
+#define SM_CMP(a,b,c) _mm256_cmp_ps(a,b,c)
+#endif
+
 	static inline sfloat1 Equal(const sfloat1 &a, const sfloat1 &b){
+#if BLCLOUD_VSIZE > 4
+		return SM_CMP(a.v,b.v,_CMP_EQ_OQ);
+#else
 		return _mm_cmpeq_ps(a.v,b.v);
+#endif
 	}
 
 	static inline sfloat1 Greater(const sfloat1 &a, const sfloat1 &b){
+#if BLCLOUD_VSIZE > 4
+		return SM_CMP(a.v,b.v,_CMP_GT_OS);
+#else
 		return _mm_cmpgt_ps(a.v,b.v);
+#endif
 	}
 
 	static inline sfloat1 GreaterOrEqual(const sfloat1 &a, const sfloat1 &b){
+#if BLCLOUD_VSIZE > 4
+		return SM_CMP(a.v,b.v,_CMP_GE_OS);
+#else
 		return _mm_cmpge_ps(a.v,b.v);
+#endif
 	}
 
 	static inline sfloat1 Less(const sfloat1 &a, const sfloat1 &b){
+#if BLCLOUD_VSIZE > 4
+		return SM_CMP(a.v,b.v,_CMP_LT_OS);
+#else
 		return _mm_cmplt_ps(a.v,b.v);
+#endif
 	}
 
 	static inline sfloat1 LessOrEqual(const sfloat1 &a, const sfloat1 &b){
+#if BLCLOUD_VSIZE > 4
+		return SM_CMP(a.v,b.v,_CMP_LE_OS);
+#else
 		return _mm_cmple_ps(a.v,b.v);
+#endif
 	}
 
+#undef SM_CMP
+
 	static inline sfloat1 And(const sfloat1 &a, const sfloat1 &b){
-		return _mm_and_ps(a.v,b.v);
+#if BLCLOUD_VSIZE == 16
+		return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(a.v),_mm512_castps_si512(b.v)));
+#else
+		return VL_PS(and)(a.v,b.v);
+#endif
 	}
 
 	static inline sfloat1 AndNot(const sfloat1 &a, const sfloat1 &b){
-		return _mm_andnot_ps(a.v,b.v);
+#if BLCLOUD_VSIZE == 16
+		return _mm512_castsi512_ps(_mm512_andnot_si512(_mm512_castps_si512(a.v),_mm512_castps_si512(b.v)));
+#else
+		return VL_PS(andnot)(a.v,b.v);
+#endif
 	}
 
 	static inline sfloat1 Or(const sfloat1 &a, const sfloat1 &b){
-		return _mm_or_ps(a.v,b.v);
+#if BLCLOUD_VSIZE == 16
+		return _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(a.v),_mm512_castps_si512(b.v)));
+#else
+		return VL_PS(or)(a.v,b.v);
+#endif
 	}
 
 	static inline void store(float *pdst, const sfloat1 &s){
-		_mm_store_ps(pdst,s.v);
+		VL_PS(store)(pdst,s.v);
 	}
 
 	static inline sfloat1 load(const float *psrc){
-		return _mm_load_ps(psrc);
+		return VL_PS(load)(psrc);
 	}
 
 	static inline void store(dfloatN *pdst, const sfloat1 &s){
-		_mm_store_ps(pdst->v,s.v);
+		VL_PS(store)(pdst->v,s.v);
 	}
 
 	static inline sfloat1 load(const dfloatN *psrc){
-		return _mm_load_ps(psrc->v);
+		return VL_PS(load)(psrc->v);
 	}
 
-	__m128 v;
+	static inline sfloat1 gather(const float *pbase, const sint1 &idx, const sfloat1 &m); //pbase[idx] where m, zero elsewhere
+
+	vfloatN v;
 };
 
-inline __m128 operator*(const __m128 &a, const sfloat1 &b){
-	return _mm_mul_ps(a,b.v);
+inline vfloatN operator*(const vfloatN &a, const sfloat1 &b){
+	return VL_PS(mul)(a,b.v);
 }
 
-inline __m128 operator/(const __m128 &a, const sfloat1 &b){
-	return _mm_div_ps(a,b.v);
+inline vfloatN operator/(const vfloatN &a, const sfloat1 &b){
+	return VL_PS(div)(a,b.v);
 }
 
 inline sfloat1 operator+(float a, const sfloat1 &b){
-	return _mm_add_ps(_mm_set1_ps(a),b.v);
+	return VL_PS(add)(VL_PS(set1)(a),b.v);
 }
 
 inline sfloat1 operator-(float a, const sfloat1 &b){
-	return _mm_sub_ps(_mm_set1_ps(a),b.v);
+	return VL_PS(sub)(VL_PS(set1)(a),b.v);
 }
 
 inline sfloat1 operator*(float a, const sfloat1 &b){
-	return _mm_mul_ps(_mm_set1_ps(a),b.v);
+	return VL_PS(mul)(VL_PS(set1)(a),b.v);
 }
 
 inline sfloat1 operator/(float a, const sfloat1 &b){
-	return _mm_div_ps(_mm_set1_ps(a),b.v);
+	return VL_PS(div)(VL_PS(set1)(a),b.v);
 }
 
 inline dfloatN::dfloatN(const sfloat1 &s){
@@ -640,7 +790,13 @@ public:
 
 	template<uint x>
 	inline sfloat1 splatN() const{
+#if BLCLOUD_VSIZE == 16
+		return _mm512_broadcastss_ps(FL_PERMUTE(v,_MM_SHUFFLE(x,x,x,x)));
+#elif BLCLOUD_VSIZE == 8
+		return _mm256_broadcastss_ps(FL_PERMUTE(v,_MM_SHUFFLE(x,x,x,x)));
+#else
 		return FL_PERMUTE(v,_MM_SHUFFLE(x,x,x,x));
+#endif
 	}
 
 	/*inline float4 splat(uint x) const{
@@ -907,13 +1063,17 @@ public:
 
 	sfloat4(const float4 &n){
 		//replicate
-		v[0].v = FL_PERMUTE(n.v,_MM_SHUFFLE(0,0,0,0));
-		v[1].v = FL_PERMUTE(n.v,_MM_SHUFFLE(1,1,1,1));
-		v[2].v = FL_PERMUTE(n.v,_MM_SHUFFLE(2,2,2,2));
-		v[3].v = FL_PERMUTE(n.v,_MM_SHUFFLE(3,3,3,3));
+		v[0] = n.splatN<0>();
+		v[1] = n.splatN<1>();
+		v[2] = n.splatN<2>();
+		v[3] = n.splatN<3>();
 	}
 
 	sfloat4(const float4 &a, const float4 &b, const float4 &c, const float4 &d){
+#if BLCLOUD_VSIZE > 4
+		for(uint i = 0; i < 4; ++i)
+			v[i] = sfloat1::zero(); //remaining lanes
+#endif
 		set(0,a);
 		set(1,b);
 		set(2,c);
@@ -1064,19 +1224,33 @@ public:
 
 	template<uint x>
 	inline float4 get() const{
+#if BLCLOUD_VSIZE > 4
+		return float4(v[0].get<x>(),v[1].get<x>(),v[2].get<x>(),v[3].get<x>());
+#else
 		return float4::select(
 			float4::select(sfloat1::splat4<x>(v[0]),sfloat1::splat4<x>(v[1]),float4::selectctrl(0,1,0,1)),
 			float4::select(sfloat1::splat4<x>(v[2]),sfloat1::splat4<x>(v[3]),float4::selectctrl(0,1,0,1)),float4::selectctrl(0,0,1,1));
+#endif
 	}
 
 	inline float4 get(uint x) const{
+#if BLCLOUD_VSIZE > 4
+		return float4(v[0].get(x),v[1].get(x),v[2].get(x),v[3].get(x));
+#else
 		return float4::select(
 			float4::select(v[0].splat4(x),v[1].splat4(x),float4::selectctrl(0,1,0,1)),
 			float4::select(v[2].splat4(x),v[3].splat4(x),float4::selectctrl(0,1,0,1)),float4::selectctrl(0,0,1,1));
+#endif
 	}
 
 	inline void set(uint x, const float4 &s){
+#if BLCLOUD_VSIZE == 16
+		sfloat1 c = _mm512_castsi512_ps(_mm512_maskz_set1_epi32((__mmask16)(1<<x),-1));
+#elif BLCLOUD_VSIZE == 8
+		sfloat1 c = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_set1_epi32(x),_mm256_set_epi32(7,6,5,4,3,2,1,0)));
+#else
 		sfloat1 c = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_set1_epi32(x),_mm_set_epi32(3,2,1,0)));
+#endif
 		v[0] = sfloat1::select(v[0],s.splatN<0>().v,c);
 		v[1] = sfloat1::select(v[1],s.splatN<1>().v,c);
 		v[2] = sfloat1::select(v[2],s.splatN<2>().v,c);
@@ -1115,8 +1289,8 @@ public:
 
 	static inline sfloat1 dot3(const sfloat4 &a, const sfloat4 &b){
 #ifdef USE_AVX2
-		return _mm_fmadd_ps(a.v[0],b.v[0],
-			_mm_fmadd_ps(a.v[1],b.v[1],a.v[2]*b.v[2]));
+		return VL_PS(fmadd)(a.v[0],b.v[0],
+			VL_PS(fmadd)(a.v[1],b.v[1],a.v[2]*b.v[2]));
 #else
 		return a.v[0]*b.v[0]+a.v[1]*b.v[1]+a.v[2]*b.v[2];
 #endif
@@ -1124,9 +1298,9 @@ public:
 
 	static inline sfloat1 dot4(const sfloat4 &a, const sfloat4 &b){
 #ifdef USE_AVX2
-		return _mm_fmadd_ps(a.v[0],b.v[0],
-			_mm_fmadd_ps(a.v[1],b.v[1],
-			_mm_fmadd_ps(a.v[2],b.v[2],a.v[3]*b.v[3])));
+		return VL_PS(fmadd)(a.v[0],b.v[0],
+			VL_PS(fmadd)(a.v[1],b.v[1],
+			VL_PS(fmadd)(a.v[2],b.v[2],a.v[3]*b.v[3])));
 #else
 		return a.v[0]*b.v[0]+a.v[1]*b.v[1]+a.v[2]*b.v[2]+a.v[3]*b.v[3];
 #endif
@@ -1180,16 +1354,18 @@ public:
 	}
 
 	sint1(int a){
-		v = _mm_set1_epi32(a);
+		v = VL_EPI32(set1)(a);
 	}
 
+#if BLCLOUD_VSIZE == 4
 	sint1(int x, int y, int z, int w){
 		v = _mm_set_epi32(w,z,y,x);
 	}
+#endif
 
 	sint1(const sfloat1 &s);
 
-	sint1(const __m128i &_v){
+	sint1(const vintN &_v){
 		v = _v;
 	}
 
@@ -1197,94 +1373,159 @@ public:
 		//
 	}
 
-	inline operator __m128i() const{
+	inline operator vintN() const{
 		return v;
 	}
 
 	static inline sint1 convert(const sfloat1 &s){
-		return _mm_cvttps_epi32(s.v);
+		return VL_EPI32(cvttps)(s.v);
 	}
 
 	inline sint1 operator+(const sint1 &s) const{
-		return _mm_add_epi32(v,s.v);
+		return VL_EPI32(add)(v,s.v);
 	}
 
 	inline void operator+=(const sint1 &s){
-		v = _mm_add_epi32(v,s.v);
+		v = VL_EPI32(add)(v,s.v);
 	}
 
 	inline sint1 operator-() const{
-		return _mm_sub_epi32(_mm_setzero_si128(),v);
+		return VL_EPI32(sub)(VL_SI(setzero)(),v);
 	}
 
 	inline sint1 operator-(const sint1 &s) const{
-		return _mm_sub_epi32(v,s.v);
+		return VL_EPI32(sub)(v,s.v);
 	}
 
 	inline void operator-=(const sint1 &s){
-		v = _mm_sub_epi32(v,s.v);
+		v = VL_EPI32(sub)(v,s.v);
+	}
+
+	inline sint1 operator*(const sint1 &s) const{ //low 32 bits
+#if BLCLOUD_VSIZE > 4 || defined(USE_SSE4)
+		return VL_EPI32(mullo)(v,s.v);
+#else
+		__m128i t1 = _mm_mul_epu32(v,s.v);
+		__m128i t2 = _mm_mul_epu32(_mm_srli_si128(v,4),_mm_srli_si128(s.v,4));
+		return _mm_unpacklo_epi32(_mm_shuffle_epi32(t1,_MM_SHUFFLE(0,0,2,0)),_mm_shuffle_epi32(t2,_MM_SHUFFLE(0,0,2,0)));
+#endif
+	}
+
+	template<uint x>
+	inline int get() const{
+		return ((const int*)&v)[x];
+	}
+
+	inline int get(uint x) const{
+		return ((const int*)&v)[x];
+	}
+
+	template<uint s>
+	inline sint1 ShiftLeft() const{
+		return VL_EPI32(slli)(v,s);
+	}
+
+	template<uint s>
+	inline sint1 ShiftRight() const{ //logical
+		return VL_EPI32(srli)(v,s);
+	}
+
+	static inline sint1 index(){ //(0,1,2,...,N-1)
+#if BLCLOUD_VSIZE == 16
+		return _mm512_set_epi32(15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0);
+#elif BLCLOUD_VSIZE == 8
+		return _mm256_set_epi32(7,6,5,4,3,2,1,0);
+#else
+		return _mm_set_epi32(3,2,1,0);
+#endif
 	}
 
 	static inline sint1 mask(int m){
+#if BLCLOUD_VSIZE > 4
+		sint1 q = VL_EPI32(sllv)(VL_EPI32(set1)(1),index().v);
+		return sint1::Greater(sint1::And(sint1(m),q),sint1(0));
+#else
 		__m128i m1 = _mm_set1_epi32(m);
-		__m128i v1 = _mm_set1_epi32(1);
-		__m128i q = _mm_sll_epi32(v1,_mm_set_epi32(3,2,1,0));
+		__m128i q = _mm_set_epi32(8,4,2,1); //_mm_sll_epi32 shifts every lane by the same count
 		return _mm_cmpgt_epi32(_mm_and_si128(m1,q),_mm_setzero_si128());
+#endif
 	}
 
 	static inline sint1 falseI(){
-		return _mm_setzero_si128();
+		return VL_SI(setzero)();
 	}
 
 	static inline sint1 trueI(){
-		return _mm_set1_epi32(-1);
+		return VL_EPI32(set1)(-1);
 	}
 
+#if BLCLOUD_VSIZE == 16
+#define SM_CMP(m) _mm512_maskz_set1_epi32(m,-1)
+
 	static inline sint1 Equal(const sint1 &a, const sint1 &b){
-		return _mm_cmpeq_epi32(a.v,b.v);
+		return SM_CMP(_mm512_cmpeq_epi32_mask(a.v,b.v));
 	}
 
 	static inline sint1 Greater(const sint1 &a, const sint1 &b){
-		return _mm_cmpgt_epi32(a.v,b.v);
+		return SM_CMP(_mm512_cmpgt_epi32_mask(a.v,b.v));
+	}
+
+	static inline sint1 Less(const sint1 &a, const sint1 &b){
+		return SM_CMP(_mm512_cmplt_epi32_mask(a.v,b.v));
+	}
+
+#undef SM_CMP
+#else
+	static inline sint1 Equal(const sint1 &a, const sint1 &b){
+		return VL_EPI32(cmpeq)(a.v,b.v);
+	}
+
+	static inline sint1 Greater(const sint1 &a, const sint1 &b){
+		return VL_EPI32(cmpgt)(a.v,b.v);
 	}
 
 	//static inline sint1 GreaterOrEqual(const sint1 &a, const sint1 &b)...
 
 	static inline sint1 Less(const sint1 &a, const sint1 &b){
-		return _mm_cmplt_epi32(a.v,b.v);
+		return VL_EPI32(cmpgt)(b.v,a.v);
 	}
 
 	//static inline sint1 LessOrEqual(const sint1 &a, const sint1 &b)...
+#endif
 
 	static inline sint1 And(const sint1 &a, const sint1 &b){
-		return _mm_and_si128(a.v,b.v);
+		return VL_SI(and)(a.v,b.v);
 	}
 
 	static inline sint1 AndNot(const sint1 &a, const sint1 &b){
-		return _mm_andnot_si128(a.v,b.v);
+		return VL_SI(andnot)(a.v,b.v);
 	}
 
 	static inline sint1 Or(const sint1 &a, const sint1 &b){
-		return _mm_or_si128(a.v,b.v);
+		return VL_SI(or)(a.v,b.v);
+	}
+
+	static inline sint1 Xor(const sint1 &a, const sint1 &b){
+		return VL_SI(xor)(a.v,b.v);
 	}
 
 	static inline void store(int *pdst, const sint1 &s){
-		_mm_store_si128(reinterpret_cast<__m128i*>(pdst),s.v);
+		VL_SI(store)(reinterpret_cast<vintN*>(pdst),s.v);
 	}
 
 	static inline sint1 load(const int *psrc){
-		return _mm_load_si128(reinterpret_cast<const __m128i*>(psrc));
+		return VL_SI(load)(reinterpret_cast<const vintN*>(psrc));
 	}
 
 	static inline void store(dintN *pdst, const sint1 &s){
-		_mm_store_si128(reinterpret_cast<__m128i*>(pdst),s.v);
+		VL_SI(store)(reinterpret_cast<vintN*>(pdst),s.v);
 	}
 
 	static inline sint1 load(const dintN *psrc){
-		return _mm_load_si128(reinterpret_cast<const __m128i*>(psrc));
+		return VL_SI(load)(reinterpret_cast<const vintN*>(psrc));
 	}
 
-	__m128i v;
+	vintN v;
 };
 
 class sint4{
@@ -1295,10 +1536,10 @@ public:
 
 	sint4(const sint1 &n){
 		//replicate
-		v[0].v = IL_PERMUTE(n.v,_MM_SHUFFLE(0,0,0,0));
-		v[1].v = IL_PERMUTE(n.v,_MM_SHUFFLE(1,1,1,1));
-		v[2].v = IL_PERMUTE(n.v,_MM_SHUFFLE(2,2,2,2));
-		v[3].v = IL_PERMUTE(n.v,_MM_SHUFFLE(3,3,3,3));
+		v[0] = sint1(n.get<0>());
+		v[1] = sint1(n.get<1>());
+		v[2] = sint1(n.get<2>());
+		v[3] = sint1(n.get<3>());
 	}
 
 	sint4(const sfloat4 &s){
@@ -1366,11 +1607,11 @@ public:
 };
 
 inline sfloat1::sfloat1(const sint1 &s){
-	v = _mm_castsi128_ps(s.v);
+	v = VL_CASTSI_PS(s.v);
 }
 
 inline sint1::sint1(const sfloat1 &s){
-	v = _mm_castps_si128(s.v); //no conversion
+	v = VL_CASTPS_SI(s.v); //no conversion
 	//v = _mm_cvttps_epi32(s.v); //truncate
 }
 
@@ -1378,6 +1619,24 @@ inline dintN::dintN(const sint1 &s){
 	sint1::store(v,s);
 }
 
+inline sfloat1 sfloat1::gather(const float *pbase, const sint1 &idx, const sfloat1 &m){
+#if BLCLOUD_VSIZE == 16
+	return _mm512_mask_i32gather_ps(_mm512_setzero_ps(),(__mmask16)m.MoveMask(),idx.v,pbase,4);
+#elif BLCLOUD_VSIZE == 8
+	return _mm256_mask_i32gather_ps(_mm256_setzero_ps(),pbase,idx.v,m.v,4);
+#elif defined(USE_AVX2)
+	return _mm_mask_i32gather_ps(_mm_setzero_ps(),pbase,idx.v,m.v,4);
+#else
+	dintN I = dintN(idx);
+	dfloatN r = dfloatN(0.0f);
+	for(int b = m.MoveMask(); b != 0; b &= b-1){
+		uint i = __builtin_ctz(b);
+		r.v[i] = pbase[I.v[i]];
+	}
+	return sfloat1::load(&r);
+#endif
+}
+
 class matrix44{
 public:
 	matrix44(){}